@@ -0,0 +1,444 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compares streaming messages through a channel with oneway transactions, sent
+ * one per message or coalesced into batches.
+ *
+ * For each payload size, the client streams timestamped messages to a
+ * consumer, which measures their delivery latency; reported are messages/sec,
+ * p50/p99/p99.9 delivery latency and client-side ioctls per message.
+ *
+ * With a Binder device (`-d`), the consumer is a forked process that becomes
+ * the context manager; this needs a device without another context manager,
+ * such as a fresh binderfs instance. Without one, it runs in-process on
+ * `binder_emulator_backend`.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <linux/android/binder.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "binder.h"
+#include "channel.h"
+#include "threadpool.h"
+#include "util.h"
+
+#define DEFAULT_ITERATIONS 100000
+#define CHANNEL_CAPACITY (256 * 1024)
+#define MAP_SIZE (4 * 1024 * 1024)
+#define MAX_RETRIES 100000
+
+// Transaction codes of the consumer
+#define CODE_CHANNEL 1
+#define CODE_ONEWAY 2
+#define CODE_DONE 3
+#define CODE_BATCH 4
+
+static const size_t default_sizes[] = {16, 256, 4096};
+
+typedef enum { MODE_ONEWAY, MODE_BATCH, MODE_CHANNEL } bench_mode_t;
+
+static const char *const mode_names[] = {"oneway", "batch", "channel"};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define EMULATOR_DEVICE "channel_bench"
+
+static const binder_backend_t *backend = &binder_kernel_backend;
+static binder_backend_t counting_backend;
+static uint64_t ioctls;
+
+// Counts the ioctls issued by the client
+static int counting_ioctl(int fd, unsigned long request, void *arg) {
+  __atomic_fetch_add(&ioctls, 1, __ATOMIC_RELAXED);
+  return backend->ioctl(fd, request, arg);
+}
+
+typedef struct {
+  uint64_t count;
+  double p50, p99, p999;
+} bench_result_t;
+
+// The consumer's state, in the consumer process
+static uint64_t *latencies;
+static uint64_t latency_count, latency_capacity;
+static binder_channel_t *consumer_channel;
+static int result_fd;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(const void *data, size_t len) {
+  uint64_t sent, i;
+
+  if (len < sizeof(sent))
+    return;
+  memcpy(&sent, data, sizeof(sent));
+  i = __atomic_fetch_add(&latency_count, 1, __ATOMIC_RELAXED);
+  if (i < latency_capacity)
+    latencies[i] = now_ns() - sent;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t count, double p) {
+  return count ? sorted[(size_t)(p * (count - 1))] / 1000.0 : 0;
+}
+
+// Reports the latencies recorded since the last report to the client.
+static void report(void) {
+  bench_result_t result;
+  uint64_t count = __atomic_exchange_n(&latency_count, 0, __ATOMIC_RELAXED);
+
+  if (count > latency_capacity)
+    count = latency_capacity;
+  qsort(latencies, count, sizeof(*latencies), compare_u64);
+  result.count = count;
+  result.p50 = percentile_us(latencies, count, 0.5);
+  result.p99 = percentile_us(latencies, count, 0.99);
+  result.p999 = percentile_us(latencies, count, 0.999);
+  if (write(result_fd, &result, sizeof(result)) != sizeof(result))
+    ERR("Failed to report results");
+}
+
+static void on_message(const void *data, size_t len, void *arg) {
+  (void)arg;
+  record(data, len);
+}
+
+static void *consumer_thread(void *arg) {
+  binder_channel_t *ch = arg;
+
+  while (binder_channel_recv(ch, -1) > 0)
+    ;
+  report();
+  binder_channel_destroy(ch);
+  return NULL;
+}
+
+static int consumer_handler(binder_ctx *ctx, translated_data_t *txnin,
+                            translation_data_t *reply, void *arg) {
+  binder_batch_iter_t iter;
+  const void *data;
+  size_t len;
+  pthread_t thread;
+
+  (void)ctx;
+  (void)arg;
+
+  switch (txnin->code) {
+    case CODE_CHANNEL:
+      if (binder_channel_op(txnin) == BINDER_CHANNEL_OP_MESSAGE)
+        return binder_channel_handle_txn(consumer_channel, txnin);
+      consumer_channel =
+          binder_channel_accept(txnin, reply, on_message, NULL);
+      if (!consumer_channel
+          || pthread_create(&thread, NULL, consumer_thread, consumer_channel))
+        return -EINVAL;
+      pthread_detach(thread);
+      return 0;
+    case CODE_ONEWAY:
+      record(txnin->data, txnin->data_avail);
+      return 0;
+    case CODE_BATCH:
+      if (binder_batch_iter_init(&iter, txnin) < 0)
+        return -EINVAL;
+      while ((data = binder_batch_iter_next(&iter, &len)))
+        record(data, len);
+      return 0;
+    case CODE_DONE:
+      report();
+      return 0;
+    default:
+      return -EINVAL;
+  }
+}
+
+static int consumer_start(const char *device, uint64_t iterations) {
+  binder_open_opts_t opts = {.map_size = MAP_SIZE, .backend = backend};
+  binder_ctx *ctx;
+
+  latency_capacity = iterations;
+  latencies = malloc(iterations * sizeof(*latencies));
+  ctx = binder_open_ex(device, &opts);
+  // Channel setups and memfd blobs carry file descriptors
+  if (!latencies || !ctx
+      || binder_set_context_manager_ext(ctx, 0, FLAT_BINDER_FLAG_ACCEPTS_FDS)
+             < 0
+      || !binder_threadpool_start(ctx, 2, consumer_handler, NULL)) {
+    ERR("Failed to start the consumer on %s", device);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Forks the consumer. Returns its pid once it is ready to receive
+ * transactions, or -1.
+ */
+static pid_t consumer_fork(const char *device, uint64_t iterations) {
+  int fds[2];
+  pid_t pid;
+  char ready;
+
+  if (pipe(fds) < 0)
+    return -1;
+
+  pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  if (!pid) {
+    close(fds[0]);
+    if (consumer_start(device, iterations) < 0)
+      _exit(1);
+    if (write(fds[1], "", 1) != 1)
+      _exit(1);
+    for (;;)
+      pause();
+  }
+
+  close(fds[1]);
+  if (read(fds[0], &ready, 1) != 1) {
+    ERR("Failed to start the consumer on %s", device);
+    waitpid(pid, NULL, 0);
+    pid = -1;
+  }
+  close(fds[0]);
+  return pid;
+}
+
+static int send_oneway(binder_ctx *ctx, translation_data_t *trdata) {
+  int ret = -1, retries;
+
+  // The consumer may run out of buffer space when transactions pile up
+  for (retries = 0; retries < MAX_RETRIES; retries++) {
+    ret = binder_transact(ctx, 0, CODE_ONEWAY, TF_ONE_WAY, trdata, NULL);
+    if (ret == 0)
+      break;
+    usleep(100);
+  }
+  return ret;
+}
+
+// Same as `send_oneway` for batches; a NULL `payload` flushes the batch
+static int send_batch(binder_ctx *ctx, binder_batch_t *batch,
+                      const uint8_t *payload, size_t size) {
+  int ret = -1, retries;
+
+  for (retries = 0; retries < MAX_RETRIES; retries++) {
+    ret = payload ? binder_batch_add(batch, ctx, payload, size)
+                  : binder_batch_flush(batch, ctx);
+    if (ret == 0)
+      break;
+    usleep(100);
+  }
+  return ret;
+}
+
+static int bench_run(binder_ctx *ctx, int results, bench_mode_t mode,
+                     size_t size, uint64_t iterations, uint8_t *payload) {
+  translation_data_t trdata;
+  translated_data_t reply;
+  binder_channel_t *ch = NULL;
+  binder_batch_t *batch = NULL;
+  bench_result_t result;
+  uint64_t i, sent, start, elapsed, start_ioctls;
+  int ret = -1;
+
+  trdata_init(&trdata);
+  if (mode == MODE_CHANNEL) {
+    ch = binder_channel_connect(ctx, 0, CODE_CHANNEL, CHANNEL_CAPACITY);
+    if (!ch)
+      goto out;
+  } else if (mode == MODE_BATCH) {
+    batch = binder_batch_create(0, CODE_BATCH, NULL);
+    if (!batch)
+      goto out;
+  }
+
+  start_ioctls = __atomic_load_n(&ioctls, __ATOMIC_RELAXED);
+  start = now_ns();
+  for (i = 0; i < iterations; i++) {
+    sent = now_ns();
+    memcpy(payload, &sent, sizeof(sent));
+    if (mode == MODE_CHANNEL) {
+      ret = binder_channel_send(ch, ctx, payload, size);
+    } else if (mode == MODE_BATCH) {
+      ret = send_batch(ctx, batch, payload, size);
+    } else {
+      trdata_reset(&trdata);
+      trdata_put_bytes(&trdata, (const char *)payload, size);
+      ret = send_oneway(ctx, &trdata);
+    }
+    if (ret < 0)
+      goto out;
+  }
+  if (mode == MODE_BATCH && send_batch(ctx, batch, NULL, 0) < 0)
+    goto out;
+
+  // Closing the channel, or the two-way transaction queued behind the oneway
+  // ones, makes the consumer report once it received every message
+  if (mode == MODE_CHANNEL) {
+    binder_channel_destroy(ch);
+    ch = NULL;
+  } else {
+    trdata_reset(&trdata);
+    ret = binder_transact(ctx, 0, CODE_DONE, 0, &trdata, &reply);
+    if (ret < 0)
+      goto out;
+    binder_free_buffer(ctx, (binder_uintptr_t)reply.data);
+  }
+  ret = -1;
+  if (read(results, &result, sizeof(result)) != sizeof(result))
+    goto out;
+  elapsed = now_ns() - start;
+
+  // Figures are per delivered message: failed sends and flushes, retried
+  // above, only add to the time and ioctls they cost
+  if (result.count < iterations)
+    LOG("%s: only %llu of %llu messages delivered", mode_names[mode],
+        (unsigned long long)result.count, (unsigned long long)iterations);
+  LOG("%-7s %8zu %12.0f %9.2f %9.2f %9.2f %10.3f",
+      mode_names[mode], size, result.count * 1e9 / elapsed,
+      result.p50, result.p99, result.p999,
+      result.count ? (double)(__atomic_load_n(&ioctls, __ATOMIC_RELAXED)
+                              - start_ioctls)
+                         / result.count
+                   : 0);
+  ret = 0;
+
+out:
+  if (ret < 0)
+    ERR("Benchmark failed");
+  binder_channel_destroy(ch);
+  binder_batch_destroy(batch, ctx);
+  trdata_release(&trdata);
+  return ret;
+}
+
+static void usage(const char *name) {
+  LOG("Usage: %s [-d device] [-n iterations] [-s size]", name);
+}
+
+int main(int argc, char **argv) {
+  binder_open_opts_t opts = {.map_size = MAP_SIZE};
+  const size_t *sizes = default_sizes;
+  size_t nsizes = ARRAY_SIZE(default_sizes);
+  size_t size_arg, max_size = 0, s;
+  uint64_t iterations = DEFAULT_ITERATIONS;
+  const char *device = NULL;
+  binder_ctx *ctx = NULL;
+  uint8_t *payload;
+  bench_mode_t mode;
+  pid_t consumer = -1;
+  int fds[2], opt, ret = 0;
+
+  while ((opt = getopt(argc, argv, "d:n:s:")) != -1) {
+    switch (opt) {
+      case 'd':
+        device = optarg;
+        break;
+      case 'n':
+        iterations = strtoull(optarg, NULL, 0);
+        break;
+      case 's':
+        size_arg = strtoull(optarg, NULL, 0);
+        sizes = &size_arg;
+        nsizes = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  for (s = 0; s < nsizes; s++) {
+    if (sizes[s] > max_size)
+      max_size = sizes[s];
+  }
+  if (!iterations || sizes[0] < sizeof(uint64_t)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (pipe(fds) < 0)
+    return 1;
+  result_fd = fds[1];
+
+  if (device) {
+    consumer = consumer_fork(device, iterations);
+    if (consumer < 0)
+      return 1;
+  } else {
+    device = EMULATOR_DEVICE;
+    backend = &binder_emulator_backend;
+    if (consumer_start(device, iterations) < 0)
+      return 1;
+  }
+  LOG("Running against %s",
+      consumer < 0 ? "the userspace emulator" : device);
+
+  counting_backend = *backend;
+  counting_backend.ioctl = counting_ioctl;
+  opts.backend = &counting_backend;
+
+  payload = calloc(1, max_size);
+  ctx = binder_open_ex(device, &opts);
+  if (!payload || !ctx) {
+    ret = 1;
+    goto out;
+  }
+
+  LOG("%-7s %8s %12s %9s %9s %9s %10s", "mode", "size", "msgs/s", "p50(us)",
+      "p99(us)", "p99.9(us)", "ioctls/msg");
+  for (s = 0; s < nsizes; s++) {
+    for (mode = MODE_ONEWAY; mode <= MODE_CHANNEL; mode++) {
+      if (bench_run(ctx, fds[0], mode, sizes[s], iterations, payload) < 0) {
+        ret = 1;
+        goto out;
+      }
+    }
+  }
+
+out:
+  if (ctx)
+    binder_close(ctx);
+  free(payload);
+  if (consumer > 0) {
+    kill(consumer, SIGKILL);
+    waitpid(consumer, NULL, 0);
+  }
+  return ret;
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fake_driver.h"
+
+#include <sys/types.h>
+#include <errno.h>
+#include <linux/android/binder.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#ifdef __BIONIC__
+typedef int ioctl_request_t;
+#else
+typedef unsigned long ioctl_request_t;
+#endif
+
+void *__real_mmap(void *addr, size_t length, int prot, int flags, int fd,
+                  off_t offset);
+int __real_ioctl(int fd, ioctl_request_t request, ...);
+
+fake_driver_stats_t fake_driver_stats;
+
+static int fake_fd = -1;
+static void *fake_map;
+static size_t fake_map_size;
+
+static __thread uint32_t pending_complete;
+static __thread uint32_t pending_reply;
+
+static bool is_fake_device(int fd) {
+  struct stat st;
+
+  if (fstat(fd, &st) < 0)
+    return false;
+
+  return S_ISCHR(st.st_mode) && st.st_rdev == makedev(1, 3);
+}
+
+void *__wrap_mmap(void *addr, size_t length, int prot, int flags, int fd,
+                  off_t offset) {
+  if (fd < 0 || !is_fake_device(fd))
+    return __real_mmap(addr, length, prot, flags, fd, offset);
+
+  fake_map = __real_mmap(addr, length, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (fake_map != MAP_FAILED) {
+    fake_fd = fd;
+    fake_map_size = length;
+  }
+
+  return fake_map;
+}
+
+static void stats_add(uint64_t *counter, uint64_t n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// Charges the copy the driver makes into the target's buffer
+static void fake_copy(const struct binder_transaction_data *tr) {
+  size_t size = tr->data_size;
+
+  if (size > fake_map_size)
+    size = fake_map_size;
+  memcpy(fake_map, (const void *)(uintptr_t)tr->data.ptr.buffer, size);
+}
+
+static void fake_write(struct binder_write_read *bwr) {
+  uint8_t *ptr = (uint8_t *)bwr->write_buffer + bwr->write_consumed;
+  uint8_t *end = (uint8_t *)bwr->write_buffer + bwr->write_size;
+  struct binder_transaction_data *tr;
+  uint32_t cmd;
+
+  while (ptr < end) {
+    cmd = *(uint32_t *)ptr;
+    ptr += sizeof(cmd);
+    switch (cmd) {
+      case BC_TRANSACTION:
+      case BC_TRANSACTION_SG:
+        tr = (struct binder_transaction_data *)ptr;
+        fake_copy(tr);
+        pending_complete++;
+        if (!(tr->flags & TF_ONE_WAY))
+          pending_reply++;
+        break;
+      case BC_REPLY:
+      case BC_REPLY_SG:
+        fake_copy((struct binder_transaction_data *)ptr);
+        pending_complete++;
+        break;
+      default:
+        break;
+    }
+    ptr += _IOC_SIZE(cmd);
+  }
+
+  stats_add(&fake_driver_stats.write_bytes,
+            bwr->write_size - bwr->write_consumed);
+  bwr->write_consumed = bwr->write_size;
+}
+
+static int fake_read(struct binder_write_read *bwr) {
+  uint8_t *ptr = (uint8_t *)bwr->read_buffer + bwr->read_consumed;
+  uint8_t *end = (uint8_t *)bwr->read_buffer + bwr->read_size;
+  struct binder_transaction_data tr = {0};
+  uint32_t cmd;
+
+  if (!pending_complete && !pending_reply) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  cmd = BR_NOOP;
+  memcpy(ptr, &cmd, sizeof(cmd));
+  ptr += sizeof(cmd);
+
+  while (pending_complete && (size_t)(end - ptr) >= sizeof(cmd)) {
+    cmd = BR_TRANSACTION_COMPLETE;
+    memcpy(ptr, &cmd, sizeof(cmd));
+    ptr += sizeof(cmd);
+    pending_complete--;
+  }
+
+  if (!pending_complete && pending_reply
+      && (size_t)(end - ptr) >= sizeof(cmd) + sizeof(tr)) {
+    cmd = BR_REPLY;
+    tr.data.ptr.buffer = (binder_uintptr_t)fake_map;
+    memcpy(ptr, &cmd, sizeof(cmd));
+    memcpy(ptr + sizeof(cmd), &tr, sizeof(tr));
+    ptr += sizeof(cmd) + sizeof(tr);
+    pending_reply--;
+  }
+
+  stats_add(&fake_driver_stats.read_bytes,
+            ptr - ((uint8_t *)bwr->read_buffer + bwr->read_consumed));
+  bwr->read_consumed = ptr - (uint8_t *)bwr->read_buffer;
+  return 0;
+}
+
+int __wrap_ioctl(int fd, ioctl_request_t request, ...) {
+  va_list ap;
+  void *arg;
+
+  va_start(ap, request);
+  arg = va_arg(ap, void *);
+  va_end(ap);
+
+  stats_add(&fake_driver_stats.ioctls, 1);
+
+  if (fd != fake_fd)
+    return __real_ioctl(fd, request, arg);
+
+  switch (request) {
+    case BINDER_WRITE_READ: {
+      struct binder_write_read *bwr = arg;
+      fake_write(bwr);
+      if (bwr->read_size)
+        return fake_read(bwr);
+      return 0;
+    }
+    case BINDER_VERSION:
+      ((struct binder_version *)arg)->protocol_version =
+          BINDER_CURRENT_PROTOCOL_VERSION;
+      return 0;
+    default:
+      return 0;
+  }
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FAKE_DRIVER_H_
+#define FAKE_DRIVER_H_
+
+#include <stdint.h>
+
+/*
+ * A minimal stand-in for the binder driver, so that the library can be
+ * benchmarked on hosts without it. Link with
+ * `-Wl,--wrap=mmap,--wrap=ioctl` and open `FAKE_DRIVER_DEVICE` with
+ * `binder_open`.
+ *
+ * Every command in the write half is consumed, and the data of transactions and
+ * replies is copied into the mapping as the driver would do for the target.
+ * The read half reports a `BR_TRANSACTION_COMPLETE` per transaction or reply,
+ * and an empty `BR_REPLY` per two-way transaction. Reads with nothing to report
+ * fail with `EAGAIN` instead of blocking.
+ *
+ * Other devices are passed through to the real `mmap` and `ioctl`.
+ * `fake_driver_stats.ioctls` counts the calls made on every file descriptor;
+ * all counters are updated atomically.
+ */
+#define FAKE_DRIVER_DEVICE "/dev/null"
+
+typedef struct {
+  uint64_t ioctls;
+  uint64_t write_bytes;
+  uint64_t read_bytes;
+} fake_driver_stats_t;
+
+extern fake_driver_stats_t fake_driver_stats;
+
+#endif  // FAKE_DRIVER_H_
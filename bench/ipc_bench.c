@@ -0,0 +1,421 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures end-to-end transaction throughput and latency.
+ *
+ * Sweeps oneway and two-way transactions over payload sizes, client thread
+ * counts and the number of binder objects carried per transaction, and reports
+ * ops/sec, p50/p99/p99.9 latency and client-side ioctls per op.
+ *
+ * With a Binder device (`-d`, or `/dev/binder` and `/dev/binderfs/binder` when
+ * accessible), a forked server process becomes the context manager and replies
+ * to every transaction from a thread pool; this needs a device without another
+ * context manager, such as a fresh binderfs instance. Without one, the server
+ * runs in-process on `binder_emulator_backend`.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <linux/android/binder.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "binder.h"
+#include "threadpool.h"
+#include "util.h"
+
+#define DEFAULT_ITERATIONS 10000
+#define MIN_ITERATIONS 1000
+// Caps the bytes sent per thread and configuration for large payloads
+#define BYTES_BUDGET (1UL << 30)
+#define MAP_SIZE (4 * 1024 * 1024)
+#define MAX_RETRIES 100000
+
+static const size_t default_sizes[] = {16, 256, 4096, 65536, 524288};
+static const int default_threads[] = {1, 2, 4};
+static const int default_objects[] = {0, 1, 8};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static const char *const devices[] = {"/dev/binder", "/dev/binderfs/binder"};
+
+#define EMULATOR_DEVICE "ipc_bench"
+
+static const binder_backend_t *backend = &binder_kernel_backend;
+static binder_backend_t counting_backend;
+static uint64_t ioctls;
+
+// Counts the ioctls issued by the clients
+static int counting_ioctl(int fd, unsigned long request, void *arg) {
+  __atomic_fetch_add(&ioctls, 1, __ATOMIC_RELAXED);
+  return backend->ioctl(fd, request, arg);
+}
+
+typedef struct {
+  bool oneway;
+  size_t size;
+  int threads;
+  int objects;
+  uint64_t iterations;
+} bench_config_t;
+
+typedef struct {
+  pthread_t thread;
+  binder_ctx *root;
+  const bench_config_t *config;
+  uint64_t *latencies;
+  uint8_t *payload;
+  int ret;
+} bench_thread_t;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int reply_handler(binder_ctx *ctx, translated_data_t *txnin,
+                         translation_data_t *reply, void *arg) {
+  (void)ctx;
+  (void)txnin;
+  (void)reply;
+  (void)arg;
+  return 0;
+}
+
+/*
+ * Forks a server that becomes the context manager of `device`. Returns its pid
+ * once it is ready to receive transactions, or -1.
+ */
+static pid_t server_start(const char *device, int max_threads) {
+  binder_open_opts_t opts = {.map_size = MAP_SIZE};
+  binder_threadpool_t *pool;
+  binder_ctx *ctx;
+  int fds[2];
+  pid_t pid;
+  char ready;
+
+  if (pipe(fds) < 0)
+    return -1;
+
+  pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  if (!pid) {
+    close(fds[0]);
+    ctx = binder_open_ex(device, &opts);
+    if (!ctx || binder_set_context_manager(ctx) < 0)
+      _exit(1);
+    pool = binder_threadpool_start(ctx, max_threads, reply_handler, NULL);
+    if (!pool)
+      _exit(1);
+    if (write(fds[1], "", 1) != 1)
+      _exit(1);
+    binder_threadpool_join(pool);
+    _exit(0);
+  }
+
+  close(fds[1]);
+  if (read(fds[0], &ready, 1) != 1) {
+    ERR("Failed to start the server on %s", device);
+    waitpid(pid, NULL, 0);
+    pid = -1;
+  }
+  close(fds[0]);
+  return pid;
+}
+
+/*
+ * Starts an in-process server on the emulator. It is torn down with the
+ * process.
+ */
+static int emulator_server_start(int max_threads) {
+  binder_open_opts_t opts = {.map_size = MAP_SIZE, .backend = backend};
+  binder_ctx *ctx;
+
+  ctx = binder_open_ex(EMULATOR_DEVICE, &opts);
+  if (!ctx || binder_set_context_manager(ctx) < 0
+      || !binder_threadpool_start(ctx, max_threads, reply_handler, NULL)) {
+    ERR("Failed to start the emulated server");
+    return -1;
+  }
+  return 0;
+}
+
+static void *bench_thread(void *arg) {
+  bench_thread_t *t = arg;
+  const bench_config_t *config = t->config;
+  uint32_t flags = config->oneway ? TF_ONE_WAY : 0;
+  translated_data_t reply;
+  translation_data_t trdata;
+  binder_ctx *ctx;
+  uint64_t i, start;
+  int ret, retries, obj;
+
+  t->ret = -1;
+  ctx = binder_ctx_clone(t->root);
+  if (!ctx)
+    return NULL;
+
+  trdata_init(&trdata);
+  for (obj = 0; obj < config->objects; obj++)
+    trdata_put_binder(&trdata, (binder_uintptr_t)&t->payload[obj], true);
+  trdata_put_bytes(&trdata, (const char *)t->payload, config->size);
+
+  for (i = 0; i < config->iterations; i++) {
+    start = now_ns();
+    // The server may run out of buffer space when oneway transactions pile up
+    for (retries = 0; retries < MAX_RETRIES; retries++) {
+      ret = binder_transact(ctx, 0, 0, flags, &trdata, &reply);
+      if (ret == 0)
+        break;
+      usleep(100);
+    }
+    if (ret < 0)
+      goto out;
+    if (!config->oneway)
+      binder_free_buffer(ctx, (binder_uintptr_t)reply.data);
+    t->latencies[i] = now_ns() - start;
+  }
+
+  t->ret = binder_flush(ctx);
+
+out:
+  trdata_release(&trdata);
+  binder_close(ctx);
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t count, double p) {
+  return sorted[(size_t)(p * (count - 1))] / 1000.0;
+}
+
+static int bench_run(binder_ctx *root, const bench_config_t *config,
+                     uint8_t *payload) {
+  bench_thread_t *threads;
+  uint64_t *latencies, start, elapsed, start_ioctls, count_ioctls;
+  size_t count = config->threads * config->iterations;
+  int i, ret = 0;
+  bool failed = false;
+
+  threads = calloc(config->threads, sizeof(*threads));
+  latencies = malloc(count * sizeof(*latencies));
+  if (!threads || !latencies) {
+    ret = -1;
+    goto out;
+  }
+
+  start_ioctls = __atomic_load_n(&ioctls, __ATOMIC_RELAXED);
+  start = now_ns();
+  for (i = 0; i < config->threads; i++) {
+    threads[i].root = root;
+    threads[i].config = config;
+    threads[i].latencies = latencies + i * config->iterations;
+    threads[i].payload = payload;
+    if (pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i])) {
+      ERR("Failed to create thread");
+      failed = true;
+      break;
+    }
+  }
+  while (i--) {
+    pthread_join(threads[i].thread, NULL);
+    if (threads[i].ret < 0)
+      failed = true;
+  }
+  elapsed = now_ns() - start;
+  count_ioctls = __atomic_load_n(&ioctls, __ATOMIC_RELAXED) - start_ioctls;
+
+  if (failed) {
+    ERR("Benchmark failed");
+    ret = -1;
+    goto out;
+  }
+
+  qsort(latencies, count, sizeof(*latencies), compare_u64);
+  LOG("%-7s %8zu %4d %4d %12.0f %9.2f %9.2f %9.2f %10.3f",
+      config->oneway ? "oneway" : "two-way", config->size, config->threads,
+      config->objects, count * 1e9 / elapsed,
+      percentile_us(latencies, count, 0.5),
+      percentile_us(latencies, count, 0.99),
+      percentile_us(latencies, count, 0.999), (double)count_ioctls / count);
+
+out:
+  free(latencies);
+  free(threads);
+  return ret;
+}
+
+static const char *find_device(void) {
+  size_t i;
+
+  for (i = 0; i < ARRAY_SIZE(devices); i++) {
+    if (access(devices[i], R_OK | W_OK) == 0)
+      return devices[i];
+  }
+  return NULL;
+}
+
+static void usage(const char *name) {
+  LOG("Usage: %s [-d device] [-n iterations] [-s size] [-t threads] "
+      "[-o objects]",
+      name);
+}
+
+int main(int argc, char **argv) {
+  binder_open_opts_t opts = {.map_size = MAP_SIZE};
+  const size_t *sizes = default_sizes;
+  const int *threads = default_threads, *objects = default_objects;
+  size_t nsizes = ARRAY_SIZE(default_sizes);
+  size_t nthreads = ARRAY_SIZE(default_threads);
+  size_t nobjects = ARRAY_SIZE(default_objects);
+  size_t size_arg;
+  size_t max_size = 0;
+  int threads_arg, objects_arg, max_threads = 0, max_objects = 0;
+  int opt, ret = 0;
+  uint64_t iterations = DEFAULT_ITERATIONS;
+  const char *device = NULL;
+  bench_config_t config;
+  uint8_t *payload;
+  binder_ctx *ctx;
+  pid_t server = -1;
+  size_t s, t, o;
+  int mode;
+
+  while ((opt = getopt(argc, argv, "d:n:s:t:o:")) != -1) {
+    switch (opt) {
+      case 'd':
+        device = optarg;
+        break;
+      case 'n':
+        iterations = strtoull(optarg, NULL, 0);
+        break;
+      case 's':
+        size_arg = strtoull(optarg, NULL, 0);
+        sizes = &size_arg;
+        nsizes = 1;
+        break;
+      case 't':
+        threads_arg = atoi(optarg);
+        threads = &threads_arg;
+        nthreads = 1;
+        break;
+      case 'o':
+        objects_arg = atoi(optarg);
+        objects = &objects_arg;
+        nobjects = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (!iterations || threads[0] <= 0 || objects[0] < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  for (s = 0; s < nsizes; s++) {
+    if (sizes[s] > max_size)
+      max_size = sizes[s];
+  }
+  for (t = 0; t < nthreads; t++) {
+    if (threads[t] > max_threads)
+      max_threads = threads[t];
+  }
+  for (o = 0; o < nobjects; o++) {
+    if (objects[o] > max_objects)
+      max_objects = objects[o];
+  }
+
+  if (!device)
+    device = find_device();
+  if (device) {
+    server = server_start(device, max_threads);
+    if (server < 0)
+      return 1;
+  } else {
+    device = EMULATOR_DEVICE;
+    backend = &binder_emulator_backend;
+    if (emulator_server_start(max_threads) < 0)
+      return 1;
+  }
+  LOG("Running against %s",
+      server < 0 ? "the userspace emulator" : device);
+
+  counting_backend = *backend;
+  counting_backend.ioctl = counting_ioctl;
+  opts.backend = &counting_backend;
+
+  // Binder objects point into the payload so that they are distinct nodes
+  payload = calloc(1, max_size + max_objects);
+  ctx = binder_open_ex(device, &opts);
+  if (!payload || !ctx) {
+    ret = 1;
+    goto out;
+  }
+
+  LOG("%-7s %8s %4s %4s %12s %9s %9s %9s %10s", "mode", "size", "thr",
+      "objs", "ops/s", "p50(us)", "p99(us)", "p99.9(us)", "ioctls/op");
+  for (mode = 0; mode < 2; mode++) {
+    for (s = 0; s < nsizes; s++) {
+      for (t = 0; t < nthreads; t++) {
+        for (o = 0; o < nobjects; o++) {
+          config.oneway = !mode;
+          config.size = sizes[s];
+          config.threads = threads[t];
+          config.objects = objects[o];
+          config.iterations = iterations;
+          if (config.size * config.iterations > BYTES_BUDGET)
+            config.iterations = BYTES_BUDGET / config.size;
+          if (config.iterations < MIN_ITERATIONS && iterations > MIN_ITERATIONS)
+            config.iterations = MIN_ITERATIONS;
+
+          if (bench_run(ctx, &config, payload) < 0) {
+            ret = 1;
+            goto out;
+          }
+        }
+      }
+    }
+  }
+
+out:
+  if (ctx)
+    binder_close(ctx);
+  free(payload);
+  if (server > 0) {
+    kill(server, SIGKILL);
+    waitpid(server, NULL, 0);
+  }
+  return ret;
+}
@@ -0,0 +1,409 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures the CPU cost of the userspace marshalling and parsing code over
+ * realistic parcel and command shapes, reporting cycles/op, ns/op and bytes/s.
+ *
+ * Command parsing runs through `binder_recv_txn` on a prefilled read buffer,
+ * so the only ioctls are the occasional flushes of queued commands, which the
+ * fake driver absorbs. Cycles come from the TSC on x86 and from the virtual
+ * counter on arm64, which ticks at a fixed frequency rather than the CPU
+ * clock.
+ */
+
+#include <sys/types.h>
+#include <linux/android/binder.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "binder.h"
+#include "fake_driver.h"
+#include "util.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define BULK_SIZE 4096
+#define STR_SIZE 1024
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef struct {
+  const char *name;
+  // Runs one operation and returns the number of bytes it processed
+  size_t (*run)(void);
+  void (*setup)(void);
+} bench_case_t;
+
+static binder_ctx *ctx;
+static buf_t wbuf;
+static buf_t rbuf;
+static translation_data_t trdata;
+static translation_data_t small_parcel;
+static translation_data_t mixed_parcel;
+static translation_data_t str16_parcel;
+static uint8_t bulk[BULK_SIZE];
+static char ascii_str[STR_SIZE + 1];
+static char intl_str[STR_SIZE + 1];
+static char str_out[STR_SIZE + 1];
+static uint8_t cmds[512];
+static size_t cmds_size;
+static volatile uint64_t sink;
+
+static uint64_t read_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t cycles;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(cycles));
+  return cycles;
+#else
+  return 0;
+#endif
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The shape of a `getService` call to the service manager
+static void put_small(translation_data_t *t) {
+  trdata_put_u32(t, 0x100);
+  trdata_put_str16(t, "android.os.IServiceManager");
+  trdata_put_str16(t, "media.player");
+}
+
+static void put_mixed(translation_data_t *t) {
+  int i;
+
+  for (i = 0; i < 8; i++)
+    trdata_put_u32(t, i);
+  trdata_put_handle(t, 1, true);
+  trdata_put_binder(t, (binder_uintptr_t)&trdata, true);
+  trdata_put_bytes(t, (const char *)bulk, 64);
+}
+
+static size_t run_buf_write_u32(void) {
+  int i;
+
+  buf_reset_write(&wbuf);
+  for (i = 0; i < 64; i++)
+    buf_write_u32(&wbuf, i);
+  return wbuf.size;
+}
+
+static size_t run_buf_write_tr(void) {
+  struct binder_transaction_data tr = {0};
+  int i;
+
+  buf_reset_write(&wbuf);
+  for (i = 0; i < 4; i++) {
+    buf_write_u32(&wbuf, BC_TRANSACTION);
+    buf_write(&wbuf, &tr, sizeof(tr));
+  }
+  return wbuf.size;
+}
+
+static size_t run_buf_read_u32(void) {
+  uint64_t sum = 0;
+  int i;
+
+  rbuf.ptr = rbuf.buffer;
+  for (i = 0; i < 64; i++)
+    sum += buf_read_u32(&rbuf);
+  sink = sum;
+  return 64 * sizeof(uint32_t);
+}
+
+static size_t run_buf_read_tr(void) {
+  struct binder_transaction_data tr;
+  int i;
+
+  rbuf.ptr = rbuf.buffer;
+  for (i = 0; i < 4; i++) {
+    sink = buf_read_u32(&rbuf);
+    buf_read_transaction_data(&rbuf, &tr);
+  }
+  sink = tr.code;
+  return 4 * (sizeof(uint32_t) + sizeof(tr));
+}
+
+static size_t run_trdata_small(void) {
+  trdata_reset(&trdata);
+  put_small(&trdata);
+  return trdata.data_ptr - trdata.data;
+}
+
+static size_t run_trdata_mixed(void) {
+  trdata_reset(&trdata);
+  put_mixed(&trdata);
+  return trdata.data_ptr - trdata.data;
+}
+
+static size_t run_trdata_bulk(void) {
+  trdata_reset(&trdata);
+  trdata_put_bytes(&trdata, (const char *)bulk, sizeof(bulk));
+  return trdata.data_ptr - trdata.data;
+}
+
+static void init_txnin(translated_data_t *txnin, translation_data_t *t) {
+  struct binder_transaction_data tr = {0};
+
+  tr.data.ptr.buffer = (binder_uintptr_t)t->data;
+  tr.data.ptr.offsets = (binder_uintptr_t)t->offs;
+  tr.data_size = t->data_ptr - t->data;
+  tr.offsets_size = (t->offs_ptr - t->offs) * sizeof(binder_size_t);
+  txnin_init(txnin, &tr);
+}
+
+static void pop_str16(translated_data_t *txnin) {
+  size_t len;
+
+  sink = (uintptr_t)txnin_pop_str16(txnin, &len);
+}
+
+static size_t run_txnin_small(void) {
+  translated_data_t txnin;
+
+  init_txnin(&txnin, &small_parcel);
+  sink = txnin_pop_i32(&txnin);
+  pop_str16(&txnin);
+  pop_str16(&txnin);
+  return txnin.data_ptr - txnin.data;
+}
+
+static size_t run_txnin_mixed(void) {
+  translated_data_t txnin;
+  int i;
+
+  init_txnin(&txnin, &mixed_parcel);
+  for (i = 0; i < 8; i++)
+    sink = txnin_pop_u32(&txnin);
+  sink = txnin_pop_handle(&txnin);
+  sink = (uintptr_t)txnin_pop_object(&txnin, BINDER_TYPE_BINDER);
+  sink = (uintptr_t)txnin_pop(&txnin, 64);
+  return txnin.data_ptr - txnin.data;
+}
+
+// The widening loop `trdata_put_str16` had before the conversion to UTF-16
+// was vectorised, kept as a baseline. It only handles ASCII correctly.
+static void put_str16_bytewise(translation_data_t *t, const char *str) {
+  size_t i, len;
+  uint16_t *ptr;
+
+  len = strlen(str);
+  trdata_put_u32(t, len);
+  ptr = trdata_alloc(t, (len + 1) * 2, false);
+  if (!ptr)
+    return;
+
+  for (i = 0; i < len; i++)
+    ptr[i] = str[i];
+  ptr[len] = '\0';
+}
+
+static size_t run_str16_bytewise_short(void) {
+  trdata_reset(&trdata);
+  put_str16_bytewise(&trdata, "android.os.IServiceManager");
+  return 26;
+}
+
+static size_t run_str16_short(void) {
+  trdata_reset(&trdata);
+  trdata_put_str16(&trdata, "android.os.IServiceManager");
+  return 26;
+}
+
+static size_t run_str16_bytewise_ascii(void) {
+  trdata_reset(&trdata);
+  put_str16_bytewise(&trdata, ascii_str);
+  return STR_SIZE;
+}
+
+static size_t run_str16_ascii(void) {
+  trdata_reset(&trdata);
+  trdata_put_str16(&trdata, ascii_str);
+  return STR_SIZE;
+}
+
+static size_t run_str16_intl(void) {
+  trdata_reset(&trdata);
+  trdata_put_str16(&trdata, intl_str);
+  return STR_SIZE;
+}
+
+static size_t run_txnin_str16_utf8(void) {
+  translated_data_t txnin;
+
+  init_txnin(&txnin, &str16_parcel);
+  sink = (uintptr_t)txnin_pop_str16_utf8(&txnin, str_out, sizeof(str_out));
+  return STR_SIZE;
+}
+
+static size_t recv_cmds(void) {
+  translated_data_t txnin;
+  buf_t *in = &ctx->in;
+
+  buf_reset_write(in);
+  buf_write(in, cmds, cmds_size);
+  in->ptr = in->buffer;
+
+  if (binder_recv_txn(ctx, &txnin) < 0)
+    exit(1);
+  binder_free_buffer(ctx, (binder_uintptr_t)txnin.data);
+  return cmds_size;
+}
+
+static void put_cmd(uint32_t cmd, const void *data, size_t size) {
+  memcpy(cmds + cmds_size, &cmd, sizeof(cmd));
+  memcpy(cmds + cmds_size + sizeof(cmd), data, size);
+  cmds_size += sizeof(cmd) + size;
+}
+
+static void put_transaction(void) {
+  struct binder_transaction_data tr = {0};
+
+  tr.data.ptr.buffer = (binder_uintptr_t)ctx->map_ptr;
+  tr.data_size = 64;
+  put_cmd(BR_TRANSACTION, &tr, sizeof(tr));
+}
+
+// A transaction as read by an idle looper
+static size_t run_skip_cmds_txn(void) {
+  if (!cmds_size) {
+    put_cmd(BR_NOOP, NULL, 0);
+    put_transaction();
+  }
+  return recv_cmds();
+}
+
+// Reference count requests and completions ahead of the transaction
+static size_t run_skip_cmds_mixed(void) {
+  struct binder_ptr_cookie ref = {0};
+
+  if (!cmds_size) {
+    put_cmd(BR_NOOP, NULL, 0);
+    put_cmd(BR_TRANSACTION_COMPLETE, NULL, 0);
+    put_cmd(BR_INCREFS, &ref, sizeof(ref));
+    put_cmd(BR_ACQUIRE, &ref, sizeof(ref));
+    put_cmd(BR_NOOP, NULL, 0);
+    put_transaction();
+  }
+  return recv_cmds();
+}
+
+static void reset_cmds(void) { cmds_size = 0; }
+
+static const bench_case_t cases[] = {
+    {.name = "buf_write_u32 (x64)", .run = run_buf_write_u32},
+    {.name = "buf_write (4 transactions)", .run = run_buf_write_tr},
+    {.name = "buf_read_u32 (x64)", .run = run_buf_read_u32},
+    {.name = "buf_read (4 transactions)", .run = run_buf_read_tr},
+    {.name = "trdata_put (getService)", .run = run_trdata_small},
+    {.name = "trdata_put (mixed)", .run = run_trdata_mixed},
+    {.name = "trdata_put (4 KB bytes)", .run = run_trdata_bulk},
+    {.name = "txnin_pop (getService)", .run = run_txnin_small},
+    {.name = "txnin_pop (mixed)", .run = run_txnin_mixed},
+    {.name = "str16 bytewise (26 B)", .run = run_str16_bytewise_short},
+    {.name = "trdata_put_str16 (26 B)", .run = run_str16_short},
+    {.name = "str16 bytewise (1 KB ASCII)", .run = run_str16_bytewise_ascii},
+    {.name = "trdata_put_str16 (1 KB ASCII)", .run = run_str16_ascii},
+    {.name = "trdata_put_str16 (1 KB mixed)", .run = run_str16_intl},
+    {.name = "txnin_pop_str16_utf8 (1 KB)", .run = run_txnin_str16_utf8},
+    {.name = "binder_skip_cmds (transaction)",
+     .run = run_skip_cmds_txn,
+     .setup = reset_cmds},
+    {.name = "binder_skip_cmds (mixed)",
+     .run = run_skip_cmds_mixed,
+     .setup = reset_cmds},
+};
+
+int main(int argc, char **argv) {
+  uint64_t iterations = DEFAULT_ITERATIONS;
+  uint64_t i, start, start_cycles, elapsed, cycles, bytes;
+  size_t c;
+
+  if (argc > 1)
+    iterations = strtoull(argv[1], NULL, 0);
+  if (!iterations) {
+    LOG("Usage: %s [iterations]", argv[0]);
+    return 1;
+  }
+
+  ctx = binder_open(FAKE_DRIVER_DEVICE);
+  if (!ctx)
+    return 1;
+
+  buf_init_write(&wbuf);
+  buf_init_write(&rbuf);
+  run_buf_write_tr();
+  buf_write(&rbuf, wbuf.buffer, wbuf.size);
+
+  trdata_init(&trdata);
+  trdata_init(&small_parcel);
+  trdata_init(&mixed_parcel);
+  put_small(&small_parcel);
+  put_mixed(&mixed_parcel);
+
+  for (i = 0; i < STR_SIZE; i++)
+    ascii_str[i] = 'a' + i % 26;
+  // Latin text with the odd two- and three-byte character
+  for (i = 0; i + 3 <= STR_SIZE; i += 3) {
+    if (i % 48 == 0)
+      memcpy(intl_str + i, "\xe2\x82\xac", 3);
+    else if (i % 24 == 0)
+      memcpy(intl_str + i, "\xc3\xa9" "a", 3);
+    else
+      memcpy(intl_str + i, "abc", 3);
+  }
+  memset(intl_str + i, 'a', STR_SIZE - i);
+  trdata_init(&str16_parcel);
+  trdata_put_str16(&str16_parcel, ascii_str);
+
+  LOG("%-32s %10s %10s %10s", "case", "cycles/op", "ns/op", "MB/s");
+  for (c = 0; c < ARRAY_SIZE(cases); c++) {
+    if (cases[c].setup)
+      cases[c].setup();
+
+    // Warm up caches and branch predictors
+    for (i = 0; i < iterations / 10; i++)
+      cases[c].run();
+
+    bytes = 0;
+    start = now_ns();
+    start_cycles = read_cycles();
+    for (i = 0; i < iterations; i++)
+      bytes += cases[c].run();
+    cycles = read_cycles() - start_cycles;
+    elapsed = now_ns() - start;
+
+    LOG("%-32s %10.1f %10.1f %10.1f", cases[c].name,
+        (double)cycles / iterations, (double)elapsed / iterations,
+        bytes * 1e3 / elapsed);
+  }
+
+  trdata_release(&trdata);
+  trdata_release(&small_parcel);
+  trdata_release(&mixed_parcel);
+  trdata_release(&str16_parcel);
+  binder_close(ctx);
+  return 0;
+}
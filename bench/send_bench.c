@@ -0,0 +1,180 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures the cost and the heap allocations of the library's send path.
+ *
+ * Runs against the fake driver, so only userspace overhead is measured. Link
+ * with `-Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc` to count allocations
+ * made by the library.
+ */
+
+#include <sys/types.h>
+#include <linux/android/binder.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "binder.h"
+#include "fake_driver.h"
+#include "util.h"
+
+#define DEFAULT_ITERATIONS 1000000
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static uint64_t allocs;
+
+void *__wrap_malloc(size_t size) {
+  allocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  allocs++;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  allocs++;
+  return __real_realloc(ptr, size);
+}
+
+typedef struct {
+  const char *name;
+  int (*run)(binder_ctx *ctx);
+} bench_case_t;
+
+static translation_data_t trdata;
+static uint8_t payload[16];
+
+static int run_send_cmd(binder_ctx *ctx) {
+  binder_uintptr_t ptr = (binder_uintptr_t)ctx->map_ptr;
+  return binder_send_cmd(ctx, BC_FREE_BUFFER, (uint8_t *)&ptr, sizeof(ptr));
+}
+
+static int run_free_buffer(binder_ctx *ctx) {
+  int ret = binder_free_buffer(ctx, (binder_uintptr_t)ctx->map_ptr);
+  if (ret < 0)
+    return ret;
+  return binder_flush(ctx);
+}
+
+static int run_send_txn(binder_ctx *ctx) {
+  int ret = binder_send_txn(ctx, 0, 0, TF_ONE_WAY, &trdata, false, false);
+  if (ret < 0)
+    return ret;
+  // Drain `BR_TRANSACTION_COMPLETE`
+  buf_t buf;
+  buf_init_read(&buf);
+  return binder_recv(ctx, &buf);
+}
+
+static int run_send_raw_txn(binder_ctx *ctx) {
+  int ret = binder_send_raw_txn(ctx, 0, 0, TF_ONE_WAY, payload,
+                                sizeof(payload), false, false);
+  if (ret < 0)
+    return ret;
+  buf_t buf;
+  buf_init_read(&buf);
+  return binder_recv(ctx, &buf);
+}
+
+static int run_transact_oneway(binder_ctx *ctx) {
+  return binder_transact(ctx, 0, 0, TF_ONE_WAY, &trdata, NULL);
+}
+
+static int run_transact(binder_ctx *ctx) {
+  translated_data_t reply;
+  int ret = binder_transact(ctx, 0, 0, 0, &trdata, &reply);
+  if (ret < 0)
+    return ret;
+  return binder_free_buffer(ctx, (binder_uintptr_t)reply.data);
+}
+
+static int run_transact_pooled(binder_ctx *ctx) {
+  translation_data_t *pooled = trdata_pool_get();
+  int ret;
+
+  if (!pooled)
+    return -1;
+  trdata_put_bytes(pooled, (const char *)payload, sizeof(payload));
+  ret = binder_transact(ctx, 0, 0, TF_ONE_WAY, pooled, NULL);
+  trdata_pool_put(pooled);
+  return ret;
+}
+
+static const bench_case_t cases[] = {
+    {"binder_send_cmd", run_send_cmd},
+    {"binder_free_buffer+flush", run_free_buffer},
+    {"binder_send_txn (oneway)", run_send_txn},
+    {"binder_send_raw_txn (oneway)", run_send_raw_txn},
+    {"binder_transact (oneway)", run_transact_oneway},
+    {"binder_transact (two-way)", run_transact},
+    {"binder_transact (pooled trdata)", run_transact_pooled},
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+  binder_ctx *ctx;
+  uint64_t iterations = DEFAULT_ITERATIONS;
+  uint64_t i, start, elapsed, start_allocs, start_ioctls;
+  size_t c;
+
+  if (argc > 1)
+    iterations = strtoull(argv[1], NULL, 0);
+  if (!iterations) {
+    LOG("Usage: %s [iterations]", argv[0]);
+    return 1;
+  }
+
+  ctx = binder_open(FAKE_DRIVER_DEVICE);
+  if (!ctx)
+    return 1;
+
+  trdata_init(&trdata);
+  trdata_put_bytes(&trdata, (const char *)payload, sizeof(payload));
+
+  LOG("%-32s %10s %10s %10s", "case", "ns/op", "allocs/op", "ioctls/op");
+  for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    start_allocs = allocs;
+    start_ioctls = fake_driver_stats.ioctls;
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+      if (cases[c].run(ctx) < 0) {
+        ERR("%s failed", cases[c].name);
+        return 1;
+      }
+    }
+    elapsed = now_ns() - start;
+    binder_flush(ctx);
+
+    LOG("%-32s %10.1f %10.3f %10.3f", cases[c].name,
+        (double)elapsed / iterations,
+        (double)(allocs - start_allocs) / iterations,
+        (double)(fake_driver_stats.ioctls - start_ioctls) / iterations);
+  }
+
+  binder_close(ctx);
+  return 0;
+}
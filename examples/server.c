@@ -20,22 +20,27 @@
 #include <unistd.h>
 
 #include "binder.h"
+#include "dispatcher.h"
 #include "util.h"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-static void process_buf(binder_ctx *ctx, buf_t *in_b);
+static int print_txn(binder_ctx *ctx, translated_data_t *txnin,
+                     translation_data_t *reply, void *arg);
 
 int main() {
   int ret;
   binder_ctx *ctx;
-  buf_t *read_buf;
+  binder_dispatcher_t *dispatcher;
 
-  read_buf = buf_alloc();
-  if (!read_buf) {
+  dispatcher = binder_dispatcher_create();
+  if (!dispatcher) {
     return 1;
   }
 
+  // The context manager node has a null cookie
+  binder_dispatcher_register(dispatcher, 0, 0, print_txn, NULL);
+
   ctx = binder_open("/dev/binder");
   if (!ctx) {
     return 1;
@@ -46,105 +51,27 @@ int main() {
     return 1;
   }
 
-  binder_enter_looper(ctx);
-
   LOG("Listening...");
-  do {
-    buf_init_read(read_buf);
-
-    ret = binder_recv(ctx, read_buf);
-    if (ret < 0)
-      break;
+  binder_loop(ctx, binder_dispatch, dispatcher);
 
-    process_buf(ctx, read_buf);
-  } while (1);
-
-  buf_free(read_buf);
   binder_close(ctx);
+  binder_dispatcher_destroy(dispatcher);
   return 0;
 }
 
-static void process_buf(binder_ctx *ctx, buf_t *in_b) {
-  uint32_t cmd;
-
-  while (!buf_is_empty(in_b)) {
-    cmd = buf_read_u32(in_b);
-    switch (cmd) {
-      case BR_ERROR: {
-        buf_pop(in_b, sizeof(int));  // int error
-        LOG("BR_ERROR");
-      } break;
-      case BR_OK:
-        LOG("BR_OK");
-        break;
-      case BR_TRANSACTION:
-      case BR_REPLY: {
-        char out_buffer[256] = {0};
-        struct binder_transaction_data txn;
-
-        char *cmd_str = cmd == BR_TRANSACTION ? "BR_TRANSACTION" : "BR_REPLY";
+static int print_txn(binder_ctx *ctx, translated_data_t *txnin,
+                     translation_data_t *reply, void *arg) {
+  char out_buffer[256] = {0};
 
-        buf_read_transaction_data(in_b, &txn);
-
-        if (txn.flags & TF_ONE_WAY) {
-          LOG("%s (TF_ONE_WAY)", cmd_str);
-        } else {
-          LOG("%s ", cmd_str);
-        }
-
-        memcpy(out_buffer, (void *)txn.data.ptr.buffer,
-               MIN(txn.data_size, sizeof(out_buffer)));
-        LOG("\t%s", out_buffer);
+  if (txnin->flags & TF_ONE_WAY) {
+    LOG("BR_TRANSACTION (TF_ONE_WAY)");
+  } else {
+    LOG("BR_TRANSACTION ");
+  }
 
-        binder_free_buffer(ctx, (binder_uintptr_t)txn.data.ptr.buffer);
+  memcpy(out_buffer, txnin->data,
+         MIN(txnin->data_avail, sizeof(out_buffer) - 1));
+  LOG("\t%s", out_buffer);
 
-        break;
-      }
-      case BR_DEAD_REPLY:
-        LOG("BR_DEAD_REPLY\n");
-        break;
-      case BR_TRANSACTION_COMPLETE:
-        LOG("BR_TRANSACTION_COMPLETE\n");
-        break;
-      case BR_INCREFS: {
-        buf_pop(in_b, sizeof(void *));  // void *ptr
-        buf_pop(in_b, sizeof(void *));  // void *cookie
-        LOG("BR_INCREFS");
-      } break;
-      case BR_ACQUIRE: {
-        buf_pop(in_b, sizeof(void *));  // void *ptr
-        buf_pop(in_b, sizeof(void *));  // void *cookie
-        LOG("BR_ACQUIRE");
-      } break;
-      case BR_RELEASE: {
-        buf_pop(in_b, sizeof(void *));  // void *ptr
-        buf_pop(in_b, sizeof(void *));  // void *cookie
-        LOG("BR_RELEASE");
-      } break;
-      case BR_DECREFS: {
-        buf_pop(in_b, sizeof(void *));  // void *ptr
-        buf_pop(in_b, sizeof(void *));  // void *cookie
-        LOG("BR_DECREFS");
-      } break;
-      case BR_NOOP:
-        break;
-      case BR_SPAWN_LOOPER:
-        LOG("BR_SPAWN_LOOPER");
-        break;
-      case BR_DEAD_BINDER: {
-        buf_pop(in_b, sizeof(void *));  // void *cookie
-        LOG("BR_DEAD_BINDER");
-      } break;
-      case BR_CLEAR_DEATH_NOTIFICATION_DONE: {
-        buf_pop(in_b, sizeof(void *));  // void *cookie
-        LOG("BR_CLEAR_DEATH_NOTIFICATION_DONE");
-      } break;
-      case BR_FAILED_REPLY:
-        LOG("BR_FAILED_REPLY\n");
-        break;
-      default:
-        LOG("WARN: Unknown returned command\n");
-        break;
-    }
-  }
+  return 0;
 }
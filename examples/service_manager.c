@@ -0,0 +1,192 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * A stand-in for the classic servicemanager, serving the protocol of
+ * `service_manager.h` on devices without one, e.g. a fresh binderfs instance.
+ */
+
+#include <linux/android/binder.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "binder.h"
+#include "service_manager.h"
+#include "util.h"
+
+#define MAX_SERVICES 64
+
+typedef struct {
+  char name[BINDER_SVCMGR_NAME_MAX];
+  uint32_t handle;  // 0 for unused entries
+} service_t;
+
+static service_t services[MAX_SERVICES];
+static bool work_source;
+
+static service_t *find_service(const char *name) {
+  for (size_t i = 0; i < MAX_SERVICES; i++) {
+    if (services[i].handle && !strcmp(services[i].name, name))
+      return &services[i];
+  }
+  return NULL;
+}
+
+static bool handle_in_use(uint32_t handle) {
+  for (size_t i = 0; i < MAX_SERVICES; i++) {
+    if (services[i].handle == handle)
+      return true;
+  }
+  return false;
+}
+
+// Drops an entry, and the reference and death notification of its handle
+// once no other entry uses it.
+static void remove_service(binder_ctx *ctx, service_t *service) {
+  uint32_t handle = service->handle;
+
+  service->handle = 0;
+  if (!handle_in_use(handle))
+    binder_clear_death_notification(ctx, handle, handle);
+  binder_handle_release(ctx, handle);
+}
+
+static void on_death(binder_ctx *ctx, binder_uintptr_t cookie, void *arg) {
+  for (size_t i = 0; i < MAX_SERVICES; i++) {
+    if (services[i].handle == cookie) {
+      LOG("Service died: %s", services[i].name);
+      remove_service(ctx, &services[i]);
+    }
+  }
+}
+
+static int add_service(binder_ctx *ctx, const char *name, uint32_t handle) {
+  service_t *service = find_service(name);
+
+  if (!service) {
+    for (size_t i = 0; i < MAX_SERVICES && !service; i++) {
+      if (!services[i].handle)
+        service = &services[i];
+    }
+    if (!service)
+      return -1;
+  } else {
+    remove_service(ctx, service);
+  }
+
+  // The reference that came with the transaction is dropped with its buffer
+  binder_handle_acquire(ctx, handle);
+  if (!handle_in_use(handle))
+    binder_request_death_notification(ctx, handle, handle);
+
+  strcpy(service->name, name);
+  service->handle = handle;
+  LOG("Service added: %s (handle %u)", name, handle);
+  return 0;
+}
+
+static int serve(binder_ctx *ctx, translated_data_t *txnin,
+                 translation_data_t *reply, void *arg) {
+  char name[BINDER_SVCMGR_NAME_MAX];
+  service_t *service;
+  uint32_t handle, index;
+
+  txnin_pop_u32(txnin);  // Strict mode policy
+  if (work_source)
+    txnin_pop_u32(txnin);
+  if (!txnin_pop_str16_utf8(txnin, name, sizeof(name))
+      || strcmp(name, BINDER_SVCMGR_INTERFACE)) {
+    ERR("Unexpected interface token");
+    return -1;
+  }
+
+  switch (txnin->code) {
+    case BINDER_SVCMGR_GET_SERVICE:
+    case BINDER_SVCMGR_CHECK_SERVICE:
+      if (!txnin_pop_str16_utf8(txnin, name, sizeof(name)))
+        return -1;
+      service = find_service(name);
+      if (service) {
+        trdata_put_handle(reply, service->handle, true);
+      } else {
+        // A null object, which is plain data
+        struct flat_binder_object *fbo =
+            trdata_alloc(reply, sizeof(*fbo), false);
+
+        if (fbo) {
+          memset(fbo, 0, sizeof(*fbo));
+          fbo->hdr.type = BINDER_TYPE_BINDER;
+        }
+      }
+      return 0;
+    case BINDER_SVCMGR_ADD_SERVICE:
+      if (!txnin_pop_str16_utf8(txnin, name, sizeof(name)))
+        return -1;
+      handle = txnin_pop_handle(txnin);
+      if (!handle)
+        return -1;
+      trdata_put_u32(reply, add_service(ctx, name, handle) < 0 ? -1 : 0);
+      return 0;
+    case BINDER_SVCMGR_LIST_SERVICES:
+      index = txnin_pop_u32(txnin);
+      for (size_t i = 0; i < MAX_SERVICES; i++) {
+        if (services[i].handle && !index--) {
+          trdata_put_str16(reply, services[i].name);
+          return 0;
+        }
+      }
+      return -1;
+    default:
+      ERR("Unknown transaction code: %u", txnin->code);
+      return -1;
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *device = "/dev/binder";
+  binder_ctx *ctx;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:w")) != -1) {
+    switch (opt) {
+      case 'd':
+        device = optarg;
+        break;
+      case 'w':
+        work_source = true;
+        break;
+      default:
+        ERR("Usage: %s [-d device] [-w]", argv[0]);
+        return 1;
+    }
+  }
+
+  ctx = binder_open(device);
+  if (!ctx)
+    return 1;
+
+  if (binder_set_context_manager(ctx) < 0)
+    return 1;
+  binder_set_death_handler(ctx, on_death, NULL);
+
+  LOG("Listening on %s...", device);
+  binder_loop(ctx, serve, NULL);
+
+  binder_close(ctx);
+  return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The driver operations a `binder_ctx` is built on.
+ *
+ * Each operation follows the convention of the system call it replaces:
+ * failures return -1 (`MAP_FAILED` for `mmap`) and set errno.
+ *
+ * @open: Opens `device` with the `open(2)` `flags` and returns a descriptor.
+ *        The descriptor must be pollable for `binder_wait`.
+ * @mmap: Maps `size` bytes of the transaction buffer region of `fd`.
+ * @munmap: Unmaps the region returned by `mmap`.
+ * @ioctl: Issues a Binder `request` on `fd`.
+ * @close: Closes `fd`.
+ * @wake: Makes the threads blocked reading `fd`, or about to, return even
+ *        without work, as the driver does when the device is flushed. May be
+ *        NULL if unsupported.
+ */
+typedef struct binder_backend {
+  int (*open)(const char *device, int flags);
+  void *(*mmap)(int fd, size_t size);
+  int (*munmap)(int fd, void *addr, size_t size);
+  int (*ioctl)(int fd, unsigned long request, void *arg);
+  int (*close)(int fd);
+  int (*wake)(int fd);
+} binder_backend_t;
+
+/**
+ * The Binder kernel driver. This is the default backend.
+ */
+extern const binder_backend_t binder_kernel_backend;
+
+/**
+ * A userspace emulation of the Binder driver between the contexts of a single
+ * process, for hosts without the kernel module.
+ *
+ * Every context opened on the same device name talks to the same emulated
+ * driver, and each of them is a separate process to it: transactions are
+ * copied into the receiver's region, binder objects and handles are
+ * translated, file descriptors are duplicated, scatter-gather buffers are
+ * fixed up and the first context to ask becomes the context manager.
+ * Oneway transactions, looper threads and `BR_SPAWN_LOOPER`, non-blocking
+ * reads, wakeups, death notifications and `BINDER_THREAD_EXIT` behave as in
+ * the driver.
+ *
+ * Simplifications: nodes live as long as their owner and never receive
+ * `BR_INCREFS`/`BR_ACQUIRE`, oneway transactions are not serialized per node,
+ * there is no separate async buffer space, and the descriptor polls readable
+ * whenever any thread of the context has work.
+ */
+extern const binder_backend_t binder_emulator_backend;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // BACKEND_H
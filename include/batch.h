@@ -0,0 +1,163 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "binder.h"
+
+#define BINDER_BATCH_MAGIC 0x68637462  // "btch"
+
+#define BINDER_BATCH_MAX_BYTES 0x4000
+#define BINDER_BATCH_MAX_COUNT 256
+#define BINDER_BATCH_MAX_DELAY_NS 1000000
+
+/**
+ * Options for `binder_batch_create`. Zero fields take their default.
+ *
+ * @max_bytes: The size of the frames a batch holds before it is flushed, or 0
+ *             for `BINDER_BATCH_MAX_BYTES`.
+ * @max_count: The number of frames a batch holds before it is flushed, or 0
+ *             for `BINDER_BATCH_MAX_COUNT`.
+ * @max_delay_ns: How long the oldest frame waits before the batch is flushed,
+ *                or 0 for `BINDER_BATCH_MAX_DELAY_NS`.
+ */
+typedef struct {
+  size_t max_bytes;
+  size_t max_count;
+  uint64_t max_delay_ns;
+} binder_batch_opts_t;
+
+/**
+ * A sender coalescing small messages to one handle and code into oneway
+ * transactions.
+ *
+ * Each transaction carries a header, `BINDER_BATCH_MAGIC` and the frame
+ * count, followed by the frames, each a 32-bit length and the message padded
+ * to 4 bytes. A batch is flushed once it reaches `max_bytes` or `max_count`,
+ * and by `binder_batch_add` or `binder_batch_poll` once its oldest frame is
+ * `max_delay_ns` old; there is no timer, so callers that may go idle poll the
+ * batch after `binder_batch_timeout_ms`. Receivers walk the frames with
+ * `binder_batch_iter_init` and `binder_batch_iter_next`.
+ *
+ * A batch is used by one thread at a time.
+ */
+typedef struct binder_batch binder_batch_t;
+
+/**
+ * An iterator over the frames of a received batch.
+ */
+typedef struct {
+  translated_data_t *txnin;
+  uint32_t remaining;
+} binder_batch_iter_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Creates an empty batch.
+ *
+ * @param handle The handle of the recipient.
+ * @param code The transaction code.
+ * @param opts The flush policy, or NULL for the defaults.
+ * @return A pointer to the batch on success, or NULL on failure.
+ */
+binder_batch_t *binder_batch_create(int32_t handle, uint32_t code,
+                                    const binder_batch_opts_t *opts);
+
+/**
+ * Flushes and frees a batch.
+ *
+ * @param batch A pointer to the batch.
+ * @param ctx The context of the calling thread.
+ * @return 0 on success, or -1 if the last flush failed.
+ */
+int binder_batch_destroy(binder_batch_t *batch, binder_ctx *ctx);
+
+/**
+ * Appends a message, flushing the batch before if it does not fit, and after
+ * if it is full or due. Messages larger than `max_bytes` are sent alone.
+ *
+ * @param batch A pointer to the batch.
+ * @param ctx The context of the calling thread.
+ * @param data The message.
+ * @param len The length of the message.
+ * @return 0 once the message is queued, or -1 with `errno` set if it is not,
+ *         e.g. because the pending frames could not be flushed to make room,
+ *         see `binder_batch_flush`. The frames of a failed flush are kept for
+ *         the next one.
+ */
+int binder_batch_add(binder_batch_t *batch, binder_ctx *ctx, const void *data,
+                     size_t len);
+
+/**
+ * Sends the pending frames, if any, in one oneway transaction.
+ *
+ * @param batch A pointer to the batch.
+ * @param ctx The context of the calling thread.
+ * @return 0 on success, or -1 with `errno` set on error, keeping the frames.
+ *         Failures are not logged: `EIO` usually means that the recipient's
+ *         buffer space is full, and the flush may be retried later.
+ */
+int binder_batch_flush(binder_batch_t *batch, binder_ctx *ctx);
+
+/**
+ * Flushes the batch if its oldest frame is due.
+ *
+ * @param batch A pointer to the batch.
+ * @param ctx The context of the calling thread.
+ * @return 0 on success, or -1 with `errno` set on error.
+ */
+int binder_batch_poll(binder_batch_t *batch, binder_ctx *ctx);
+
+/**
+ * Returns the time until the batch is due, e.g. as a `poll` timeout before
+ * calling `binder_batch_poll`.
+ *
+ * @param batch A pointer to the batch.
+ * @return The number of milliseconds, rounded up, or -1 if the batch is
+ *         empty.
+ */
+int binder_batch_timeout_ms(const binder_batch_t *batch);
+
+/**
+ * Starts iterating over the frames of a received batch.
+ *
+ * @param iter A pointer to the iterator.
+ * @param txnin The received transaction.
+ * @return 0 on success, or -1, without moving, if `txnin` holds no batch.
+ */
+int binder_batch_iter_init(binder_batch_iter_t *iter, translated_data_t *txnin);
+
+/**
+ * Returns the next frame, as a view into the transaction buffer.
+ *
+ * @param iter A pointer to the iterator.
+ * @param len A pointer to store the length of the frame.
+ * @return The frame, or NULL after the last one or at a truncated frame.
+ */
+const void *binder_batch_iter_next(binder_batch_iter_t *iter, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // BATCH_H
@@ -22,24 +22,126 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "backend.h"
 #include "buf.h"
+#include "stats.h"
 #include "transaction.h"
 
 #define BINDER_VM_SIZE 1 * 1024 * 1024
 
+/*
+ * Flags for `binder_open_opts_t`
+ */
+
+// Opens the device with O_NONBLOCK: reads return immediately without work.
+#define BINDER_OPEN_NONBLOCK (1 << 0)
+
+/**
+ * Options for `binder_open_ex`.
+ *
+ * @flags: A combination of `BINDER_OPEN_*` flags.
+ * @map_size: The size of the memory-mapped region receiving transactions, or 0
+ *            for `BINDER_VM_SIZE`. The driver caps it to 4 MB.
+ * @backend: The driver backend, or NULL for `binder_kernel_backend`.
+ */
+typedef struct {
+  uint32_t flags;
+  size_t map_size;
+  const binder_backend_t *backend;
+} binder_open_opts_t;
+
+/**
+ * Occupancy of the memory-mapped region by received transaction buffers that
+ * still await `BC_FREE_BUFFER`.
+ *
+ * Only buffers received and freed through the library are accounted for, and
+ * the size of scatter-gather buffers is not known, so figures are a lower
+ * bound of what the driver sees.
+ *
+ * @map_size: The size of the memory-mapped region in bytes.
+ * @bytes: The size of the outstanding buffers in bytes.
+ * @count: The number of outstanding buffers.
+ * @max_bytes: The highest value of `bytes` since the last reset.
+ * @max_count: The highest value of `count` since the last reset.
+ */
+typedef struct {
+  size_t map_size;
+  size_t bytes;
+  size_t count;
+  size_t max_bytes;
+  size_t max_count;
+} binder_buffer_stats_t;
+
+struct binder_ctx;
+
+/**
+ * Handles a `BR_DEAD_BINDER`, see `binder_set_death_handler`.
+ *
+ * @param ctx The context the notification was received on.
+ * @param cookie The cookie given to `binder_request_death_notification`.
+ * @param arg The argument given along with the handler.
+ */
+typedef void (*binder_death_handler_t)(struct binder_ctx *ctx,
+                                       binder_uintptr_t cookie, void *arg);
+
 /**
  * Represents a Binder context.
  *
  * @fd: The file descriptor associated with the opened Binder device.
  * @map_ptr: A pointer to the memory-mapped region used for Binder.
  * @map_size: The size of the memory-mapped region in bytes.
+ * @out: Deferred commands, sent ahead of the next `BINDER_WRITE_READ`.
+ * @in: Commands read by `binder_recv_txn` and friends, kept across calls until
+ *      they have all been parsed.
+ * @parent: The context owning `fd` and `map_ptr` for contexts created with
+ *          `binder_ctx_clone`, or NULL.
+ * @spawn_looper: Set when `BR_SPAWN_LOOPER` is received, for the caller to
+ *                start a new looper thread and clear it.
+ * @interrupted: Set by `binder_interrupt`, possibly from another thread.
+ * @buffers: Tracker of the outstanding transaction buffers, shared with clones.
+ * @handles: The references this context holds on handles, see
+ *           `binder_handle_acquire`. Created on first use.
+ * @backend: The driver operations used on `fd`.
+ * @death_handler: The handler of death notifications. Only used on the context
+ *                 owning `fd`, see `binder_set_death_handler`.
+ * @death_arg: The argument passed to `death_handler`.
+ * @stats: The counters of this context, see `binder_get_stats`.
+ *
+ * A context is meant to be used by a single thread at a time. Threads sharing
+ * a Binder device each use their own context from `binder_ctx_clone`.
  */
-typedef struct {
+typedef struct binder_ctx {
   int fd;
   void *map_ptr;
   size_t map_size;
+  buf_t out;
+  buf_t in;
+  struct binder_ctx *parent;
+  bool spawn_looper;
+  bool interrupted;
+  struct binder_buffer_tracker *buffers;
+  struct binder_handle_table *handles;
+  const binder_backend_t *backend;
+  binder_death_handler_t death_handler;
+  void *death_arg;
+  binder_stats_t stats;
 } binder_ctx;
 
+/**
+ * Handles an incoming transaction, for `binder_loop` and the thread pool.
+ *
+ * @param ctx The context the transaction was received on.
+ * @param txnin The incoming transaction. Its buffer is freed once the handler
+ *              returns.
+ * @param reply The reply, initially empty. Ignored for `TF_ONE_WAY`
+ *              transactions.
+ * @param arg The argument given along with the handler.
+ * @return 0 to send `reply`, or a negative status code to send a
+ *         `TF_STATUS_CODE` reply carrying it instead.
+ */
+typedef int (*binder_txn_handler_t)(binder_ctx *ctx, translated_data_t *txnin,
+                                    translation_data_t *reply, void *arg);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -57,12 +159,99 @@ extern "C" {
 binder_ctx *binder_open(const char *driver);
 
 /**
- * Closes a Binder device and frees the associated context.
+ * Same as `binder_open`, with options.
+ *
+ * @param driver The name of the Binder driver (e.g., "/dev/binder").
+ * @param opts A pointer to the options, or NULL for the defaults.
+ * @return A pointer to a `binder_ctx` structure on success, or NULL on failure.
+ */
+binder_ctx *binder_open_ex(const char *driver, const binder_open_opts_t *opts);
+
+/**
+ * Creates a context for another thread, sharing the device and memory-mapped
+ * region of `ctx` but with its own command queue and read buffer.
+ *
+ * Clones must be closed before the context they were created from.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @return A pointer to a `binder_ctx` structure on success, or NULL on failure.
+ */
+binder_ctx *binder_ctx_clone(binder_ctx *ctx);
+
+/**
+ * Closes a Binder device and frees the associated context. Commands left in
+ * the deferred command queue are flushed first. For a context created with
+ * `binder_ctx_clone`, the device is left open.
  *
  * @param ctx A pointer to the `binder_ctx` structure.
  */
 void binder_close(binder_ctx *ctx);
 
+/**
+ * Returns the file descriptor of the Binder device, to be watched for
+ * readability with poll/epoll. The driver only reports work for looper
+ * threads, so `binder_enter_looper` and `binder_flush` must be called on the
+ * polling thread first.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @return The file descriptor.
+ */
+int binder_get_fd(binder_ctx *ctx);
+
+/**
+ * Waits until the Binder device has work for the calling thread.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param timeout_ms The maximum time to wait in milliseconds, or -1 to wait
+ *                   indefinitely.
+ * @return 1 if there is work, 0 on timeout, or a negative error code on
+ *         failure.
+ */
+int binder_wait(binder_ctx *ctx, int timeout_ms);
+
+/**
+ * Gets the occupancy of the memory-mapped region by outstanding transaction
+ * buffers.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param stats A pointer to a `binder_buffer_stats_t` structure to fill in.
+ */
+void binder_get_buffer_stats(binder_ctx *ctx, binder_buffer_stats_t *stats);
+
+/**
+ * Gets the counters of a context. Contexts from `binder_ctx_clone` have their
+ * own counters.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param stats A pointer to a `binder_stats_t` structure to fill in.
+ */
+void binder_get_stats(binder_ctx *ctx, binder_stats_t *stats);
+
+/**
+ * Resets the counters of a context.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ */
+void binder_reset_stats(binder_ctx *ctx);
+
+/**
+ * Resets the high-water marks of the buffer statistics to the current values.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ */
+void binder_reset_buffer_stats(binder_ctx *ctx);
+
+/**
+ * Grows the read buffer used by `binder_recv_txn`, `binder_reply_and_recv_txn`
+ * and `binder_transact`, so that more commands can be drained per
+ * `BINDER_WRITE_READ`. The default is `BUF_INLINE_SIZE` bytes.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param size The new capacity in bytes. Smaller values are ignored.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_set_read_buffer_size(binder_ctx *ctx, size_t size);
+
 /*
  * IOCTL operations
  */
@@ -83,6 +272,29 @@ int binder_check_version(binder_ctx *ctx);
  */
 int binder_set_context_manager(binder_ctx *ctx);
 
+/**
+ * Sets the context manager with the node `ptr` and its
+ * `FLAT_BINDER_FLAG_*` flags, e.g. `FLAT_BINDER_FLAG_ACCEPTS_FDS`.
+ * (BINDER_SET_CONTEXT_MGR_EXT)
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param ptr The address of the node.
+ * @param flags The flags of the node.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_set_context_manager_ext(binder_ctx *ctx, binder_uintptr_t ptr,
+                                   uint32_t flags);
+
+/**
+ * Sets the maximum number of looper threads the driver may ask the process to
+ * spawn with `BR_SPAWN_LOOPER`. (BINDER_SET_MAX_THREADS)
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param max_threads The maximum number of threads.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_set_max_threads(binder_ctx *ctx, uint32_t max_threads);
+
 /**
  * Signals the Binder thread to exit. (BINDER_THREAD_EXIT)
  *
@@ -95,6 +307,44 @@ int binder_thread_exit(binder_ctx *ctx);
  * IOCTL BINDER_WRITE_READ operations
  */
 
+/**
+ * Performs a single `BINDER_WRITE_READ` with both halves filled in, so that
+ * commands can be submitted and the driver's answer received in one syscall.
+ * Interrupted calls are resumed until the driver consumed all of `wb`.
+ * Commands in the deferred command queue are sent ahead of `wb`.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param wb A pointer to a `buf_t` structure containing the data to be sent,
+ *           or NULL to only read.
+ * @param rb A pointer to a `buf_t` structure to store the received data, or
+ *           NULL to only write. On return, `rb->size` holds the number of
+ *           bytes read.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_write_read(binder_ctx *ctx, buf_t *wb, buf_t *rb);
+
+/**
+ * Appends a command to the context's deferred command queue. Queued commands
+ * are sent ahead of the write half of the next `BINDER_WRITE_READ`, or by
+ * `binder_flush`. The queue is flushed first if the command does not fit.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param cmd The command code.
+ * @param data A pointer to the data to be sent after the command.
+ * @param data_size The size of the data in bytes.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_queue_cmd(binder_ctx *ctx, uint32_t cmd, const void *data,
+                     size_t data_size);
+
+/**
+ * Sends all commands in the context's deferred command queue.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_flush(binder_ctx *ctx);
+
 /**
  * Sends raw data in the `write_buf`.
  *
@@ -134,7 +384,8 @@ int binder_send_txn(binder_ctx *ctx, int32_t handle, uint32_t code,
                     bool reply, bool sg);
 
 /**
- * Sends a raw transaction to a Binder service.
+ * Sends a raw transaction to a Binder service. The driver reads `data`
+ * directly, without it being copied into a `translation_data_t` first.
  *
  * @param ctx A pointer to the `binder_ctx` structure.
  * @param handle The handle of the target recipient.
@@ -151,7 +402,32 @@ int binder_send_raw_txn(binder_ctx *ctx, int32_t handle, uint32_t code,
                         bool reply, bool sg);
 
 /**
- * Reads raw data from the `read_buf`.
+ * Sends a raw transaction whose buffer and offsets array are read by the
+ * driver directly from the caller's memory, without any intermediate copy.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param handle The handle of the target recipient.
+ * @param code The transaction code.
+ * @param flags The transaction flags.
+ * @param data A pointer to the raw transaction data.
+ * @param data_size The size of the raw transaction data in bytes.
+ * @param offs A pointer to the offsets of the objects in `data`, or NULL.
+ * @param offs_count The number of entries in `offs`.
+ * @param buffers_size The total size of the buffers referenced by
+ *                     `BINDER_TYPE_PTR` objects. Only used with `sg`.
+ * @param reply Whether it is a BC_TRANSACTION* or `BC_REPLY*` transaction.
+ * @param sg Whether it is a `BC_*` or `BC_*_SG` transaction.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_send_raw_txn_offs(binder_ctx *ctx, int32_t handle, uint32_t code,
+                             uint32_t flags, const void *data,
+                             size_t data_size, const binder_size_t *offs,
+                             size_t offs_count, binder_size_t buffers_size,
+                             bool reply, bool sg);
+
+/**
+ * Reads raw data from the `read_buf`. On a non-blocking context, `b->size` is
+ * set to 0 when there is nothing to read.
  *
  * @param ctx A pointer to the `binder_ctx` structure.
  * @param b A pointer to a `buf_t` structure to store the received data.
@@ -161,7 +437,8 @@ int binder_recv(binder_ctx *ctx, buf_t *b);
 
 /**
  * Reads a `BC_TRANSACTION`/`BC_TRANSACTION_SG` or `BC_REPLY`/`BC_REPLY_SG`
- * transaction, skipping other received commands.
+ * transaction, skipping other received commands. On a non-blocking context,
+ * fails with `errno` set to `EAGAIN` when no transaction is pending.
  *
  * @param ctx A pointer to the `binder_ctx` structure.
  * @param txnin A pointer to a `translated_data_t` structure to store the
@@ -171,7 +448,114 @@ int binder_recv(binder_ctx *ctx, buf_t *b);
 int binder_recv_txn(binder_ctx *ctx, translated_data_t *txnin);
 
 /**
- * Send the `BC_ENTER_LOOPER` command.
+ * Interrupts `ctx` from any thread: from then on, `binder_recv_txn` and the
+ * other calls waiting for a transaction fail with `errno` set to `EINTR`,
+ * after sending any reply they carry. The threads of the process blocked in
+ * the driver are woken; those of other contexts resume waiting.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @return 0 on success, or -1 if the backend cannot wake blocked threads, in
+ *         which case `ctx` is only interrupted once it returns from the driver.
+ */
+int binder_interrupt(binder_ctx *ctx);
+
+/**
+ * Same as `binder_recv_txn`, but waits at most `timeout_ms` milliseconds for a
+ * transaction, failing with `errno` set to `ETIMEDOUT` otherwise. The timeout
+ * is only strictly honoured on non-blocking contexts, as another thread may
+ * take the work after the device was polled.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param txnin A pointer to a `translated_data_t` structure to store the
+ *              received transaction data.
+ * @param timeout_ms The maximum time to wait in milliseconds.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_recv_txn_timeout(binder_ctx *ctx, translated_data_t *txnin,
+                            int timeout_ms);
+
+/**
+ * Finishes the transaction in `txnin` and waits for the next one, all within
+ * a single `BINDER_WRITE_READ` call: the write half frees the transaction
+ * buffer (`BC_FREE_BUFFER`) and, unless the transaction was `TF_ONE_WAY`,
+ * sends the reply (`BC_REPLY`), while the read half receives the next
+ * `BR_TRANSACTION`. On a non-blocking context, fails with `errno` set to
+ * `EAGAIN` once the reply was sent if no transaction is pending.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param txnin A pointer to the `translated_data_t` structure holding the
+ *              transaction being finished. It receives the next transaction.
+ * @param reply A pointer to the reply data, or NULL to send an empty reply.
+ *              Ignored for `TF_ONE_WAY` transactions. Sent as `BC_REPLY_SG`
+ *              when it carries buffers.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_reply_and_recv_txn(binder_ctx *ctx, translated_data_t *txnin,
+                              const translation_data_t *reply);
+
+/**
+ * Same as `binder_reply_and_recv_txn`, but replies with a `TF_STATUS_CODE`
+ * reply carrying `status` instead of transaction data.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param txnin A pointer to the `translated_data_t` structure holding the
+ *              transaction being finished. It receives the next transaction.
+ * @param status The status code to reply with.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_reply_status_and_recv_txn(binder_ctx *ctx, translated_data_t *txnin,
+                                     int32_t status);
+
+/**
+ * Sends a `BC_TRANSACTION` and waits for its outcome within the same
+ * `BINDER_WRITE_READ` call. Two-way transactions return once `BR_REPLY` is
+ * received; one-way transactions return on `BR_TRANSACTION_COMPLETE`. This
+ * blocks even on non-blocking contexts.
+ *
+ * It is sent as `BC_TRANSACTION_SG` when `trdata` carries buffers, e.g. from
+ * `trdata_put_regions`.
+ *
+ * The reply may only carry file descriptors, e.g. from `trdata_put_blob`, if
+ * `flags` has `TF_ACCEPT_FDS`.
+ *
+ * Transactions received while waiting, e.g. calls back into this thread from
+ * the recipient, have no handler to run them: they are freed, and two-way ones
+ * are answered with a `-EBADMSG` status (UNKNOWN_TRANSACTION in libbinder).
+ *
+ * The reply buffer lives in the memory-mapped region and must be released
+ * with `binder_free_buffer` once the caller is done with it.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param handle The handle of the target recipient.
+ * @param code The transaction code.
+ * @param flags The transaction flags.
+ * @param trdata A pointer to transaction data.
+ * @param reply A pointer to a `translated_data_t` structure to store the
+ *              reply. May be NULL for `TF_ONE_WAY` transactions.
+ * @return 0 on success, or a negative error code on failure, including
+ *         `BR_DEAD_REPLY`, with `errno` set to `EPIPE`, and `BR_FAILED_REPLY`,
+ *         with `errno` set to `EIO`. The latter is not logged for `TF_ONE_WAY`
+ *         transactions, which get it when the recipient's buffer space for
+ *         them is full and may be retried.
+ */
+int binder_transact(binder_ctx *ctx, int32_t handle, uint32_t code,
+                    uint32_t flags, const translation_data_t *trdata,
+                    translated_data_t *reply);
+
+/**
+ * Serves transactions on the calling thread until receiving fails: enters the
+ * looper, then calls `handler` for each transaction and finishes it with
+ * `binder_reply_and_recv_txn`. Meant for blocking contexts.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param handler The transaction handler.
+ * @param arg An argument passed to `handler`.
+ * @return The negative error code that ended the loop.
+ */
+int binder_loop(binder_ctx *ctx, binder_txn_handler_t handler, void *arg);
+
+/**
+ * Queues the `BC_ENTER_LOOPER` command.
  *
  * @param ctx A pointer to the `binder_ctx` structure.
  * @return 0 on success, or a negative error code on failure.
@@ -179,7 +563,27 @@ int binder_recv_txn(binder_ctx *ctx, translated_data_t *txnin);
 int binder_enter_looper(binder_ctx *ctx);
 
 /**
- * Sends the `BC_ACQUIRE` command to acquire a handle
+ * Queues the `BC_REGISTER_LOOPER` command, for threads spawned in response to
+ * `BR_SPAWN_LOOPER`.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_register_looper(binder_ctx *ctx);
+
+/**
+ * Queues the `BC_EXIT_LOOPER` command.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_exit_looper(binder_ctx *ctx);
+
+/**
+ * Acquires a strong reference on a handle.
+ *
+ * References are counted per context, and only the first one queues a
+ * `BC_ACQUIRE` command.
  *
  * @param ctx A pointer to the `binder_ctx` structure.
  * @param handle The handle to acquire.
@@ -188,7 +592,12 @@ int binder_enter_looper(binder_ctx *ctx);
 int binder_handle_acquire(binder_ctx *ctx, int32_t handle);
 
 /**
- * Sends the `BC_RELEASE` command to release a handle
+ * Releases a strong reference on a handle.
+ *
+ * The `BC_RELEASE` command for the last reference is deferred until the
+ * context next talks to the driver, and dropped if the handle is acquired
+ * again in the meantime. A reference the context did not acquire is released
+ * right away.
  *
  * @param ctx A pointer to the `binder_ctx` structure.
  * @param handle The handle to release.
@@ -197,7 +606,69 @@ int binder_handle_acquire(binder_ctx *ctx, int32_t handle);
 int binder_handle_release(binder_ctx *ctx, int32_t handle);
 
 /**
- * Sends the `BC_FREE_BUFFER` to free a transaction buffer.
+ * Same as `binder_handle_acquire`, for a weak reference (`BC_INCREFS`).
+ */
+int binder_handle_acquire_weak(binder_ctx *ctx, int32_t handle);
+
+/**
+ * Same as `binder_handle_release`, for a weak reference (`BC_DECREFS`).
+ */
+int binder_handle_release_weak(binder_ctx *ctx, int32_t handle);
+
+/**
+ * Queues a `BC_REQUEST_DEATH_NOTIFICATION`, for the death handler to be
+ * called with `cookie` once the object behind `handle` dies.
+ *
+ * Notifications are delivered to looper threads, or to the requesting thread
+ * while it is not a looper. The driver allows one notification per handle and
+ * process.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param handle The handle to watch.
+ * @param cookie A value identifying the notification.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_request_death_notification(binder_ctx *ctx, int32_t handle,
+                                      binder_uintptr_t cookie);
+
+/**
+ * Queues a `BC_CLEAR_DEATH_NOTIFICATION` to cancel a notification requested
+ * with the same `handle` and `cookie`. A `BR_DEAD_BINDER` already underway is
+ * still delivered.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure.
+ * @param handle The watched handle.
+ * @param cookie The cookie of the notification.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_clear_death_notification(binder_ctx *ctx, int32_t handle,
+                                    binder_uintptr_t cookie);
+
+/**
+ * Sets the handler called for each `BR_DEAD_BINDER` received by the context or
+ * any of its clones, before `BC_DEAD_BINDER_DONE` is queued. It is shared by
+ * the whole process, and is meant to be set before other threads start using
+ * the device.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure, or one of its clones.
+ * @param handler The handler, or NULL to only acknowledge notifications.
+ * @param arg An argument passed to `handler`.
+ */
+void binder_set_death_handler(binder_ctx *ctx, binder_death_handler_t handler,
+                              void *arg);
+
+/**
+ * Gets the handler set with `binder_set_death_handler`, e.g. to chain to it.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure, or one of its clones.
+ * @param handler Receives the handler, or NULL.
+ * @param arg Receives the argument of the handler.
+ */
+void binder_get_death_handler(binder_ctx *ctx, binder_death_handler_t *handler,
+                              void **arg);
+
+/**
+ * Queues the `BC_FREE_BUFFER` to free a transaction buffer.
  *
  * @param ctx A pointer to the `binder_ctx` structure representing the Binder
  *            context.
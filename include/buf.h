@@ -23,19 +23,32 @@
 #include <stdio.h>
 #include <unistd.h>
 
+#define BUF_INLINE_SIZE 0x200
+
 /**
  * A buffer used for Binder write/read operations.
  *
- * @buffer: The buffer.
+ * Small buffers use the inline storage, so that they can live on the stack
+ * without any allocation. Larger capacities are allocated on the heap with
+ * `buf_alloc_size` or `buf_reserve`. As `buffer` may point into the structure
+ * itself, a `buf_t` must not be copied by value.
+ *
+ * `buf_init_*` set a buffer up with its inline storage, while `buf_reset_*`
+ * rewind it and keep its current storage. Heap storage is released by
+ * `buf_free` or, for buffers not obtained from `buf_alloc*`, `buf_release`.
+ *
+ * @buffer: The buffer, either `inline_buffer` or heap storage.
  * @ptr: Current position for writing or reading within the buffer.
  * @size: The number of bytes currently used in the buffer.
  * @max_size: The maximum capacity of the buffer.
+ * @inline_buffer: The inline storage.
  */
 typedef struct {
-  unsigned char buffer[0x200];
+  unsigned char *buffer;
   unsigned char *ptr;
   size_t size;
   size_t max_size;
+  unsigned char inline_buffer[BUF_INLINE_SIZE];
 } buf_t;
 
 #ifdef __cplusplus
@@ -43,9 +56,14 @@ extern "C" {
 #endif
 
 buf_t *buf_alloc();
+buf_t *buf_alloc_size(size_t capacity);
 void buf_free(buf_t *b);
 void buf_init_write(buf_t *b);
 void buf_init_read(buf_t *b);
+void buf_reset_write(buf_t *b);
+void buf_reset_read(buf_t *b);
+int buf_reserve(buf_t *b, size_t capacity);
+void buf_release(buf_t *b);
 
 void *buf_push(buf_t *b, size_t size);
 void *buf_pop(buf_t *b, size_t size);
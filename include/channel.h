@@ -0,0 +1,158 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "binder.h"
+
+#define BINDER_CHANNEL_MIN_CAPACITY 0x1000
+#define BINDER_CHANNEL_MAX_CAPACITY 0x40000000
+
+/*
+ * Operations of channel transactions, in their first word
+ */
+#define BINDER_CHANNEL_OP_SETUP 1
+#define BINDER_CHANNEL_OP_MESSAGE 2
+
+/**
+ * A one-way stream of messages between two processes, through a ring buffer
+ * in shared memory.
+ *
+ * The producer creates the ring in a memfd and hands it over with one
+ * `BINDER_CHANNEL_OP_SETUP` transaction, which the consumer answers with
+ * `binder_channel_accept`. Messages are then copied into the ring without
+ * entering the kernel. A consumer that runs dry announces it in the ring and
+ * sleeps on a socket pair, which the producer writes to only when announced,
+ * and which hangs up when the producer exits or crashes.
+ *
+ * Messages that do not fit the ring, because it is full or they are larger
+ * than half of it, fall back to a two-way `BINDER_CHANNEL_OP_MESSAGE`
+ * transaction carrying them as a blob. The consumer first drains the ring up
+ * to the position the producer had reached, so messages keep their order, and
+ * the producer waits for the reply, which throttles it to the pace of the
+ * consumer.
+ *
+ * Each end is used by one thread at a time, except for the fallback
+ * transactions, which the consumer may handle on any thread.
+ */
+typedef struct binder_channel binder_channel_t;
+
+/**
+ * Handles a message received on a channel.
+ *
+ * @param data The message, which the producer may still modify for a ring
+ *             message: it is only valid until the handler returns, and must
+ *             be validated on its copies.
+ * @param len The length of the message.
+ * @param arg The argument given to `binder_channel_accept`.
+ */
+typedef void (*binder_channel_handler_t)(const void *data, size_t len,
+                                         void *arg);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Creates a channel and hands its consumer end to the node `handle` with a
+ * setup transaction of `code`. The transaction carries file descriptors, so
+ * the node must accept them: it must have been published with
+ * `FLAT_BINDER_FLAG_ACCEPTS_FDS`, e.g. with `trdata_put_binder_flags` or
+ * `binder_set_context_manager_ext`.
+ *
+ * @param ctx The context of the calling thread.
+ * @param handle The handle of the consumer.
+ * @param code The transaction code of the setup and fallback transactions.
+ * @param capacity The size of the ring, rounded up to a power of two.
+ * @return A pointer to the producer end on success, or NULL on failure.
+ */
+binder_channel_t *binder_channel_connect(binder_ctx *ctx, int32_t handle,
+                                         uint32_t code, size_t capacity);
+
+/**
+ * Sends a message, through the ring or else with a fallback transaction.
+ *
+ * @param ch A pointer to the producer end.
+ * @param ctx The context of the calling thread, for fallback transactions.
+ * @param data The message.
+ * @param len The length of the message.
+ * @return 0 on success, or -1 on error, with `errno` set to `EPIPE` once the
+ *         consumer closed, or died with the ring full.
+ */
+int binder_channel_send(binder_channel_t *ch, binder_ctx *ctx,
+                        const void *data, size_t len);
+
+/**
+ * Returns the operation of a channel transaction, or 0 for other data.
+ */
+uint32_t binder_channel_op(const translated_data_t *txnin);
+
+/**
+ * Accepts a channel from a `BINDER_CHANNEL_OP_SETUP` transaction, and writes
+ * the reply to send back.
+ *
+ * @param txnin The setup transaction.
+ * @param reply The reply.
+ * @param handler The handler of the messages.
+ * @param arg An argument passed to `handler`.
+ * @return A pointer to the consumer end on success, or NULL on failure.
+ */
+binder_channel_t *binder_channel_accept(translated_data_t *txnin,
+                                        translation_data_t *reply,
+                                        binder_channel_handler_t handler,
+                                        void *arg);
+
+/**
+ * Handles a `BINDER_CHANNEL_OP_MESSAGE` transaction of the channel: drains
+ * the ring up to the message and passes the message to the handler.
+ *
+ * @param ch A pointer to the consumer end.
+ * @param txnin The fallback transaction.
+ * @return 0 on success, or a negative status code to reply with.
+ */
+int binder_channel_handle_txn(binder_channel_t *ch, translated_data_t *txnin);
+
+/**
+ * Passes the messages available in the ring to the handler, waiting for some
+ * if there are none.
+ *
+ * @param ch A pointer to the consumer end.
+ * @param timeout_ms The time to wait for, in milliseconds, or -1 to wait
+ *                   until a message arrives.
+ * @return The number of messages handled, 0 if the timeout expired, or -1 on
+ *         error, with `errno` set to `EPIPE` once the producer closed or exited
+ *         and the ring is drained.
+ */
+int binder_channel_recv(binder_channel_t *ch, int timeout_ms);
+
+/**
+ * Closes an end of a channel, waking the other end, and frees it. The
+ * consumer end must not be closed while its fallback transactions are being
+ * handled.
+ *
+ * @param ch A pointer to the producer or consumer end.
+ */
+void binder_channel_destroy(binder_channel_t *ch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // CHANNEL_H
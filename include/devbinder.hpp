@@ -0,0 +1,541 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DEVBINDER_HPP
+#define DEVBINDER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "binder.h"
+#include "transaction.h"
+#include "unicode.h"
+
+/*
+ * A header-only C++17 layer over the C API.
+ *
+ * Ownership is tied to object lifetimes: a `Context` closes its device, a
+ * `Parcel` frees its storage and a `Buffer` hands its received transaction
+ * back to the driver. All three are move-only. Errors are reported the same
+ * way as in C, through return values and `errno`.
+ */
+namespace devbinder {
+
+/**
+ * Outgoing transaction data.
+ *
+ * A `translation_data_t`, which starts in inline storage and spills to the
+ * heap as it grows. Typed writes of fitting values are inlined as direct
+ * stores.
+ */
+class Parcel {
+ public:
+  Parcel() noexcept { trdata_init(&data_); }
+  ~Parcel() { trdata_release(&data_); }
+
+  Parcel(const Parcel &) = delete;
+  Parcel &operator=(const Parcel &) = delete;
+
+  Parcel(Parcel &&other) noexcept { take(other); }
+
+  Parcel &operator=(Parcel &&other) noexcept {
+    if (this != &other) {
+      trdata_release(&data_);
+      take(other);
+    }
+    return *this;
+  }
+
+  /**
+   * Appends a trivially copyable value, padded to 4 bytes with zeroes.
+   *
+   * @return true on success, or false if the parcel failed to grow.
+   */
+  template <typename T>
+  bool write(const T &value) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "Parcel::write needs a trivially copyable type");
+    constexpr size_t size = (sizeof(T) + 3) & ~size_t(3);
+    uint8_t *ptr;
+
+    if (size <= data_.data_avail) {
+      ptr = data_.data_ptr;
+      data_.data_ptr += size;
+      data_.data_avail -= size;
+    } else {
+      ptr = static_cast<uint8_t *>(trdata_alloc(&data_, sizeof(T), false));
+      if (!ptr)
+        return false;
+    }
+
+    if constexpr (size != sizeof(T))
+      std::memset(ptr + sizeof(T), 0, size - sizeof(T));
+    std::memcpy(ptr, &value, sizeof(T));
+    return true;
+  }
+
+  // Like `write`, the writers below return true on success, or false if the
+  // parcel failed to grow, in which case nothing is appended
+
+  bool write_bytes(const void *data, size_t len) {
+    return !trdata_put_bytes(&data_, static_cast<const char *>(data), len);
+  }
+
+  bool write_str(const char *str) { return !trdata_put_str(&data_, str); }
+  bool write_str16(const char *str) { return !trdata_put_str16(&data_, str); }
+
+  bool write_handle(uint32_t handle, bool strong = true) {
+    return !trdata_put_handle(&data_, handle, strong);
+  }
+
+  /**
+   * Appends a local binder. Pass `FLAT_BINDER_FLAG_ACCEPTS_FDS` in `flags`
+   * for transactions to the node to carry file descriptors.
+   */
+  bool write_binder(binder_uintptr_t ptr, bool strong = true,
+                    uint32_t flags = 0) {
+    return !trdata_put_binder_flags(&data_, ptr, 0, strong, flags);
+  }
+
+  /**
+   * Appends regions of caller memory, gathered by the driver when the
+   * transaction is sent. They must outlive the call that sends it.
+   */
+  bool write_regions(const trdata_region_t *regions, size_t count) {
+    return !trdata_put_regions(&data_, regions, count);
+  }
+
+  bool write_fd(int fd, binder_uintptr_t cookie = 0) {
+    return !trdata_put_fd(&data_, fd, cookie);
+  }
+
+  /**
+   * Appends file descriptors, sent by reference: `fds` must outlive the call
+   * that sends the transaction.
+   */
+  bool write_fd_array(const int *fds, size_t count) {
+    return !trdata_put_fd_array(&data_, fds, count);
+  }
+
+  /**
+   * Appends a blob, inline or in a sealed memfd owned by the parcel
+   * depending on its size.
+   */
+  bool write_blob(const void *data, size_t size) {
+    return !trdata_put_blob(&data_, data, size);
+  }
+
+  /**
+   * Empties the parcel, keeping its storage.
+   */
+  void reset() noexcept { trdata_reset(&data_); }
+
+  size_t size() const noexcept { return data_.data_ptr - data_.data; }
+  const uint8_t *data() const noexcept { return data_.data; }
+
+  translation_data_t *get() noexcept { return &data_; }
+  const translation_data_t *get() const noexcept { return &data_; }
+
+ private:
+  // The data and offsets may point into the inline storage of `other`, in
+  // which case they are copied rather than stolen
+  void take(Parcel &other) noexcept {
+    translation_data_t *src = &other.data_;
+    size_t data_used = src->data_ptr - src->data;
+    size_t offs_used = src->offs_ptr - src->offs;
+
+    trdata_init(&data_);
+
+    if (src->data == src->data_inline) {
+      std::memcpy(data_.data_inline, src->data_inline, data_used);
+    } else {
+      data_.data = src->data;
+      data_.data_avail = src->data_avail + data_used;
+    }
+    data_.data_ptr = data_.data + data_used;
+    data_.data_avail -= data_used;
+
+    if (src->offs == src->offs_inline) {
+      std::memcpy(data_.offs_inline, src->offs_inline,
+                  offs_used * sizeof(binder_size_t));
+    } else {
+      data_.offs = src->offs;
+      data_.offs_avail = src->offs_avail + offs_used;
+    }
+    data_.offs_ptr = data_.offs + offs_used;
+    data_.offs_avail -= offs_used;
+
+    data_.buffers_size = src->buffers_size;
+    data_.owned_fds_count = src->owned_fds_count;
+    std::memcpy(data_.owned_fds, src->owned_fds,
+                src->owned_fds_count * sizeof(int));
+
+    // The heap storage and descriptors now belong to this parcel
+    trdata_init(src);
+  }
+
+  translation_data_t data_;
+};
+
+/**
+ * A blob read from a `Buffer`, unmapping memfd blobs when destroyed.
+ */
+class Blob {
+ public:
+  Blob() noexcept : blob_() {}
+  ~Blob() { txnin_blob_release(&blob_); }
+
+  Blob(const Blob &) = delete;
+  Blob &operator=(const Blob &) = delete;
+
+  Blob(Blob &&other) noexcept : blob_(other.blob_) { other.blob_ = {}; }
+
+  Blob &operator=(Blob &&other) noexcept {
+    if (this != &other) {
+      txnin_blob_release(&blob_);
+      blob_ = other.blob_;
+      other.blob_ = {};
+    }
+    return *this;
+  }
+
+  const void *data() const noexcept { return blob_.data; }
+  size_t size() const noexcept { return blob_.size; }
+
+  explicit operator bool() const noexcept { return blob_.data != nullptr; }
+
+ private:
+  friend class Buffer;
+
+  txnin_blob_t blob_;
+};
+
+/**
+ * A received transaction or reply.
+ *
+ * The data stays in the memory-mapped region and is read in place; the buffer
+ * is freed with `BC_FREE_BUFFER` when the `Buffer` is destroyed or reset.
+ */
+class Buffer {
+ public:
+  Buffer() noexcept : ctx_(nullptr), txnin_() {}
+  ~Buffer() { reset(); }
+
+  Buffer(const Buffer &) = delete;
+  Buffer &operator=(const Buffer &) = delete;
+
+  Buffer(Buffer &&other) noexcept : ctx_(other.ctx_), txnin_(other.txnin_) {
+    other.ctx_ = nullptr;
+  }
+
+  Buffer &operator=(Buffer &&other) noexcept {
+    if (this != &other) {
+      reset();
+      ctx_ = other.ctx_;
+      txnin_ = other.txnin_;
+      other.ctx_ = nullptr;
+    }
+    return *this;
+  }
+
+  /**
+   * Reads a trivially copyable value.
+   *
+   * @return true on success, or false, leaving `*value` untouched, if the
+   *         data is exhausted.
+   */
+  template <typename T>
+  bool read(T *value) noexcept {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "Buffer::read needs a trivially copyable type");
+    constexpr size_t size = (sizeof(T) + 3) & ~size_t(3);
+
+    if (size > txnin_.data_avail)
+      return false;
+
+    std::memcpy(value, txnin_.data_ptr, sizeof(T));
+    txnin_.data_ptr += size;
+    txnin_.data_avail -= size;
+    return true;
+  }
+
+  /**
+   * Reads a trivially copyable value, or returns a value-initialised one if
+   * the data is exhausted.
+   */
+  template <typename T>
+  T read() noexcept {
+    T value{};
+
+    read(&value);
+    return value;
+  }
+
+  const void *read_bytes(size_t len) noexcept {
+    return txnin_pop(&txnin_, len);
+  }
+
+  uint32_t read_handle() noexcept { return txnin_pop_handle(&txnin_); }
+  void *read_buffer() noexcept { return txnin_pop_buffer(&txnin_); }
+  int read_fd() noexcept { return txnin_pop_fd(&txnin_); }
+
+  /**
+   * Reads a blob, which is empty if there is none or it cannot be mapped.
+   * Inline blobs are views into the buffer, which must outlive them.
+   */
+  Blob read_blob() noexcept {
+    Blob blob;
+
+    txnin_pop_blob(&txnin_, &blob.blob_);
+    return blob;
+  }
+
+  /**
+   * Reads a String16 as a view into the buffer, which is empty for a null
+   * or malformed string. A null string is consumed, while a malformed one
+   * sets `errno` to EBADMSG and is left in place.
+   */
+  std::u16string_view read_str16() noexcept {
+    const uint16_t *str;
+    size_t len;
+
+    str = txnin_pop_str16(&txnin_, &len);
+    if (!str)
+      return {};
+
+    return {reinterpret_cast<const char16_t *>(str), len};
+  }
+
+  /**
+   * Reads a String16 narrowed to UTF-8.
+   */
+  std::string read_str16_utf8() {
+    std::u16string_view view = read_str16();
+    const uint16_t *str = reinterpret_cast<const uint16_t *>(view.data());
+    std::string out(utf16_to_utf8_length(str, view.size()), '\0');
+
+    utf16_to_utf8(str, view.size(), out.data());
+    return out;
+  }
+
+  /**
+   * Frees the buffer, if any.
+   */
+  void reset() noexcept {
+    if (ctx_)
+      binder_free_buffer(ctx_, reinterpret_cast<binder_uintptr_t>(txnin_.data));
+    ctx_ = nullptr;
+  }
+
+  explicit operator bool() const noexcept { return ctx_ != nullptr; }
+
+  uint32_t code() const noexcept { return txnin_.code; }
+  uint32_t flags() const noexcept { return txnin_.flags; }
+  binder_uintptr_t target() const noexcept { return txnin_.target; }
+  binder_uintptr_t cookie() const noexcept { return txnin_.cookie; }
+  const uint8_t *data() const noexcept { return txnin_.data; }
+  size_t remaining() const noexcept { return txnin_.data_avail; }
+
+  translated_data_t *get() noexcept { return &txnin_; }
+
+ private:
+  friend class Context;
+
+  // Takes ownership of the buffer just received into `txnin_`
+  void adopt(binder_ctx *ctx) noexcept { ctx_ = ctx; }
+
+  binder_ctx *ctx_;
+  translated_data_t txnin_;
+};
+
+/**
+ * A Binder context, closed on destruction.
+ */
+class Context {
+ public:
+  Context() noexcept : ctx_(nullptr) {}
+
+  /**
+   * Opens `device`, which is checked with `operator bool`.
+   */
+  explicit Context(const char *device,
+                   const binder_open_opts_t *opts = nullptr) noexcept
+      : ctx_(opts ? binder_open_ex(device, opts) : binder_open(device)) {}
+
+  /**
+   * Adopts a context opened with the C API.
+   */
+  explicit Context(binder_ctx *ctx) noexcept : ctx_(ctx) {}
+
+  ~Context() { close(); }
+
+  Context(const Context &) = delete;
+  Context &operator=(const Context &) = delete;
+
+  Context(Context &&other) noexcept : ctx_(other.ctx_) {
+    other.ctx_ = nullptr;
+  }
+
+  Context &operator=(Context &&other) noexcept {
+    if (this != &other) {
+      close();
+      ctx_ = other.ctx_;
+      other.ctx_ = nullptr;
+    }
+    return *this;
+  }
+
+  /**
+   * Returns a context for another thread, sharing this one's device.
+   */
+  Context clone() const noexcept { return Context(binder_ctx_clone(ctx_)); }
+
+  void close() noexcept {
+    if (ctx_)
+      binder_close(ctx_);
+    ctx_ = nullptr;
+  }
+
+  /**
+   * Gives up ownership of the C context.
+   */
+  binder_ctx *release() noexcept { return std::exchange(ctx_, nullptr); }
+
+  binder_ctx *get() const noexcept { return ctx_; }
+  explicit operator bool() const noexcept { return ctx_ != nullptr; }
+
+  /**
+   * Sends a transaction and, unless it is `TF_ONE_WAY`, waits for the reply.
+   *
+   * @param reply Receives the reply, freeing what it held. May be NULL for
+   *              `TF_ONE_WAY` transactions.
+   * @return 0 on success, or a negative error code on failure.
+   */
+  int transact(int32_t handle, uint32_t code, const Parcel &data,
+               Buffer *reply = nullptr, uint32_t flags = 0) noexcept {
+    int ret;
+
+    if (reply)
+      reply->reset();
+
+    ret = binder_transact(ctx_, handle, code, flags, data.get(),
+                          reply ? reply->get() : nullptr);
+    if (ret == 0 && reply && !(flags & TF_ONE_WAY))
+      reply->adopt(ctx_);
+
+    return ret;
+  }
+
+  /**
+   * Waits for an incoming transaction.
+   *
+   * @param txn Receives the transaction, freeing what it held.
+   * @return 0 on success, or a negative error code on failure.
+   */
+  int recv(Buffer *txn) noexcept {
+    int ret;
+
+    txn->reset();
+    ret = binder_recv_txn(ctx_, txn->get());
+    if (ret == 0)
+      txn->adopt(ctx_);
+
+    return ret;
+  }
+
+  /**
+   * Replies to `txn`, frees it and waits for the next transaction into it,
+   * all within one ioctl.
+   *
+   * @return 0 on success, or a negative error code on failure.
+   */
+  int reply_and_recv(Buffer *txn, const Parcel *reply) noexcept {
+    int ret;
+
+    // The C call frees the buffer along with the reply
+    txn->ctx_ = nullptr;
+    ret = binder_reply_and_recv_txn(ctx_, txn->get(),
+                                    reply ? reply->get() : nullptr);
+    if (ret == 0)
+      txn->adopt(ctx_);
+
+    return ret;
+  }
+
+  /**
+   * Same as `reply_and_recv`, with a `TF_STATUS_CODE` reply.
+   */
+  int reply_status_and_recv(Buffer *txn, int32_t status) noexcept {
+    int ret;
+
+    txn->ctx_ = nullptr;
+    ret = binder_reply_status_and_recv_txn(ctx_, txn->get(), status);
+    if (ret == 0)
+      txn->adopt(ctx_);
+
+    return ret;
+  }
+
+  /**
+   * Serves transactions on this thread, like `binder_loop`. `handler` is
+   * called as `int(Buffer &txn, Parcel &reply)` and returns 0 to send
+   * `reply`, or a negative status code to send instead.
+   *
+   * @return The error that ended the loop.
+   */
+  template <typename Handler>
+  int loop(Handler &&handler) {
+    Parcel reply;
+    Buffer txn;
+    int ret, status;
+
+    binder_enter_looper(ctx_);
+
+    ret = recv(&txn);
+    while (ret == 0) {
+      reply.reset();
+      status = handler(txn, reply);
+      if (status < 0)
+        ret = reply_status_and_recv(&txn, status);
+      else
+        ret = reply_and_recv(&txn, &reply);
+    }
+
+    return ret;
+  }
+
+  int acquire_handle(int32_t handle) noexcept {
+    return binder_handle_acquire(ctx_, handle);
+  }
+
+  int release_handle(int32_t handle) noexcept {
+    return binder_handle_release(ctx_, handle);
+  }
+
+  int flush() noexcept { return binder_flush(ctx_); }
+
+ private:
+  binder_ctx *ctx_;
+};
+
+}  // namespace devbinder
+
+#endif  // DEVBINDER_HPP
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#include <errno.h>
+#include <linux/android/binder.h>
+#include <stdint.h>
+
+#include "binder.h"
+#include "transaction.h"
+
+/*
+ * Status returned by `binder_dispatch` for transactions without a handler
+ * (UNKNOWN_TRANSACTION in libbinder).
+ */
+#define BINDER_UNKNOWN_TRANSACTION (-EBADMSG)
+
+/**
+ * Routes incoming transactions to handlers registered per binder object
+ * (the cookie it was published with) and transaction code.
+ *
+ * Handlers are kept in an open-addressing hash table, so routing a
+ * transaction costs one hash and, in general, a single probe. The table is
+ * not synchronised: register handlers before dispatching.
+ */
+typedef struct binder_dispatcher binder_dispatcher_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Creates an empty dispatcher.
+ *
+ * @return A pointer to the dispatcher on success, or NULL on failure.
+ */
+binder_dispatcher_t *binder_dispatcher_create(void);
+
+/**
+ * Frees a dispatcher.
+ *
+ * @param d A pointer to the dispatcher.
+ */
+void binder_dispatcher_destroy(binder_dispatcher_t *d);
+
+/**
+ * Registers the handler of a transaction code on a binder object, replacing
+ * any previous one.
+ *
+ * @param d A pointer to the dispatcher.
+ * @param cookie The cookie of the target binder object (0 for the context
+ *               manager).
+ * @param code The transaction code.
+ * @param handler The transaction handler.
+ * @param arg An argument passed to `handler`.
+ * @return 0 on success, or a negative error code on failure.
+ */
+int binder_dispatcher_register(binder_dispatcher_t *d, binder_uintptr_t cookie,
+                               uint32_t code, binder_txn_handler_t handler,
+                               void *arg);
+
+/**
+ * Sets the handler of transactions without a registered handler. Without one,
+ * they are answered with `BINDER_UNKNOWN_TRANSACTION`.
+ *
+ * @param d A pointer to the dispatcher.
+ * @param handler The transaction handler, or NULL.
+ * @param arg An argument passed to `handler`.
+ */
+void binder_dispatcher_set_default(binder_dispatcher_t *d,
+                                   binder_txn_handler_t handler, void *arg);
+
+/**
+ * Calls the handler registered for `txnin`. This is a `binder_txn_handler_t`
+ * taking the dispatcher as argument, to be given to `binder_loop` or
+ * `binder_threadpool_start`, which free the buffer and send the reply.
+ *
+ * @param ctx The context the transaction was received on.
+ * @param txnin The incoming transaction.
+ * @param reply The reply.
+ * @param d A pointer to the dispatcher.
+ * @return The status returned by the handler, or
+ *         `BINDER_UNKNOWN_TRANSACTION`.
+ */
+int binder_dispatch(binder_ctx *ctx, translated_data_t *txnin,
+                    translation_data_t *reply, void *d);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // DISPATCHER_H
@@ -0,0 +1,122 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SERVICE_MANAGER_H
+#define SERVICE_MANAGER_H
+
+#include <stdint.h>
+
+#include "binder.h"
+
+#define BINDER_SVCMGR_INTERFACE "android.os.IServiceManager"
+
+/*
+ * Transaction codes of the classic servicemanager (Android 10 and earlier).
+ */
+#define BINDER_SVCMGR_GET_SERVICE 1
+#define BINDER_SVCMGR_CHECK_SERVICE 2
+#define BINDER_SVCMGR_ADD_SERVICE 3
+#define BINDER_SVCMGR_LIST_SERVICES 4
+
+/*
+ * Requests carry the work source header of Android 10 after the strict mode
+ * policy.
+ */
+#define BINDER_SVCMGR_WORK_SOURCE 0x1
+
+// The longest service name that is cached, terminator included. Longer names
+// are looked up without the cache.
+#define BINDER_SVCMGR_NAME_MAX 128
+#define BINDER_SVCMGR_CACHE_SIZE 256
+
+/**
+ * A client of the classic servicemanager protocol, caching the handles of
+ * the services it looked up.
+ *
+ * Lookups read the cache without locking, under a sequence counter, so that
+ * cached names cost no transaction and no atomic read-modify-write. The
+ * cache holds a strong reference on each handle, with a death notification
+ * evicting the handle once its service dies. Notifications are only
+ * delivered to processes running looper threads.
+ *
+ * A cached handle is owned by the cache: callers keeping it past the death
+ * of its service, or past the eviction of the oldest entries once the cache
+ * fills up, acquire it themselves.
+ */
+typedef struct binder_svcmgr binder_svcmgr_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Creates a client and installs its death handler, chained to the one in
+ * place.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure, or one of its clones.
+ * @param flags A combination of `BINDER_SVCMGR_*` flags.
+ * @return A pointer to the client on success, or NULL on failure.
+ */
+binder_svcmgr_t *binder_svcmgr_create(binder_ctx *ctx, uint32_t flags);
+
+/**
+ * Releases the cached handles, restores the previous death handler and frees
+ * the client. No other thread may be using the client or receiving
+ * notifications.
+ *
+ * @param sm A pointer to the client.
+ * @param ctx The context used to release the handles.
+ */
+void binder_svcmgr_destroy(binder_svcmgr_t *sm, binder_ctx *ctx);
+
+/**
+ * Looks up a service, from the cache or with a `CHECK_SERVICE` transaction.
+ *
+ * The handle of a name too long to be cached is not owned by the cache:
+ * `ctx` acquires it for the caller, who releases it with
+ * `binder_handle_release`.
+ *
+ * @param sm A pointer to the client.
+ * @param ctx The context of the calling thread.
+ * @param name The name of the service.
+ * @return The handle of the service, or -1 on error, with `errno` set to
+ *         `ENOENT` if the service is not registered.
+ */
+int32_t binder_svcmgr_get_service(binder_svcmgr_t *sm, binder_ctx *ctx,
+                                  const char *name);
+
+/**
+ * Registers a local object as a service with an `ADD_SERVICE` transaction.
+ *
+ * @param sm A pointer to the client.
+ * @param ctx The context of the calling thread.
+ * @param name The name of the service.
+ * @param ptr The address of the object.
+ * @param cookie The cookie of the object, which incoming transactions carry.
+ * @param flags The `FLAT_BINDER_FLAG_*` flags of the object, e.g.
+ *              `FLAT_BINDER_FLAG_ACCEPTS_FDS` for transactions to it to carry
+ *              file descriptors.
+ * @return 0 on success, or -1 on error.
+ */
+int binder_svcmgr_add_service(binder_svcmgr_t *sm, binder_ctx *ctx,
+                              const char *name, binder_uintptr_t ptr,
+                              binder_uintptr_t cookie, uint32_t flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // SERVICE_MANAGER_H
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <sys/ioctl.h>
+#include <stdint.h>
+
+#define BINDER_STATS_CMDS 32
+#define BINDER_STATS_LATENCY_BUCKETS 40
+
+/**
+ * The slot of a `BC_*` or `BR_*` command in `binder_stats_t`.
+ */
+#define BINDER_STATS_CMD(cmd) (_IOC_NR(cmd) % BINDER_STATS_CMDS)
+
+/**
+ * Counters of a Binder context.
+ *
+ * Each context counts its own activity without atomics, so counters are only
+ * reliable when read from the thread using the context. Counters of several
+ * contexts can be summed with `binder_stats_merge`.
+ *
+ * @ioctls: The number of ioctls issued, including retries.
+ * @write_bytes: The number of bytes consumed by the driver.
+ * @read_bytes: The number of bytes returned by the driver.
+ * @eintr: The number of `BINDER_WRITE_READ` retries after `EINTR`.
+ * @eagain: The number of non-blocking reads that found nothing.
+ * @bc: The number of each command written, by `BINDER_STATS_CMD`.
+ * @br: The number of each command read, by `BINDER_STATS_CMD`. This includes
+ *      `BR_FAILED_REPLY` and `BR_DEAD_REPLY`.
+ * @transactions: The number of round trips timed by `binder_transact`.
+ * @latency: Round trips by duration: bucket `i` counts durations in
+ *           [2^i, 2^(i+1)) nanoseconds, the last one everything longer.
+ */
+typedef struct {
+  uint64_t ioctls;
+  uint64_t write_bytes;
+  uint64_t read_bytes;
+  uint64_t eintr;
+  uint64_t eagain;
+  uint64_t bc[BINDER_STATS_CMDS];
+  uint64_t br[BINDER_STATS_CMDS];
+  uint64_t transactions;
+  uint64_t latency[BINDER_STATS_LATENCY_BUCKETS];
+} binder_stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Adds the counters of `src` to `dst`.
+ *
+ * @param dst A pointer to the `binder_stats_t` structure to add to.
+ * @param src A pointer to the `binder_stats_t` structure to add.
+ */
+void binder_stats_merge(binder_stats_t *dst, const binder_stats_t *src);
+
+/**
+ * Estimates a percentile of the round-trip latency.
+ *
+ * @param stats A pointer to the `binder_stats_t` structure.
+ * @param p The percentile, between 0 and 1.
+ * @return The upper bound in nanoseconds of the bucket holding the
+ *         percentile, or 0 if no round trip was timed.
+ */
+uint64_t binder_stats_latency_percentile(const binder_stats_t *stats, double p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // STATS_H
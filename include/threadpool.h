@@ -0,0 +1,75 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdint.h>
+
+#include "binder.h"
+#include "transaction.h"
+
+typedef struct binder_threadpool binder_threadpool_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Starts a pool of looper threads serving transactions on `ctx`.
+ *
+ * One looper thread is started right away (`BC_ENTER_LOOPER`). Further
+ * threads are spawned (`BC_REGISTER_LOOPER`) whenever the driver asks for
+ * them with `BR_SPAWN_LOOPER`, up to `max_threads`. Each thread uses its own
+ * context from `binder_ctx_clone` and calls `handler` for the transactions it
+ * receives.
+ *
+ * @param ctx A pointer to the `binder_ctx` structure. It must outlive the pool.
+ * @param max_threads The maximum number of threads spawned on request of the
+ *                    driver. (BINDER_SET_MAX_THREADS)
+ * @param handler The transaction handler.
+ * @param arg An argument passed to `handler`.
+ * @return A pointer to the pool on success, or NULL on failure.
+ */
+binder_threadpool_t *binder_threadpool_start(binder_ctx *ctx,
+                                             uint32_t max_threads,
+                                             binder_txn_handler_t handler,
+                                             void *arg);
+
+/**
+ * Asks the looper threads of the pool to exit: each one finishes the
+ * transaction it is handling, if any, then leaves the looper
+ * (`BC_EXIT_LOOPER`) instead of waiting for the next one. No thread is
+ * spawned anymore. Returns without waiting; see `binder_threadpool_join`.
+ *
+ * @param pool A pointer to the pool.
+ */
+void binder_threadpool_stop(binder_threadpool_t *pool);
+
+/**
+ * Waits for all the looper threads of the pool to exit, and frees the pool.
+ * Looper threads exit after `binder_threadpool_stop`, or when receiving
+ * transactions fails, e.g. once the context is closed.
+ *
+ * @param pool A pointer to the pool.
+ */
+void binder_threadpool_join(binder_threadpool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // THREADPOOL_H
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BINDER_TRACE_MAGIC 0x43525442  // "BTRC"
+#define BINDER_TRACE_VERSION 1
+
+/**
+ * A command crossing the driver, as recorded by the trace.
+ *
+ * @ticks: The timestamp, in ticks of the trace clock.
+ * @tid: The thread issuing the ioctl.
+ * @cmd: The `BC_*` or `BR_*` command.
+ * @target: For transactions and replies, the handle (`BC_*`) or the node
+ *          pointer (`BR_*`). For other commands, their first argument.
+ * @code: The transaction code.
+ * @flags: The transaction flags.
+ * @data_size: The size of the transaction data.
+ * @offsets_size: The size of the transaction offsets.
+ */
+typedef struct {
+  uint64_t ticks;
+  uint32_t tid;
+  uint32_t cmd;
+  uint64_t target;
+  uint32_t code;
+  uint32_t flags;
+  uint32_t data_size;
+  uint32_t offsets_size;
+} binder_trace_event_t;
+
+/**
+ * The header of a trace file, followed by `count` events.
+ *
+ * Ticks convert to nanoseconds with the two calibration points: `ns` =
+ * `ns0` + (`ticks` - `ticks0`) * (`ns1` - `ns0`) / (`ticks1` - `ticks0`).
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t event_size;
+  uint32_t count;
+  uint64_t ticks0;
+  uint64_t ns0;
+  uint64_t ticks1;
+  uint64_t ns1;
+} binder_trace_header_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Whether commands are being recorded. Read it atomically.
+ */
+extern bool binder_trace_enabled;
+
+/**
+ * Starts recording every command written to and read from the driver.
+ *
+ * Each thread records into its own ring of `events` entries (rounded up to a
+ * power of two), so recording takes no lock. Rings are kept once their thread
+ * exits, for the next thread to reuse.
+ *
+ * @param events The capacity of each per-thread ring.
+ * @return 0 on success, or -1 on error.
+ */
+int binder_trace_enable(size_t events);
+
+/**
+ * Stops recording. Recorded events are kept for `binder_trace_dump`.
+ */
+void binder_trace_disable(void);
+
+/**
+ * Writes the recorded events to a file descriptor, as a
+ * `binder_trace_header_t` followed by the events of each ring from oldest to
+ * newest. Events recorded during the dump may be torn.
+ *
+ * @param fd The file descriptor to write to.
+ * @return 0 on success, or -1 on error.
+ */
+int binder_trace_dump(int fd);
+
+/**
+ * Records the commands of a buffer exchanged with the driver.
+ *
+ * @param buffer The commands.
+ * @param size The size of the commands in bytes.
+ */
+void binder_trace_cmds(const void *buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // TRACE_H
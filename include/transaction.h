@@ -23,24 +23,113 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define TRDATA_INLINE_DATA_SIZE 0x100
+#define TRDATA_INLINE_OFFS_COUNT 0x8
+#define TRDATA_OWNED_FDS_MAX 4
+
+// Blobs larger than this are sent in a memfd, see `trdata_put_blob`
+#define TRDATA_BLOB_THRESHOLD 0x10000
+
+/*
+ * Blob encodings, which lead the blob in the transaction data along with its
+ * 64-bit size
+ */
+#define TRDATA_BLOB_INLINE 1
+#define TRDATA_BLOB_MEMFD 2
+
+/**
+ * Outgoing transaction data.
+ *
+ * The data and offsets start in the inline storage and move to the heap,
+ * growing geometrically, once they outgrow it. `trdata_init` sets up a fresh
+ * structure, `trdata_reset` empties it while keeping its storage and
+ * `trdata_release` frees its heap storage. As `data` and `offs` may point into
+ * the structure itself, it must not be copied by value.
+ *
+ * `trdata_pool_get` and `trdata_pool_put` recycle heap-allocated instances
+ * through a per-thread pool, so that steady-state transactions do not
+ * allocate.
+ *
+ * The memfds created by `trdata_put_blob` are owned by the structure, and
+ * closed by `trdata_reset`, `trdata_release` and `trdata_pool_put`.
+ */
 typedef struct {
-  uint8_t data[0x10000];
+  uint8_t *data;
   uint8_t *data_ptr;
   size_t data_avail;
-  binder_size_t offs[0x1000];
+  binder_size_t *offs;
   binder_size_t *offs_ptr;
   size_t offs_avail;
   size_t buffers_size;
+  size_t owned_fds_count;
+  int owned_fds[TRDATA_OWNED_FDS_MAX];
+  binder_size_t offs_inline[TRDATA_INLINE_OFFS_COUNT];
+  uint8_t data_inline[TRDATA_INLINE_DATA_SIZE];
 } translation_data_t;
 
+/**
+ * A region of caller memory sent by reference in a scatter-gather
+ * transaction.
+ *
+ * Regions form a tree: a region with a `parent` holds the pointer to its
+ * parent's copy at `parent_offset` into the parent, which the driver rewrites
+ * to point at the region's copy in the receiver.
+ *
+ * @base: The start of the region.
+ * @len: The length of the region.
+ * @parent: The index of the parent region, or -1 for a root.
+ * @parent_offset: The offset of the pointer to this region in its parent.
+ */
+typedef struct {
+  const void *base;
+  size_t len;
+  ssize_t parent;
+  size_t parent_offset;
+} trdata_region_t;
+
+/**
+ * A blob received with `txnin_pop_blob`.
+ *
+ * @data: The contents of the blob, which stay valid until the transaction
+ *        buffer is freed for inline blobs, or until `txnin_blob_release` for
+ *        memfd blobs.
+ * @size: The size of the blob.
+ * @map: The read-only mapping of a memfd blob, or NULL.
+ * @map_size: The size of `map`.
+ */
+typedef struct {
+  const void *data;
+  size_t size;
+  void *map;
+  size_t map_size;
+} txnin_blob_t;
+
+/**
+ * Incoming transaction data.
+ *
+ * A reader over the transaction buffer in the memory-mapped region: every
+ * `txnin_pop*` returns a view into the buffer rather than a copy, and fails
+ * instead of reading past the end. Objects are only handed out where the
+ * offsets array says one lies, with a size matching their type, so that plain
+ * data can never be reinterpreted as an object. The offsets are walked with a
+ * cursor, which keeps sequential reads O(1) per object.
+ *
+ * `txnin_pop_str16` returns NULL both for a null String16, whose length it
+ * consumes, and for a malformed one, which it leaves in place with `errno` set
+ * to EBADMSG.
+ */
 typedef struct {
   uint8_t *data;
   uint8_t *data_ptr;
   size_t data_avail;
+  const binder_size_t *offs;
+  size_t offs_count;
+  size_t offs_next;
 
   binder_uintptr_t target;
   binder_uintptr_t cookie;
   uint32_t code;
+  uint32_t flags;
 } translated_data_t;
 
 #ifdef __cplusplus
@@ -48,28 +137,54 @@ extern "C" {
 #endif
 
 void trdata_init(translation_data_t *trdata);
+void trdata_reset(translation_data_t *trdata);
+void trdata_release(translation_data_t *trdata);
+translation_data_t *trdata_pool_get(void);
+void trdata_pool_put(translation_data_t *trdata);
 void *trdata_alloc(translation_data_t *trdata, size_t size, bool obj);
 struct flat_binder_object *trdata_alloc_fbo(translation_data_t *trdata);
 struct binder_buffer_object *trdata_alloc_bbo(translation_data_t *trdata,
                                               binder_size_t length);
-void trdata_put_u32(translation_data_t *trdata, uint32_t n);
-void trdata_put_bytes(translation_data_t *trdata, const char *data, size_t len);
-void trdata_put_str(translation_data_t *trdata, const char *str);
-void trdata_put_str16(translation_data_t *trdata, const char *str);
-void trdata_put_buffer(translation_data_t *trdata, binder_uintptr_t buffer,
-                       binder_size_t length, binder_size_t parent,
-                       binder_size_t parent_offset, bool has_parent);
-void trdata_put_binder(translation_data_t *trdata, binder_uintptr_t ptr,
-                       bool strong);
-void trdata_put_handle(translation_data_t *trdata, uint32_t handle,
-                       bool strong);
+int trdata_put_u32(translation_data_t *trdata, uint32_t n);
+int trdata_put_bytes(translation_data_t *trdata, const char *data, size_t len);
+int trdata_put_str(translation_data_t *trdata, const char *str);
+int trdata_put_str16(translation_data_t *trdata, const char *str);
+int trdata_put_buffer(translation_data_t *trdata, binder_uintptr_t buffer,
+                      binder_size_t length, binder_size_t parent,
+                      binder_size_t parent_offset, bool has_parent);
+int trdata_put_regions(translation_data_t *trdata,
+                       const trdata_region_t *regions, size_t count);
+int trdata_put_binder(translation_data_t *trdata, binder_uintptr_t ptr,
+                      bool strong);
+int trdata_put_binder_flags(translation_data_t *trdata, binder_uintptr_t ptr,
+                            binder_uintptr_t cookie, bool strong,
+                            uint32_t flags);
+int trdata_put_handle(translation_data_t *trdata, uint32_t handle,
+                      bool strong);
+int trdata_put_fd(translation_data_t *trdata, int fd, binder_uintptr_t cookie);
+int trdata_put_fd_array(translation_data_t *trdata, const int *fds,
+                        size_t count);
+void trdata_set_blob_threshold(size_t threshold);
+int trdata_put_blob(translation_data_t *trdata, const void *data, size_t size);
 
 void txnin_init(translated_data_t *txnin, struct binder_transaction_data *tr);
 void *txnin_pop(translated_data_t *txnin, size_t size);
 uint32_t txnin_pop_u32(translated_data_t *txnin);
 int32_t txnin_pop_i32(translated_data_t *txnin);
+const uint16_t *txnin_pop_str16(translated_data_t *txnin, size_t *len);
+char *txnin_pop_str16_utf8(translated_data_t *txnin, char *buf, size_t size);
 uint32_t txnin_pop_handle(translated_data_t *txnin);
 void *txnin_pop_buffer(translated_data_t *txnin);
+int txnin_pop_fd(translated_data_t *txnin);
+const int *txnin_pop_fd_array(translated_data_t *txnin, size_t *count);
+int txnin_pop_blob(translated_data_t *txnin, txnin_blob_t *blob);
+void txnin_blob_release(txnin_blob_t *blob);
+void *txnin_pop_object(translated_data_t *txnin, uint32_t type);
+size_t txnin_object_count(const translated_data_t *txnin);
+const struct binder_object_header *txnin_object_at(
+    const translated_data_t *txnin, size_t index);
+const struct binder_object_header *txnin_next_object(
+    const translated_data_t *txnin, uint32_t type, size_t *index);
 
 #ifdef __cplusplus
 }
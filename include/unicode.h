@@ -0,0 +1,65 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UNICODE_H
+#define UNICODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Converts UTF-8 to UTF-16.
+ *
+ * Invalid sequences (overlong forms, surrogates, code points past U+10FFFF or
+ * truncated sequences) become U+FFFD, one per offending byte, so the output
+ * never has more units than the input has bytes.
+ *
+ * @param src The UTF-8 input.
+ * @param len The length of the input in bytes.
+ * @param dst The output, with room for `len` units.
+ * @return The number of units written.
+ */
+size_t utf8_to_utf16(const char *src, size_t len, uint16_t *dst);
+
+/**
+ * Returns the length in bytes of the UTF-8 form of a UTF-16 string, as
+ * written by `utf16_to_utf8`.
+ *
+ * @param src The UTF-16 input.
+ * @param len The length of the input in units.
+ * @return The length of the UTF-8 form, without a terminator.
+ */
+size_t utf16_to_utf8_length(const uint16_t *src, size_t len);
+
+/**
+ * Converts UTF-16 to UTF-8. Unpaired surrogates become U+FFFD.
+ *
+ * @param src The UTF-16 input.
+ * @param len The length of the input in units.
+ * @param dst The output, with room for `utf16_to_utf8_length` bytes.
+ * @return The number of bytes written.
+ */
+size_t utf16_to_utf8(const uint16_t *src, size_t len, char *dst);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // UNICODE_H
@@ -0,0 +1,235 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "batch.h"
+
+#include <errno.h>
+#include <linux/android/binder.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "transaction.h"
+#include "util.h"
+
+#define PAD4(s) (((s) + 3) & ~3UL)
+
+/* The header of a batch: `BINDER_BATCH_MAGIC` and the frame count. */
+#define BATCH_HEADER_SIZE (2 * sizeof(uint32_t))
+
+struct binder_batch {
+  int32_t handle;
+  uint32_t code;
+  size_t max_bytes;
+  size_t max_count;
+  uint64_t max_delay_ns;
+
+  uint32_t count;
+  size_t bytes;
+  uint64_t first_ns;
+  translation_data_t trdata;
+};
+
+static uint64_t batch_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int batch_reset(binder_batch_t *batch) {
+  uint32_t *header;
+
+  trdata_reset(&batch->trdata);
+  batch->count = 0;
+  batch->bytes = 0;
+
+  header = trdata_alloc(&batch->trdata, BATCH_HEADER_SIZE, false);
+  if (!header)
+    return -1;
+  header[0] = BINDER_BATCH_MAGIC;
+  header[1] = 0;
+  return 0;
+}
+
+binder_batch_t *binder_batch_create(int32_t handle, uint32_t code,
+                                    const binder_batch_opts_t *opts) {
+  binder_batch_t *batch;
+
+  batch = calloc(1, sizeof(*batch));
+  if (!batch) {
+    ERR("Failed to allocate batch");
+    return NULL;
+  }
+
+  batch->handle = handle;
+  batch->code = code;
+  batch->max_bytes = BINDER_BATCH_MAX_BYTES;
+  batch->max_count = BINDER_BATCH_MAX_COUNT;
+  batch->max_delay_ns = BINDER_BATCH_MAX_DELAY_NS;
+  if (opts) {
+    if (opts->max_bytes)
+      batch->max_bytes = opts->max_bytes;
+    if (opts->max_count)
+      batch->max_count = opts->max_count;
+    if (opts->max_delay_ns)
+      batch->max_delay_ns = opts->max_delay_ns;
+  }
+
+  trdata_init(&batch->trdata);
+  batch_reset(batch);  // Cannot fail with inline storage
+  return batch;
+}
+
+int binder_batch_destroy(binder_batch_t *batch, binder_ctx *ctx) {
+  int ret;
+
+  if (!batch)
+    return 0;
+
+  ret = binder_batch_flush(batch, ctx);
+  trdata_release(&batch->trdata);
+  free(batch);
+  return ret;
+}
+
+int binder_batch_flush(binder_batch_t *batch, binder_ctx *ctx) {
+  int ret;
+
+  if (!batch->count)
+    return 0;
+
+  ((uint32_t *)batch->trdata.data)[1] = batch->count;
+  // Failures are expected under back-pressure, and left to the caller
+  ret = binder_transact(ctx, batch->handle, batch->code, TF_ONE_WAY,
+                        &batch->trdata, NULL);
+  if (ret < 0)
+    return -1;
+
+  return batch_reset(batch);
+}
+
+static bool batch_due(const binder_batch_t *batch, uint64_t now) {
+  return batch->count && now - batch->first_ns >= batch->max_delay_ns;
+}
+
+int binder_batch_add(binder_batch_t *batch, binder_ctx *ctx, const void *data,
+                     size_t len) {
+  size_t frame = sizeof(uint32_t) + PAD4(len);
+  uint8_t *ptr;
+
+  if (len > UINT32_MAX) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  if (batch->count &&
+      (batch->bytes + frame > batch->max_bytes ||
+       batch->count >= batch->max_count) &&
+      binder_batch_flush(batch, ctx) < 0)
+    return -1;
+
+  // A flush whose reset failed left the batch without its header, which
+  // must lead the frames
+  if (batch->trdata.data_ptr == batch->trdata.data && batch_reset(batch) < 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  ptr = trdata_alloc(&batch->trdata, frame, false);
+  if (!ptr) {
+    errno = ENOMEM;
+    return -1;
+  }
+  *(uint32_t *)ptr = len;
+  memcpy(ptr + sizeof(uint32_t), data, len);
+  memset(ptr + sizeof(uint32_t) + len, 0, PAD4(len) - len);
+
+  if (!batch->count++)
+    batch->first_ns = batch_now_ns();
+  batch->bytes += frame;
+
+  // The message is queued either way; a failed flush is retried later
+  if (batch->count >= batch->max_count || batch->bytes >= batch->max_bytes ||
+      batch_due(batch, batch_now_ns()))
+    binder_batch_flush(batch, ctx);
+  return 0;
+}
+
+int binder_batch_poll(binder_batch_t *batch, binder_ctx *ctx) {
+  if (!batch_due(batch, batch_now_ns()))
+    return 0;
+  return binder_batch_flush(batch, ctx);
+}
+
+int binder_batch_timeout_ms(const binder_batch_t *batch) {
+  uint64_t elapsed, left;
+
+  if (!batch->count)
+    return -1;
+
+  elapsed = batch_now_ns() - batch->first_ns;
+  if (elapsed >= batch->max_delay_ns)
+    return 0;
+
+  left = batch->max_delay_ns - elapsed;
+  return (left + 999999) / 1000000;
+}
+
+int binder_batch_iter_init(binder_batch_iter_t *iter,
+                           translated_data_t *txnin) {
+  const uint32_t *header;
+
+  header = txnin_pop(txnin, BATCH_HEADER_SIZE);
+  if (!header)
+    return -1;
+
+  if (header[0] != BINDER_BATCH_MAGIC) {
+    txnin->data_ptr -= BATCH_HEADER_SIZE;
+    txnin->data_avail += BATCH_HEADER_SIZE;
+    return -1;
+  }
+
+  iter->txnin = txnin;
+  iter->remaining = header[1];
+  return 0;
+}
+
+const void *binder_batch_iter_next(binder_batch_iter_t *iter, size_t *len) {
+  translated_data_t *txnin = iter->txnin;
+  const uint32_t *frame_len;
+  const void *data;
+
+  if (!iter->remaining)
+    return NULL;
+
+  frame_len = txnin_pop(txnin, sizeof(*frame_len));
+  if (!frame_len)
+    goto err;
+
+  data = txnin_pop(txnin, PAD4(*frame_len));
+  if (!data)
+    goto err;
+
+  iter->remaining--;
+  *len = *frame_len;
+  return data;
+
+err:
+  iter->remaining = 0;
+  return NULL;
+}
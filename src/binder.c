@@ -19,59 +19,494 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/android/binder.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "buf.h"
+#include "trace.h"
 #include "util.h"
 
+#define ALIGN8(s) (((s) + 7) & ~7UL)
+
+#define TRACKER_MIN_CAPACITY 64
+
+#define HANDLES_MIN_SIZE 16
+// Handles past this are counted by the driver alone
+#define HANDLES_MAX_SIZE 0x10000
+
+#define HANDLE_PENDING_STRONG 0x1
+#define HANDLE_PENDING_WEAK 0x2
+
+typedef struct {
+  binder_uintptr_t ptr;
+  size_t size;
+} tracker_entry_t;
+
+/*
+ * Received transaction buffers awaiting `BC_FREE_BUFFER`, keyed by address in
+ * an open-addressing hash table. Shared by a context and its clones.
+ */
+struct binder_buffer_tracker {
+  pthread_mutex_t lock;
+  tracker_entry_t *entries;
+  size_t capacity;  // Always a power of two
+  binder_buffer_stats_t stats;
+};
+
+static struct binder_buffer_tracker *tracker_create(size_t map_size) {
+  struct binder_buffer_tracker *t = calloc(1, sizeof(*t));
+  if (!t)
+    return NULL;
+
+  t->capacity = TRACKER_MIN_CAPACITY;
+  t->entries = calloc(t->capacity, sizeof(*t->entries));
+  if (!t->entries) {
+    free(t);
+    return NULL;
+  }
+
+  pthread_mutex_init(&t->lock, NULL);
+  t->stats.map_size = map_size;
+  return t;
+}
+
+static void tracker_destroy(struct binder_buffer_tracker *t) {
+  if (t) {
+    pthread_mutex_destroy(&t->lock);
+    free(t->entries);
+    free(t);
+  }
+}
+
+static int kernel_open(const char *device, int flags) {
+  return open(device, flags, 0);
+}
+
+static void *kernel_mmap(int fd, size_t size) {
+  return mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+}
+
+static int kernel_munmap(int fd, void *addr, size_t size) {
+  (void)fd;
+  return munmap(addr, size);
+}
+
+static int kernel_ioctl(int fd, unsigned long request, void *arg) {
+  return ioctl(fd, request, arg);
+}
+
+// Closing any descriptor of the device flushes it, which wakes its threads
+static int kernel_wake(int fd) {
+  int dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+  if (dup_fd < 0)
+    return -1;
+  return close(dup_fd);
+}
+
+const binder_backend_t binder_kernel_backend = {
+    .open = kernel_open,
+    .mmap = kernel_mmap,
+    .munmap = kernel_munmap,
+    .ioctl = kernel_ioctl,
+    .close = close,
+    .wake = kernel_wake,
+};
+
+static int binder_ioctl(binder_ctx *ctx, unsigned long request, void *arg) {
+  ctx->stats.ioctls++;
+  return ctx->backend->ioctl(ctx->fd, request, arg);
+}
+
+static size_t tracker_slot(binder_uintptr_t ptr, size_t capacity) {
+  // Buffers are 8-byte aligned; Fibonacci hashing spreads the rest
+  return (((uint64_t)ptr >> 3) * 0x9e3779b97f4a7c15ULL >> 32) & (capacity - 1);
+}
+
+static tracker_entry_t *tracker_find(tracker_entry_t *entries, size_t capacity,
+                                     binder_uintptr_t ptr) {
+  size_t i = tracker_slot(ptr, capacity);
+
+  while (entries[i].ptr && entries[i].ptr != ptr)
+    i = (i + 1) & (capacity - 1);
+
+  return &entries[i];
+}
+
+static int tracker_grow(struct binder_buffer_tracker *t) {
+  size_t i, capacity = t->capacity * 2;
+  tracker_entry_t *entries;
+
+  entries = calloc(capacity, sizeof(*entries));
+  if (!entries)
+    return -1;
+
+  for (i = 0; i < t->capacity; i++) {
+    if (t->entries[i].ptr)
+      *tracker_find(entries, capacity, t->entries[i].ptr) = t->entries[i];
+  }
+
+  free(t->entries);
+  t->entries = entries;
+  t->capacity = capacity;
+  return 0;
+}
+
+static void tracker_add(struct binder_buffer_tracker *t, binder_uintptr_t ptr,
+                        size_t size) {
+  tracker_entry_t *entry;
+  binder_buffer_stats_t *stats = &t->stats;
+
+  pthread_mutex_lock(&t->lock);
+
+  if ((stats->count + 1) * 2 > t->capacity && tracker_grow(t) < 0)
+    goto out;
+
+  entry = tracker_find(t->entries, t->capacity, ptr);
+  if (entry->ptr)
+    goto out;
+
+  entry->ptr = ptr;
+  entry->size = size;
+
+  stats->count++;
+  stats->bytes += size;
+  if (stats->count > stats->max_count)
+    stats->max_count = stats->count;
+  if (stats->bytes > stats->max_bytes)
+    stats->max_bytes = stats->bytes;
+
+out:
+  pthread_mutex_unlock(&t->lock);
+}
+
+static void tracker_remove(struct binder_buffer_tracker *t,
+                           binder_uintptr_t ptr) {
+  size_t i, j, slot, mask = t->capacity - 1;
+  tracker_entry_t *entry;
+
+  pthread_mutex_lock(&t->lock);
+
+  entry = tracker_find(t->entries, t->capacity, ptr);
+  if (!entry->ptr)
+    goto out;
+
+  t->stats.count--;
+  t->stats.bytes -= entry->size;
+
+  // Backward-shift deletion keeps probe sequences intact without tombstones
+  i = entry - t->entries;
+  j = i;
+  while (1) {
+    j = (j + 1) & mask;
+    if (!t->entries[j].ptr)
+      break;
+    slot = tracker_slot(t->entries[j].ptr, t->capacity);
+    if (((j - slot) & mask) >= ((j - i) & mask)) {
+      t->entries[i] = t->entries[j];
+      i = j;
+    }
+  }
+  t->entries[i].ptr = 0;
+
+out:
+  pthread_mutex_unlock(&t->lock);
+}
+
+typedef struct {
+  uint32_t strong;
+  uint32_t weak;
+  uint32_t pending;  // HANDLE_PENDING_* releases not sent yet
+} handle_ref_t;
+
+/*
+ * The references a context holds on handles, in a dense array indexed by
+ * handle. Only the first acquire and the last release of a handle reach the
+ * driver, and the release is deferred until the context next talks to the
+ * driver, so that a handle acquired again in between costs nothing. Each
+ * context counts its own references, which the driver adds up.
+ */
+struct binder_handle_table {
+  handle_ref_t *refs;
+  size_t size;
+  int32_t *pending;  // Handles with deferred releases, each listed once
+  size_t pending_count;
+  size_t pending_size;
+};
+
+static void handles_destroy(struct binder_handle_table *t) {
+  if (!t)
+    return;
+  free(t->refs);
+  free(t->pending);
+  free(t);
+}
+
+/*
+ * Returns the entry of `handle`, growing the table if `grow`, or NULL if the
+ * handle is not tracked.
+ */
+static handle_ref_t *handles_get(binder_ctx *ctx, int32_t handle, bool grow) {
+  struct binder_handle_table *t = ctx->handles;
+  handle_ref_t *refs;
+  size_t size;
+
+  if (t && handle >= 0 && (size_t)handle < t->size)
+    return &t->refs[handle];
+  if (!grow || handle < 0 || handle >= HANDLES_MAX_SIZE)
+    return NULL;
+
+  if (!t) {
+    t = calloc(1, sizeof(*t));
+    if (!t)
+      return NULL;
+    ctx->handles = t;
+  }
+
+  size = t->size ? t->size : HANDLES_MIN_SIZE;
+  while (size <= (size_t)handle)
+    size *= 2;
+
+  refs = realloc(t->refs, size * sizeof(*refs));
+  if (!refs)
+    return NULL;
+  memset(refs + t->size, 0, (size - t->size) * sizeof(*refs));
+
+  t->refs = refs;
+  t->size = size;
+  return &refs[handle];
+}
+
+static int handles_inc(binder_ctx *ctx, int32_t handle, bool strong) {
+  handle_ref_t *ref = handles_get(ctx, handle, true);
+  uint32_t bit = strong ? HANDLE_PENDING_STRONG : HANDLE_PENDING_WEAK;
+  uint32_t cmd = strong ? BC_ACQUIRE : BC_INCREFS;
+  uint32_t *count;
+  int ret;
+
+  if (!ref)
+    return binder_queue_cmd(ctx, cmd, &handle, sizeof(handle));
+
+  count = strong ? &ref->strong : &ref->weak;
+  if ((*count)++)
+    return 0;
+
+  // The driver still holds the reference whose release was deferred
+  if (ref->pending & bit) {
+    ref->pending &= ~bit;
+    return 0;
+  }
+
+  ret = binder_queue_cmd(ctx, cmd, &handle, sizeof(handle));
+  if (ret < 0)
+    (*count)--;
+  return ret;
+}
+
+static int handles_dec(binder_ctx *ctx, int32_t handle, bool strong) {
+  struct binder_handle_table *t = ctx->handles;
+  handle_ref_t *ref = handles_get(ctx, handle, false);
+  uint32_t bit = strong ? HANDLE_PENDING_STRONG : HANDLE_PENDING_WEAK;
+  uint32_t cmd = strong ? BC_RELEASE : BC_DECREFS;
+  uint32_t *count = NULL;
+  int32_t *pending;
+  size_t size;
+
+  // References this context did not count, e.g. acquired by the driver on
+  // its behalf, are released right away
+  if (ref)
+    count = strong ? &ref->strong : &ref->weak;
+  if (!count || !*count)
+    return binder_queue_cmd(ctx, cmd, &handle, sizeof(handle));
+
+  if (--(*count))
+    return 0;
+
+  if (!ref->pending) {
+    if (t->pending_count == t->pending_size) {
+      size = t->pending_size ? t->pending_size * 2 : HANDLES_MIN_SIZE;
+      pending = realloc(t->pending, size * sizeof(*pending));
+      if (!pending)
+        return binder_queue_cmd(ctx, cmd, &handle, sizeof(handle));
+      t->pending = pending;
+      t->pending_size = size;
+    }
+    t->pending[t->pending_count++] = handle;
+  }
+  ref->pending |= bit;
+
+  return 0;
+}
+
+/*
+ * Queues the deferred releases, ahead of whatever is sent to the driver next.
+ */
+static int handles_flush(binder_ctx *ctx) {
+  struct binder_handle_table *t = ctx->handles;
+  size_t i, count = t->pending_count;
+  handle_ref_t *ref;
+  int32_t handle;
+  int ret = 0;
+
+  // Cleared first, as queueing may flush and come back here
+  t->pending_count = 0;
+
+  for (i = 0; i < count; i++) {
+    handle = t->pending[i];
+    ref = &t->refs[handle];
+    if ((ref->pending & HANDLE_PENDING_STRONG)
+        && binder_queue_cmd(ctx, BC_RELEASE, &handle, sizeof(handle)) < 0)
+      ret = -1;
+    if ((ref->pending & HANDLE_PENDING_WEAK)
+        && binder_queue_cmd(ctx, BC_DECREFS, &handle, sizeof(handle)) < 0)
+      ret = -1;
+    ref->pending = 0;
+  }
+
+  return ret;
+}
+
+static inline bool handles_pending(binder_ctx *ctx) {
+  return ctx->handles && ctx->handles->pending_count;
+}
+
 binder_ctx *binder_open(const char *device) {
+  return binder_open_ex(device, NULL);
+}
+
+binder_ctx *binder_open_ex(const char *device, const binder_open_opts_t *opts) {
+  int flags = O_RDWR;
+
   if (!device)
     return NULL;
 
+  if (opts && (opts->flags & BINDER_OPEN_NONBLOCK))
+    flags |= O_NONBLOCK;
+
   binder_ctx *ctx = malloc(sizeof(*ctx));
   if (!ctx)
     return NULL;
 
-  ctx->fd = open(device, O_RDWR, 0);
+  ctx->backend = opts && opts->backend ? opts->backend : &binder_kernel_backend;
+  ctx->fd = ctx->backend->open(device, flags);
   if (ctx->fd == -1) {
     ERR("Failed to open binder device: %s", device);
     goto err_open;
   }
 
-  ctx->map_size = BINDER_VM_SIZE;
-  ctx->map_ptr = mmap(NULL, BINDER_VM_SIZE, PROT_READ, MAP_PRIVATE, ctx->fd, 0);
+  ctx->map_size = opts && opts->map_size ? opts->map_size : BINDER_VM_SIZE;
+  ctx->map_ptr = ctx->backend->mmap(ctx->fd, ctx->map_size);
   if (ctx->map_ptr == MAP_FAILED) {
     ERR("Failed to mmap binder device");
     goto err_mmap;
   }
 
+  ctx->handles = NULL;
+  ctx->death_handler = NULL;
+  ctx->death_arg = NULL;
+  ctx->buffers = tracker_create(ctx->map_size);
+  if (!ctx->buffers)
+    goto err_tracker;
+
+  ctx->parent = NULL;
+  ctx->spawn_looper = false;
+  ctx->interrupted = false;
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+  buf_init_write(&ctx->out);
+  buf_init_write(&ctx->in);
+
   return ctx;
+err_tracker:
+  ctx->backend->munmap(ctx->fd, ctx->map_ptr, ctx->map_size);
 err_mmap:
-  close(ctx->fd);
+  ctx->backend->close(ctx->fd);
 err_open:
   free(ctx);
   return NULL;
 }
 
+binder_ctx *binder_ctx_clone(binder_ctx *ctx) {
+  binder_ctx *clone = malloc(sizeof(*clone));
+  if (!clone)
+    return NULL;
+
+  clone->backend = ctx->backend;
+  clone->fd = ctx->fd;
+  clone->map_ptr = ctx->map_ptr;
+  clone->map_size = ctx->map_size;
+  clone->buffers = ctx->buffers;
+  clone->handles = NULL;
+  clone->death_handler = NULL;
+  clone->death_arg = NULL;
+  clone->parent = ctx->parent ? ctx->parent : ctx;
+  clone->spawn_looper = false;
+  clone->interrupted = false;
+  memset(&clone->stats, 0, sizeof(clone->stats));
+  buf_init_write(&clone->out);
+  buf_init_write(&clone->in);
+
+  return clone;
+}
+
 void binder_close(binder_ctx *ctx) {
   if (ctx) {
-    munmap(ctx->map_ptr, ctx->map_size);
-    close(ctx->fd);
+    binder_flush(ctx);
+    if (!ctx->parent) {
+      ctx->backend->munmap(ctx->fd, ctx->map_ptr, ctx->map_size);
+      ctx->backend->close(ctx->fd);
+      tracker_destroy(ctx->buffers);
+    }
+    buf_release(&ctx->out);
+    buf_release(&ctx->in);
+    handles_destroy(ctx->handles);
     free(ctx);
   }
 }
 
+int binder_get_fd(binder_ctx *ctx) { return ctx->fd; }
+
+void binder_get_buffer_stats(binder_ctx *ctx, binder_buffer_stats_t *stats) {
+  struct binder_buffer_tracker *t = ctx->buffers;
+
+  pthread_mutex_lock(&t->lock);
+  *stats = t->stats;
+  pthread_mutex_unlock(&t->lock);
+}
+
+void binder_get_stats(binder_ctx *ctx, binder_stats_t *stats) {
+  memcpy(stats, &ctx->stats, sizeof(*stats));
+}
+
+void binder_reset_stats(binder_ctx *ctx) {
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+}
+
+void binder_reset_buffer_stats(binder_ctx *ctx) {
+  struct binder_buffer_tracker *t = ctx->buffers;
+
+  pthread_mutex_lock(&t->lock);
+  t->stats.max_bytes = t->stats.bytes;
+  t->stats.max_count = t->stats.count;
+  pthread_mutex_unlock(&t->lock);
+}
+
+int binder_set_read_buffer_size(binder_ctx *ctx, size_t size) {
+  return buf_reserve(&ctx->in, size);
+}
+
 int binder_check_version(binder_ctx *ctx) {
   int ret;
   struct binder_version version = {0};
 
-  ret = ioctl(ctx->fd, BINDER_VERSION, &version);
+  ret = binder_ioctl(ctx, BINDER_VERSION, &version);
   if (ret < 0)
     return ret;
 
@@ -86,167 +521,414 @@ int binder_check_version(binder_ctx *ctx) {
 int binder_set_context_manager(binder_ctx *ctx) {
   int ret;
 
-  ret = ioctl(ctx->fd, BINDER_SET_CONTEXT_MGR, 0);
+  ret = binder_ioctl(ctx, BINDER_SET_CONTEXT_MGR, 0);
   if (ret < 0)
     ERR("BINDER_SET_CONTEXT_MGR ioctl failed: %d", errno);
 
   return ret;
 }
 
+int binder_set_context_manager_ext(binder_ctx *ctx, binder_uintptr_t ptr,
+                                   uint32_t flags) {
+  struct flat_binder_object fbo = {
+      .hdr.type = BINDER_TYPE_BINDER,
+      .flags = flags,
+      .binder = ptr,
+  };
+  int ret;
+
+  ret = binder_ioctl(ctx, BINDER_SET_CONTEXT_MGR_EXT, &fbo);
+  if (ret < 0)
+    ERR("BINDER_SET_CONTEXT_MGR_EXT ioctl failed: %d", errno);
+
+  return ret;
+}
+
+int binder_set_max_threads(binder_ctx *ctx, uint32_t max_threads) {
+  int ret;
+
+  ret = binder_ioctl(ctx, BINDER_SET_MAX_THREADS, &max_threads);
+  if (ret < 0)
+    ERR("BINDER_SET_MAX_THREADS ioctl failed: %d", errno);
+
+  return ret;
+}
+
 int binder_thread_exit(binder_ctx *ctx) {
   int ret;
 
-  ret = ioctl(ctx->fd, BINDER_THREAD_EXIT, 0);
+  ret = binder_ioctl(ctx, BINDER_THREAD_EXIT, 0);
   if (ret < 0)
     ERR("BINDER_THREAD_EXIT ioctl failed: %d", errno);
 
   return ret;
 }
 
-int binder_send(binder_ctx *ctx, buf_t *b) {
+static void binder_count_cmds(uint64_t *counts, const uint8_t *ptr,
+                              size_t size) {
+  const uint8_t *end = ptr + size;
+  uint32_t cmd;
+
+  while ((size_t)(end - ptr) >= sizeof(cmd)) {
+    memcpy(&cmd, ptr, sizeof(cmd));
+    counts[BINDER_STATS_CMD(cmd)]++;
+    if ((size_t)(end - ptr) - sizeof(cmd) < _IOC_SIZE(cmd))
+      break;
+    ptr += sizeof(cmd) + _IOC_SIZE(cmd);
+  }
+}
+
+static int binder_ioctl_write_read(binder_ctx *ctx, buf_t *wb, buf_t *rb) {
   int ret;
+  struct binder_write_read bwr = {0};
+
+  if (wb) {
+    bwr.write_size = wb->size;
+    bwr.write_buffer = (binder_uintptr_t)wb->buffer;
+  }
+  if (rb) {
+    bwr.read_size = rb->size;
+    bwr.read_buffer = (binder_uintptr_t)rb->buffer;
+  }
+
+  // Commands are traced as they are issued, so that a two-way transaction is
+  // not stamped with the time its reply arrived.
+  if (wb && __atomic_load_n(&binder_trace_enabled, __ATOMIC_RELAXED))
+    binder_trace_cmds(wb->buffer, wb->size);
+
+  // The driver resumes from `write_consumed`/`read_consumed`, so an
+  // interrupted call is simply reissued with the same descriptor.
+  while ((ret = binder_ioctl(ctx, BINDER_WRITE_READ, &bwr)) < 0
+         && errno == EINTR)
+    ctx->stats.eintr++;
 
-  struct binder_write_read bwr = {.write_size = b->size,
-                                  .write_buffer = (binder_uintptr_t)b->buffer,
-                                  .write_consumed = 0};
+  // On a non-blocking context, the write half has been consumed and there is
+  // simply nothing to read yet.
+  if (ret < 0 && errno == EAGAIN) {
+    ctx->stats.eagain++;
+    ret = 0;
+  }
+
+  ctx->stats.write_bytes += bwr.write_consumed;
+  ctx->stats.read_bytes += bwr.read_consumed;
+  if (wb)
+    binder_count_cmds(ctx->stats.bc, wb->buffer, bwr.write_consumed);
+  if (rb)
+    binder_count_cmds(ctx->stats.br, rb->buffer, bwr.read_consumed);
 
-  ret = ioctl(ctx->fd, BINDER_WRITE_READ, &bwr);
+  if (rb && __atomic_load_n(&binder_trace_enabled, __ATOMIC_RELAXED))
+    binder_trace_cmds(rb->buffer, bwr.read_consumed);
 
   if (ret < 0) {
     ERR("BINDER_WRITE_READ ioctl failed: %d", errno);
     return ret;
   }
 
-  return bwr.write_consumed;
+  if (rb) {
+    rb->ptr = rb->buffer;
+    rb->size = bwr.read_consumed;
+  }
+
+  return 0;
 }
 
-int binder_recv(binder_ctx *ctx, buf_t *b) {
+int binder_write_read(binder_ctx *ctx, buf_t *wb, buf_t *rb) {
   int ret;
+  buf_t *out = &ctx->out;
 
-  struct binder_write_read bwr = {.read_size = b->size,
-                                  .read_buffer = (binder_uintptr_t)b->buffer,
-                                  .read_consumed = 0};
+  if (handles_pending(ctx))
+    handles_flush(ctx);
 
-  ret = ioctl(ctx->fd, BINDER_WRITE_READ, &bwr);
-  if (ret < 0) {
-    ERR("BINDER_WRITE_READ ioctl failed: %d", errno);
-    return ret;
+  if (!out->size)
+    return binder_ioctl_write_read(ctx, wb, rb);
+
+  // Piggy-back the deferred commands onto this call, ahead of `wb`. If they
+  // do not fit together, the queue is flushed on its own first.
+  if (wb && out->max_size - out->size < wb->size) {
+    ret = binder_flush(ctx);
+    if (ret < 0)
+      return ret;
+    return binder_ioctl_write_read(ctx, wb, rb);
   }
 
-  b->size = bwr.read_consumed;
-  return bwr.read_consumed;
+  if (wb)
+    buf_write(out, wb->buffer, wb->size);
+
+  ret = binder_ioctl_write_read(ctx, out, rb);
+  buf_init_write(out);
+  return ret;
 }
 
-int binder_send_cmd(binder_ctx *ctx, uint32_t cmd, uint8_t *data,
-                    size_t data_size) {
+int binder_flush(binder_ctx *ctx) {
   int ret;
 
-  buf_t *b = buf_alloc();
-  if (!b)
-    return -1;
-  buf_init_write(b);
+  if (handles_pending(ctx))
+    handles_flush(ctx);
 
-  buf_write_u32(b, cmd);
-  if (data && data_size > 0) {
-    buf_write(b, data, data_size);
-  }
-  ret = binder_send(ctx, b);
+  if (!ctx->out.size)
+    return 0;
 
-  buf_free(b);
-  if (ret < 0) {
-    ERR("BINDER_WRITE_READ ioctl failed: %d", errno);
-    return ret;
+  ret = binder_ioctl_write_read(ctx, &ctx->out, NULL);
+  buf_init_write(&ctx->out);
+  return ret;
+}
+
+int binder_queue_cmd(binder_ctx *ctx, uint32_t cmd, const void *data,
+                     size_t data_size) {
+  int ret;
+  buf_t *out = &ctx->out;
+
+  if (out->max_size - out->size < sizeof(cmd) + data_size) {
+    ret = binder_flush(ctx);
+    if (ret < 0)
+      return ret;
+    if (out->max_size < sizeof(cmd) + data_size) {
+      ERR("Command 0x%x does not fit in the command queue", cmd);
+      return -1;
+    }
   }
+
+  buf_write_u32(out, cmd);
+  if (data && data_size > 0)
+    buf_write(out, (void *)data, data_size);
+
   return 0;
 }
 
+int binder_send(binder_ctx *ctx, buf_t *b) {
+  int ret;
+
+  ret = binder_write_read(ctx, b, NULL);
+  if (ret < 0)
+    return ret;
+
+  return b->size;
+}
+
+int binder_recv(binder_ctx *ctx, buf_t *b) {
+  int ret;
+
+  ret = binder_write_read(ctx, NULL, b);
+  if (ret < 0)
+    return ret;
+
+  return b->size;
+}
+
+int binder_send_cmd(binder_ctx *ctx, uint32_t cmd, uint8_t *data,
+                    size_t data_size) {
+  int ret;
+
+  ret = binder_queue_cmd(ctx, cmd, data, data_size);
+  if (ret < 0)
+    return ret;
+
+  return binder_flush(ctx);
+}
+
 int binder_enter_looper(binder_ctx *ctx) {
-  return binder_send_cmd(ctx, BC_ENTER_LOOPER, NULL, 0);
+  return binder_queue_cmd(ctx, BC_ENTER_LOOPER, NULL, 0);
+}
+
+int binder_register_looper(binder_ctx *ctx) {
+  return binder_queue_cmd(ctx, BC_REGISTER_LOOPER, NULL, 0);
+}
+
+int binder_exit_looper(binder_ctx *ctx) {
+  return binder_queue_cmd(ctx, BC_EXIT_LOOPER, NULL, 0);
 }
 
 int binder_free_buffer(binder_ctx *ctx, binder_uintptr_t ptr) {
-  return binder_send_cmd(ctx, BC_FREE_BUFFER, (uint8_t *)&ptr, sizeof(ptr));
+  tracker_remove(ctx->buffers, ptr);
+  return binder_queue_cmd(ctx, BC_FREE_BUFFER, &ptr, sizeof(ptr));
 }
 
 int binder_handle_acquire(binder_ctx *ctx, int32_t handle) {
-  return binder_send_cmd(ctx, BC_ACQUIRE, (uint8_t *)&handle, sizeof(handle));
+  return handles_inc(ctx, handle, true);
 }
 
 int binder_handle_release(binder_ctx *ctx, int32_t handle) {
-  return binder_send_cmd(ctx, BC_RELEASE, (uint8_t *)&handle, sizeof(handle));
+  return handles_dec(ctx, handle, true);
 }
 
-int binder_send_txn(binder_ctx *ctx, int32_t handle, uint32_t code,
-                    uint32_t flags, const translation_data_t *trdata,
-                    bool reply, bool sg) {
-  uint32_t cmd;
-  struct binder_transaction_data tr = {0};
-  struct binder_transaction_data_sg tr_sg = {0};
+int binder_handle_acquire_weak(binder_ctx *ctx, int32_t handle) {
+  return handles_inc(ctx, handle, false);
+}
+
+int binder_handle_release_weak(binder_ctx *ctx, int32_t handle) {
+  return handles_dec(ctx, handle, false);
+}
+
+int binder_request_death_notification(binder_ctx *ctx, int32_t handle,
+                                      binder_uintptr_t cookie) {
+  struct binder_handle_cookie hc = {.handle = handle, .cookie = cookie};
+
+  return binder_queue_cmd(ctx, BC_REQUEST_DEATH_NOTIFICATION, &hc, sizeof(hc));
+}
 
-  tr.target.handle = handle;
-  tr.code = code;
-  tr.flags = flags;
+int binder_clear_death_notification(binder_ctx *ctx, int32_t handle,
+                                    binder_uintptr_t cookie) {
+  struct binder_handle_cookie hc = {.handle = handle, .cookie = cookie};
 
-  tr.data_size = trdata->data_ptr - trdata->data;
-  tr.data.ptr.buffer = (binder_uintptr_t)trdata->data;
+  return binder_queue_cmd(ctx, BC_CLEAR_DEATH_NOTIFICATION, &hc, sizeof(hc));
+}
+
+void binder_set_death_handler(binder_ctx *ctx, binder_death_handler_t handler,
+                              void *arg) {
+  binder_ctx *root = ctx->parent ? ctx->parent : ctx;
+
+  root->death_handler = handler;
+  root->death_arg = arg;
+}
+
+void binder_get_death_handler(binder_ctx *ctx, binder_death_handler_t *handler,
+                              void **arg) {
+  binder_ctx *root = ctx->parent ? ctx->parent : ctx;
+
+  *handler = root->death_handler;
+  *arg = root->death_arg;
+}
+
+static void binder_fill_txn(struct binder_transaction_data *tr, int32_t handle,
+                            uint32_t code, uint32_t flags,
+                            const translation_data_t *trdata) {
+  memset(tr, 0, sizeof(*tr));
+
+  tr->target.handle = handle;
+  tr->code = code;
+  tr->flags = flags;
 
-  tr.offsets_size = (trdata->offs_ptr - trdata->offs) * sizeof(binder_size_t);
-  tr.data.ptr.offsets = (binder_uintptr_t)trdata->offs;
+  if (!trdata)
+    return;
+
+  tr->data_size = trdata->data_ptr - trdata->data;
+  tr->data.ptr.buffer = (binder_uintptr_t)trdata->data;
+
+  tr->offsets_size = (trdata->offs_ptr - trdata->offs) * sizeof(binder_size_t);
+  tr->data.ptr.offsets = (binder_uintptr_t)trdata->offs;
+}
+
+static int binder_send_tr(binder_ctx *ctx, struct binder_transaction_data *tr,
+                          binder_size_t buffers_size, bool reply, bool sg) {
+  uint32_t cmd;
+  struct binder_transaction_data_sg tr_sg;
 
   if (sg) {
-    tr_sg.transaction_data = tr;
-    tr_sg.buffers_size = trdata->buffers_size;
+    tr_sg.transaction_data = *tr;
+    tr_sg.buffers_size = buffers_size;
     cmd = reply ? BC_REPLY_SG : BC_TRANSACTION_SG;
     return binder_send_cmd(ctx, cmd, (uint8_t *)&tr_sg, sizeof(tr_sg));
   } else {
     cmd = reply ? BC_REPLY : BC_TRANSACTION;
-    return binder_send_cmd(ctx, cmd, (uint8_t *)&tr, sizeof(tr));
+    return binder_send_cmd(ctx, cmd, (uint8_t *)tr, sizeof(*tr));
   }
 }
 
+/*
+ * Writes `tr` to `wb` as a transaction or reply, switching to the `_SG`
+ * variant when `buffers_size` is non-zero, i.e. `BINDER_TYPE_PTR` objects
+ * are attached.
+ */
+static void binder_write_tr(buf_t *wb, struct binder_transaction_data *tr,
+                            binder_size_t buffers_size, bool reply) {
+  struct binder_transaction_data_sg tr_sg;
+
+  if (buffers_size) {
+    tr_sg.transaction_data = *tr;
+    tr_sg.buffers_size = buffers_size;
+    buf_write_u32(wb, reply ? BC_REPLY_SG : BC_TRANSACTION_SG);
+    buf_write(wb, &tr_sg, sizeof(tr_sg));
+  } else {
+    buf_write_u32(wb, reply ? BC_REPLY : BC_TRANSACTION);
+    buf_write(wb, tr, sizeof(*tr));
+  }
+}
+
+int binder_send_txn(binder_ctx *ctx, int32_t handle, uint32_t code,
+                    uint32_t flags, const translation_data_t *trdata,
+                    bool reply, bool sg) {
+  struct binder_transaction_data tr;
+
+  binder_fill_txn(&tr, handle, code, flags, trdata);
+
+  return binder_send_tr(ctx, &tr, trdata->buffers_size, reply, sg);
+}
+
+int binder_send_raw_txn_offs(binder_ctx *ctx, int32_t handle, uint32_t code,
+                             uint32_t flags, const void *data,
+                             size_t data_size, const binder_size_t *offs,
+                             size_t offs_count, binder_size_t buffers_size,
+                             bool reply, bool sg) {
+  struct binder_transaction_data tr;
+
+  binder_fill_txn(&tr, handle, code, flags, NULL);
+
+  // The driver copies straight from the caller's memory
+  tr.data_size = data_size;
+  tr.data.ptr.buffer = (binder_uintptr_t)data;
+  tr.offsets_size = offs_count * sizeof(binder_size_t);
+  tr.data.ptr.offsets = (binder_uintptr_t)offs;
+
+  return binder_send_tr(ctx, &tr, buffers_size, reply, sg);
+}
+
 int binder_send_raw_txn(binder_ctx *ctx, int32_t handle, uint32_t code,
                         uint32_t flags, void *data, size_t data_size,
                         bool reply, bool sg) {
-  translation_data_t trdata = {0};
-  trdata_init(&trdata);
-  trdata_put_bytes(&trdata, data, data_size);
-
-  return binder_send_txn(ctx, handle, code, flags, &trdata, reply, sg);
+  return binder_send_raw_txn_offs(ctx, handle, code, flags, data, data_size,
+                                  NULL, 0, 0, reply, sg);
 }
 
-static int binder_skip_cmds(binder_ctx *ctx, buf_t *buf,
-                            translated_data_t *txnin) {
+/*
+ * Consumes commands from `buf` until one that the caller has to act upon is
+ * found, acknowledging reference counting and death notifications on the way.
+ *
+ * Returns the stopping command, or 0 once the buffer has been drained.
+ */
+static uint32_t binder_skip_cmds(binder_ctx *ctx, buf_t *buf,
+                                 translated_data_t *txnin) {
   uint32_t cmd;
-  uint8_t cmd_data[2048];
+  void *cmd_data;
 
   while (buf->ptr != (buf->buffer + buf->size)) {
     cmd = buf_read_u32(buf);
-    buf_read(buf, cmd_data, _IOC_SIZE(cmd));
+    cmd_data = buf_pop(buf, _IOC_SIZE(cmd));
+    if (!cmd_data)
+      return 0;
     switch (cmd) {
       case BR_ACQUIRE:
-      case BR_INCREFS: {
-        buf_t buf;
-        struct binder_ptr_cookie *bpc = (struct binder_ptr_cookie *)cmd_data;
-        buf_init_write(&buf);
-        buf_write_u32(&buf,
-                      cmd == BR_ACQUIRE ? BC_ACQUIRE_DONE : BC_INCREFS_DONE);
-        buf_write_uintptr(&buf, bpc->ptr);
-        buf_write_uintptr(&buf, bpc->cookie);
-        binder_send(ctx, &buf);
-      } break;
+      case BR_INCREFS:
+        binder_queue_cmd(ctx,
+                         cmd == BR_ACQUIRE ? BC_ACQUIRE_DONE : BC_INCREFS_DONE,
+                         cmd_data, sizeof(struct binder_ptr_cookie));
+        break;
       case BR_DEAD_BINDER: {
-        buf_t buf;
-        binder_uintptr_t cookie = *(binder_uintptr_t *)cmd_data;
-        buf_init_write(&buf);
-        buf_write_u32(&buf, BC_DEAD_BINDER_DONE);
-        buf_write_uintptr(&buf, cookie);
-        binder_send(ctx, &buf);
-      } break;
-      case BR_TRANSACTION:
-      case BR_REPLY:
-        txnin_init(txnin, (struct binder_transaction_data *)cmd_data);
-        return 1;
+        binder_ctx *root = ctx->parent ? ctx->parent : ctx;
+        binder_uintptr_t cookie;
+
+        memcpy(&cookie, cmd_data, sizeof(cookie));
+        if (root->death_handler)
+          root->death_handler(ctx, cookie, root->death_arg);
+        binder_queue_cmd(ctx, BC_DEAD_BINDER_DONE, cmd_data,
+                         sizeof(binder_uintptr_t));
+        break;
+      }
+      case BR_SPAWN_LOOPER:
+        ctx->spawn_looper = true;
         break;
+      case BR_TRANSACTION:
+      case BR_REPLY: {
+        struct binder_transaction_data *tr = cmd_data;
+        tracker_add(ctx->buffers, tr->data.ptr.buffer,
+                    ALIGN8(tr->data_size) + ALIGN8(tr->offsets_size));
+        if (txnin)
+          txnin_init(txnin, tr);
+        return cmd;
+      }
+      case BR_TRANSACTION_COMPLETE:
+      case BR_DEAD_REPLY:
+      case BR_FAILED_REPLY:
+        return cmd;
       default:
         break;
     }
@@ -254,19 +936,285 @@ static int binder_skip_cmds(binder_ctx *ctx, buf_t *buf,
   return 0;
 }
 
-int binder_recv_txn(binder_ctx *ctx, translated_data_t *txnin) {
-  buf_t buf;
-  binder_size_t read_consumed;
+/*
+ * Submits `wb` (if any) and refills the context's read buffer, unless it still
+ * holds commands that have not been parsed yet. Fails with `EAGAIN` when a
+ * non-blocking read returned nothing.
+ */
+static int binder_talk(binder_ctx *ctx, buf_t *wb) {
+  int ret;
+  buf_t *in = &ctx->in;
 
-  while (1) {
-    buf_init_read(&buf);
-    read_consumed = binder_recv(ctx, &buf);
-    if (read_consumed < 0)
-      return read_consumed;
+  if (!buf_is_empty(in))
+    return wb ? binder_write_read(ctx, wb, NULL) : 0;
 
-    if (binder_skip_cmds(ctx, &buf, txnin))
-      break;
+  buf_reset_read(in);
+  ret = binder_write_read(ctx, wb, in);
+  if (ret < 0) {
+    buf_reset_write(in);
+    return ret;
+  }
+
+  if (buf_is_empty(in)) {
+    errno = EAGAIN;
+    return -1;
   }
 
   return 0;
 }
+
+static int64_t binder_now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t binder_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void binder_record_latency(binder_ctx *ctx, uint64_t ns) {
+  size_t bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+  if (bucket >= BINDER_STATS_LATENCY_BUCKETS)
+    bucket = BINDER_STATS_LATENCY_BUCKETS - 1;
+  ctx->stats.latency[bucket]++;
+  ctx->stats.transactions++;
+}
+
+/*
+ * Submits `wb` (if any) and keeps reading until a `BR_TRANSACTION` or
+ * `BR_REPLY` is received. With a non-negative `timeout_ms`, the device is
+ * polled before each read and the wait is bounded.
+ */
+static int binder_wait_txn(binder_ctx *ctx, buf_t *wb,
+                           translated_data_t *txnin, int timeout_ms) {
+  int64_t deadline = binder_now_ms() + timeout_ms;
+  int64_t remaining;
+  bool polled = false;
+  uint32_t cmd;
+  int ret;
+
+  while (1) {
+    // Commands already read are parsed first, as they may hold a transaction
+    if (buf_is_empty(&ctx->in)
+        && __atomic_load_n(&ctx->interrupted, __ATOMIC_ACQUIRE)) {
+      if (wb)
+        binder_write_read(ctx, wb, NULL);
+      errno = EINTR;
+      return -1;
+    }
+
+    if (timeout_ms >= 0 && buf_is_empty(&ctx->in)) {
+      remaining = deadline - binder_now_ms();
+      if (remaining < 0)
+        remaining = 0;
+      // Poll at least once, even with a zero timeout
+      ret = polled && !remaining ? 0 : binder_wait(ctx, remaining);
+      polled = true;
+      if (ret < 0)
+        return ret;
+      if (ret == 0) {
+        if (wb)
+          binder_write_read(ctx, wb, NULL);
+        errno = ETIMEDOUT;
+        return -1;
+      }
+    }
+
+    ret = binder_talk(ctx, wb);
+    wb = NULL;
+    if (ret < 0) {
+      if (errno == EAGAIN && timeout_ms >= 0)
+        continue;
+      return ret;
+    }
+
+    while ((cmd = binder_skip_cmds(ctx, &ctx->in, txnin))) {
+      if (cmd == BR_TRANSACTION || cmd == BR_REPLY)
+        return 0;
+    }
+  }
+}
+
+int binder_wait(binder_ctx *ctx, int timeout_ms) {
+  int ret;
+  struct pollfd pfd = {.fd = ctx->fd, .events = POLLIN};
+
+  ret = poll(&pfd, 1, timeout_ms);
+  if (ret < 0)
+    ERR("Failed to poll binder device: %d", errno);
+
+  return ret;
+}
+
+int binder_interrupt(binder_ctx *ctx) {
+  __atomic_store_n(&ctx->interrupted, true, __ATOMIC_RELEASE);
+  if (!ctx->backend->wake) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  return ctx->backend->wake(ctx->fd);
+}
+
+int binder_recv_txn(binder_ctx *ctx, translated_data_t *txnin) {
+  return binder_wait_txn(ctx, NULL, txnin, -1);
+}
+
+int binder_recv_txn_timeout(binder_ctx *ctx, translated_data_t *txnin,
+                            int timeout_ms) {
+  return binder_wait_txn(ctx, NULL, txnin, timeout_ms < 0 ? 0 : timeout_ms);
+}
+
+static int binder_finish_and_recv_txn(binder_ctx *ctx,
+                                      translated_data_t *txnin,
+                                      struct binder_transaction_data *tr,
+                                      binder_size_t buffers_size) {
+  buf_t wbuf;
+
+  buf_init_write(&wbuf);
+
+  buf_write_u32(&wbuf, BC_FREE_BUFFER);
+  buf_write_uintptr(&wbuf, (binder_uintptr_t)txnin->data);
+  tracker_remove(ctx->buffers, (binder_uintptr_t)txnin->data);
+
+  if (!(txnin->flags & TF_ONE_WAY))
+    binder_write_tr(&wbuf, tr, buffers_size, true);
+
+  return binder_wait_txn(ctx, &wbuf, txnin, -1);
+}
+
+int binder_reply_and_recv_txn(binder_ctx *ctx, translated_data_t *txnin,
+                              const translation_data_t *reply) {
+  struct binder_transaction_data tr;
+
+  binder_fill_txn(&tr, 0, 0, 0, reply);
+
+  return binder_finish_and_recv_txn(ctx, txnin, &tr,
+                                    reply ? reply->buffers_size : 0);
+}
+
+int binder_reply_status_and_recv_txn(binder_ctx *ctx, translated_data_t *txnin,
+                                     int32_t status) {
+  struct binder_transaction_data tr;
+
+  binder_fill_txn(&tr, 0, 0, TF_STATUS_CODE, NULL);
+  tr.data_size = sizeof(status);
+  tr.data.ptr.buffer = (binder_uintptr_t)&status;
+
+  return binder_finish_and_recv_txn(ctx, txnin, &tr, 0);
+}
+
+int binder_loop(binder_ctx *ctx, binder_txn_handler_t handler, void *arg) {
+  translation_data_t *reply;
+  translated_data_t txnin;
+  int ret, status;
+
+  reply = trdata_pool_get();
+  if (!reply)
+    return -1;
+
+  binder_enter_looper(ctx);
+
+  ret = binder_recv_txn(ctx, &txnin);
+  while (ret == 0) {
+    trdata_reset(reply);
+    status = handler(ctx, &txnin, reply, arg);
+
+    if (status < 0)
+      ret = binder_reply_status_and_recv_txn(ctx, &txnin, status);
+    else
+      ret = binder_reply_and_recv_txn(ctx, &txnin, reply);
+  }
+
+  trdata_pool_put(reply);
+  return ret;
+}
+
+/*
+ * Frees a transaction received while waiting for a reply and, if it is
+ * two-way, answers it with a status, so that its sender does not block.
+ */
+static int binder_refuse_txn(binder_ctx *ctx, const translated_data_t *txnin) {
+  // Only read once the commands are flushed
+  static const int32_t status = -EBADMSG;
+  struct binder_transaction_data tr;
+
+  ERR("Refusing transaction 0x%x received while waiting for reply",
+      txnin->code);
+  binder_free_buffer(ctx, (binder_uintptr_t)txnin->data);
+  if (!(txnin->flags & TF_ONE_WAY)) {
+    binder_fill_txn(&tr, 0, 0, TF_STATUS_CODE, NULL);
+    tr.data_size = sizeof(status);
+    tr.data.ptr.buffer = (binder_uintptr_t)&status;
+    binder_queue_cmd(ctx, BC_REPLY, &tr, sizeof(tr));
+  }
+
+  return binder_flush(ctx);
+}
+
+int binder_transact(binder_ctx *ctx, int32_t handle, uint32_t code,
+                    uint32_t flags, const translation_data_t *trdata,
+                    translated_data_t *reply) {
+  buf_t wbuf;
+  buf_t *wb = &wbuf;
+  struct binder_transaction_data tr;
+  translated_data_t txnin;
+  // Only round trips are timed, keeping oneway calls free of clock reads
+  uint64_t start = flags & TF_ONE_WAY ? 0 : binder_now_ns();
+  uint32_t cmd;
+  int ret;
+
+  binder_fill_txn(&tr, handle, code, flags, trdata);
+
+  buf_init_write(wb);
+  binder_write_tr(wb, &tr, trdata ? trdata->buffers_size : 0, false);
+
+  while (1) {
+    ret = binder_talk(ctx, wb);
+    wb = NULL;
+    if (ret < 0) {
+      // Non-blocking contexts still wait for the outcome of the transaction
+      if (errno == EAGAIN && binder_wait(ctx, -1) >= 0)
+        continue;
+      return ret;
+    }
+
+    // Read into `txnin` first, as a transaction may come ahead of the reply
+    while ((cmd = binder_skip_cmds(ctx, &ctx->in, &txnin))) {
+      switch (cmd) {
+        case BR_TRANSACTION_COMPLETE:
+          if (flags & TF_ONE_WAY)
+            return 0;
+          break;
+        case BR_TRANSACTION:
+          binder_refuse_txn(ctx, &txnin);
+          break;
+        case BR_REPLY:
+          binder_record_latency(ctx, binder_now_ns() - start);
+          if (reply)
+            *reply = txnin;
+          else
+            binder_free_buffer(ctx, (binder_uintptr_t)txnin.data);
+          return 0;
+        case BR_DEAD_REPLY:
+          ERR("Transaction to handle %d failed: BR_DEAD_REPLY", handle);
+          errno = EPIPE;
+          return -1;
+        case BR_FAILED_REPLY:
+          // Back-pressure on oneway transactions is for the caller to handle
+          if (!(flags & TF_ONE_WAY))
+            ERR("Transaction to handle %d failed: BR_FAILED_REPLY", handle);
+          errno = EIO;
+          return -1;
+        default:
+          ERR("Unexpected command while waiting for reply: 0x%x", cmd);
+          break;
+      }
+    }
+  }
+}
@@ -21,29 +21,89 @@
 
 #include "util.h"
 
-void buf_init(buf_t *b) {
-  memset(b->buffer, 0, sizeof(b->buffer));
+static void buf_init(buf_t *b) {
+  b->buffer = b->inline_buffer;
   b->ptr = b->buffer;
   b->size = 0;
-  b->max_size = sizeof(b->buffer);
+  b->max_size = sizeof(b->inline_buffer);
 }
 
 void buf_init_write(buf_t *b) {
   buf_init(b);
-  b->size = 0;
+  buf_reset_write(b);
 }
 
 void buf_init_read(buf_t *b) {
   buf_init(b);
-  b->size = sizeof(b->buffer);
+  buf_reset_read(b);
+}
+
+void buf_reset_write(buf_t *b) {
+  b->ptr = b->buffer;
+  b->size = 0;
+}
+
+void buf_reset_read(buf_t *b) {
+  b->ptr = b->buffer;
+  b->size = b->max_size;
+}
+
+int buf_reserve(buf_t *b, size_t capacity) {
+  unsigned char *buffer;
+
+  if (capacity <= b->max_size)
+    return 0;
+
+  if (b->buffer == b->inline_buffer) {
+    buffer = malloc(capacity);
+    if (buffer)
+      memcpy(buffer, b->buffer, b->size);
+  } else {
+    buffer = realloc(b->buffer, capacity);
+  }
+
+  if (!buffer) {
+    ERR("Failed to grow buffer to %zu bytes", capacity);
+    return -1;
+  }
+
+  b->ptr = buffer + (b->ptr - b->buffer);
+  b->buffer = buffer;
+  b->max_size = capacity;
+
+  return 0;
+}
+
+void buf_release(buf_t *b) {
+  if (b->buffer != b->inline_buffer)
+    free(b->buffer);
+  buf_init(b);
 }
 
 buf_t *buf_alloc() {
   buf_t *b = malloc(sizeof(buf_t));
+  if (b)
+    buf_init_write(b);
   return b;
 }
 
-void buf_free(buf_t *b) { free(b); }
+buf_t *buf_alloc_size(size_t capacity) {
+  buf_t *b = buf_alloc();
+
+  if (b && buf_reserve(b, capacity) < 0) {
+    free(b);
+    return NULL;
+  }
+
+  return b;
+}
+
+void buf_free(buf_t *b) {
+  if (b) {
+    buf_release(b);
+    free(b);
+  }
+}
 
 void *buf_push(buf_t *b, size_t size) {
   void *ptr = b->ptr;
@@ -0,0 +1,596 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // memfd_create and file seals
+#endif
+
+#include "channel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/android/binder.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#define ALIGN8(s) (((s) + 7) & ~7UL)
+
+#define CHANNEL_MAGIC 0x6c6e6863  // "chnl"
+#define CHANNEL_VERSION 1
+#define CHANNEL_CACHE_LINE 64
+
+// Marks the end of the ring as padding, the next message being at its start
+#define CHANNEL_WRAP UINT32_MAX
+
+// Polls of the ring before sleeping, which spare the wakeup when the
+// producer is about to write
+#define CHANNEL_SPINS 256
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/*
+ * The header of the shared memory, followed by the ring. Positions run freely
+ * modulo 2^32, each side writing to its own cache line.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+
+  _Alignas(CHANNEL_CACHE_LINE) uint32_t head;
+  uint32_t producer_closed;
+
+  _Alignas(CHANNEL_CACHE_LINE) uint32_t tail;
+  uint32_t consumer_closed;
+  // Set by a consumer about to sleep, cleared by the producer waking it
+  uint32_t waiting;
+} channel_header_t;
+
+struct binder_channel {
+  channel_header_t *ring;
+  uint8_t *data;
+  size_t map_size;
+  uint32_t mask;
+  uint32_t pos;  // The head of the producer, or the tail of the consumer
+  int wake_fd;   // The producer's or the consumer's socket
+  bool consumer;
+
+  // Identifies the channel in fallback transactions, random so that the
+  // consumer's address is never disclosed nor guessed
+  uint64_t id;
+
+  // Producer end
+  int32_t handle;
+  uint32_t code;
+  bool dead;
+
+  // Consumer end. `lock` serializes the ring reads of `binder_channel_recv`
+  // and of fallback transactions.
+  pthread_mutex_t lock;
+  binder_channel_handler_t handler;
+  void *arg;
+  bool broken;
+};
+
+static binder_channel_t *channel_map(int fd, size_t capacity, bool consumer) {
+  binder_channel_t *ch;
+  void *map;
+
+  ch = calloc(1, sizeof(*ch));
+  if (!ch)
+    return NULL;
+
+  ch->map_size = sizeof(channel_header_t) + capacity;
+  map = mmap(NULL, ch->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    ERR("Failed to map channel ring");
+    free(ch);
+    return NULL;
+  }
+
+  ch->ring = map;
+  ch->data = (uint8_t *)map + sizeof(channel_header_t);
+  ch->mask = capacity - 1;
+  ch->wake_fd = -1;
+  ch->consumer = consumer;
+  pthread_mutex_init(&ch->lock, NULL);
+
+  return ch;
+}
+
+// Wakes the consumer if it announced that it sleeps.
+static void channel_wake(binder_channel_t *ch) {
+  channel_header_t *ring = ch->ring;
+  char byte = 0;
+
+  // Pairs with the fence of `channel_wait`: either the consumer sees the new
+  // head, or the producer sees `waiting`
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED)
+      && __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_RELAXED)
+      && send(ch->wake_fd, &byte, sizeof(byte), MSG_NOSIGNAL) < 0
+      && errno == EPIPE)
+    ch->dead = true;
+}
+
+binder_channel_t *binder_channel_connect(binder_ctx *ctx, int32_t handle,
+                                         uint32_t code, size_t capacity) {
+  translation_data_t *trdata;
+  translated_data_t reply;
+  binder_channel_t *ch;
+  size_t size = BINDER_CHANNEL_MIN_CAPACITY;
+  const uint64_t *id;
+  int fd, wake_fds[2];
+  int ret;
+
+  if (capacity > BINDER_CHANNEL_MAX_CAPACITY) {
+    errno = EINVAL;
+    return NULL;
+  }
+  while (size < capacity)
+    size *= 2;
+
+  fd = memfd_create("devbinder-channel", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    ERR("Failed to create channel memfd");
+    return NULL;
+  }
+
+  // The consumer maps the ring as well, which must not shrink underneath it
+  if (ftruncate(fd, sizeof(channel_header_t) + size) < 0
+      || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+             < 0) {
+    ERR("Failed to size channel memfd");
+    goto err_fd;
+  }
+
+  ch = channel_map(fd, size, false);
+  if (!ch)
+    goto err_fd;
+
+  ch->ring->magic = CHANNEL_MAGIC;
+  ch->ring->version = CHANNEL_VERSION;
+  ch->ring->capacity = size;
+  ch->handle = handle;
+  ch->code = code;
+
+  // Unlike a futex, the socket hangs up when the producer exits
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                 wake_fds)
+      < 0) {
+    ERR("Failed to create channel socket");
+    goto err_ch;
+  }
+  ch->wake_fd = wake_fds[0];
+
+  trdata = trdata_pool_get();
+  if (!trdata) {
+    close(wake_fds[1]);
+    goto err_ch;
+  }
+
+  if (trdata_put_u32(trdata, BINDER_CHANNEL_OP_SETUP) < 0
+      || trdata_put_fd(trdata, fd, 0) < 0
+      || trdata_put_fd(trdata, wake_fds[1], 0) < 0)
+    ret = -1;
+  else
+    ret = binder_transact(ctx, handle, code, 0, trdata, &reply);
+  trdata_pool_put(trdata);
+  close(wake_fds[1]);
+  if (ret < 0) {
+    ERR("Failed to set up channel");
+    goto err_ch;
+  }
+
+  id = reply.flags & TF_STATUS_CODE ? NULL : txnin_pop(&reply, sizeof(*id));
+  if (id)
+    memcpy(&ch->id, id, sizeof(ch->id));
+  binder_free_buffer(ctx, (binder_uintptr_t)reply.data);
+  if (!id) {
+    ERR("Channel refused by handle %d", handle);
+    errno = ECONNREFUSED;
+    goto err_ch;
+  }
+
+  close(fd);
+  return ch;
+
+err_ch:
+  binder_channel_destroy(ch);
+err_fd:
+  close(fd);
+  return NULL;
+}
+
+/*
+ * Sends a message with a two-way transaction, carrying the head it follows.
+ */
+static int channel_send_txn(binder_channel_t *ch, binder_ctx *ctx,
+                            const void *data, size_t len) {
+  translation_data_t *trdata;
+  translated_data_t reply;
+  int32_t status = 0;
+  int ret;
+
+  trdata = trdata_pool_get();
+  if (!trdata)
+    return -1;
+
+  if (trdata_put_u32(trdata, BINDER_CHANNEL_OP_MESSAGE) < 0
+      || trdata_put_bytes(trdata, (const char *)&ch->id, sizeof(ch->id)) < 0
+      || trdata_put_u32(trdata, ch->pos) < 0
+      || trdata_put_blob(trdata, data, len) < 0) {
+    trdata_pool_put(trdata);
+    return -1;
+  }
+
+  ret = binder_transact(ctx, ch->handle, ch->code, 0, trdata, &reply);
+  trdata_pool_put(trdata);
+  if (ret < 0) {
+    ch->dead = true;
+    errno = EPIPE;
+    return -1;
+  }
+
+  if (reply.flags & TF_STATUS_CODE)
+    status = txnin_pop_i32(&reply);
+  binder_free_buffer(ctx, (binder_uintptr_t)reply.data);
+  if (status) {
+    ERR("Channel message refused: %d", status);
+    errno = EPROTO;
+    return -1;
+  }
+
+  return 0;
+}
+
+int binder_channel_send(binder_channel_t *ch, binder_ctx *ctx,
+                        const void *data, size_t len) {
+  channel_header_t *ring = ch->ring;
+  uint32_t capacity = ch->mask + 1;
+  uint32_t head = ch->pos, tail, off, room, rec, len32;
+
+  if (ch->dead || __atomic_load_n(&ring->consumer_closed, __ATOMIC_RELAXED)) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  if (len > capacity / 2 - sizeof(len32))
+    return channel_send_txn(ch, ctx, data, len);
+
+  len32 = len;
+  rec = ALIGN8(sizeof(len32) + len32);
+  tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (head - tail > capacity) {
+    ERR("Channel ring corrupted");
+    errno = EPROTO;
+    return -1;
+  }
+
+  // A message never wraps: the end of the ring is skipped when too short
+  off = head & ch->mask;
+  room = capacity - off;
+  if (capacity - (head - tail) < rec + (room < rec ? room : 0))
+    return channel_send_txn(ch, ctx, data, len);
+
+  if (room < rec) {
+    uint32_t wrap = CHANNEL_WRAP;
+
+    memcpy(ch->data + off, &wrap, sizeof(wrap));
+    head += room;
+    off = 0;
+  }
+
+  memcpy(ch->data + off, &len32, sizeof(len32));
+  memcpy(ch->data + off + sizeof(len32), data, len);
+  ch->pos = head + rec;
+  __atomic_store_n(&ring->head, ch->pos, __ATOMIC_RELEASE);
+
+  channel_wake(ch);
+  return 0;
+}
+
+uint32_t binder_channel_op(const translated_data_t *txnin) {
+  uint32_t op;
+
+  if (txnin->data_avail < sizeof(op))
+    return 0;
+
+  memcpy(&op, txnin->data_ptr, sizeof(op));
+  return op == BINDER_CHANNEL_OP_SETUP || op == BINDER_CHANNEL_OP_MESSAGE
+             ? op
+             : 0;
+}
+
+/*
+ * Closes the descriptors of the fd objects of `txnin`, which the driver
+ * installed for the receiver.
+ */
+static void channel_close_fds(const translated_data_t *txnin) {
+  const struct binder_object_header *hdr;
+  size_t index = 0;
+
+  while ((hdr = txnin_next_object(txnin, BINDER_TYPE_FD, &index)))
+    close(((const struct binder_fd_object *)hdr)->fd);
+}
+
+binder_channel_t *binder_channel_accept(translated_data_t *txnin,
+                                        translation_data_t *reply,
+                                        binder_channel_handler_t handler,
+                                        void *arg) {
+  channel_header_t header;
+  binder_channel_t *ch;
+  struct stat st;
+  int fd, wake_fd, seals;
+  void *ptr;
+
+  if (txnin_pop_u32(txnin) != BINDER_CHANNEL_OP_SETUP)
+    goto err_fd;
+
+  fd = txnin_pop_fd(txnin);
+  wake_fd = txnin_pop_fd(txnin);
+  if (fd < 0 || wake_fd < 0)
+    goto err_fd;
+
+  // The ring must neither shrink nor be resized under the mapping, and is
+  // validated before being mapped. It must start empty, so that the consumer
+  // never trusts a position it did not write.
+  seals = fcntl(fd, F_GET_SEALS);
+  if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW))
+                       != (F_SEAL_SHRINK | F_SEAL_GROW)
+      || fstat(fd, &st) < 0
+      || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+      || header.magic != CHANNEL_MAGIC || header.version != CHANNEL_VERSION
+      || header.capacity < BINDER_CHANNEL_MIN_CAPACITY
+      || header.capacity > BINDER_CHANNEL_MAX_CAPACITY
+      || (header.capacity & (header.capacity - 1)) || header.tail
+      || (uint64_t)st.st_size != sizeof(header) + header.capacity) {
+    ERR("Invalid channel ring");
+    goto err_fd;
+  }
+
+  ch = channel_map(fd, header.capacity, true);
+  if (!ch)
+    goto err_fd;
+  close(fd);
+
+  ch->pos = 0;
+  ch->wake_fd = wake_fd;
+  ch->handler = handler;
+  ch->arg = arg;
+
+  if (getrandom(&ch->id, sizeof(ch->id), 0) != sizeof(ch->id)) {
+    ERR("Failed to draw a channel id");
+    binder_channel_destroy(ch);
+    return NULL;
+  }
+
+  ptr = trdata_alloc(reply, sizeof(ch->id), false);
+  if (!ptr) {
+    binder_channel_destroy(ch);
+    return NULL;
+  }
+  memcpy(ptr, &ch->id, sizeof(ch->id));
+
+  return ch;
+
+err_fd:
+  channel_close_fds(txnin);
+  return NULL;
+}
+
+/*
+ * Handles the ring messages up to `head`. Returns their number, or -1 if the
+ * ring holds invalid data. Called with `lock` held.
+ */
+static int channel_drain(binder_channel_t *ch, uint32_t head) {
+  uint32_t capacity = ch->mask + 1;
+  uint32_t tail = ch->pos, off, room, len, rec;
+  int count = 0;
+
+  if (head - tail > capacity)
+    goto err;
+
+  while (tail != head) {
+    off = tail & ch->mask;
+    room = capacity - off;
+    // Read once, as the producer may rewrite it
+    memcpy(&len, ch->data + off, sizeof(len));
+
+    if (len == CHANNEL_WRAP) {
+      if (room > head - tail)
+        goto err;
+      tail += room;
+      continue;
+    }
+
+    if (len + sizeof(len) > room)
+      goto err;
+    rec = ALIGN8(sizeof(len) + len);
+    if (rec > head - tail)
+      goto err;
+
+    ch->handler(ch->data + off + sizeof(len), len, ch->arg);
+    tail += rec;
+    ch->pos = tail;
+    __atomic_store_n(&ch->ring->tail, tail, __ATOMIC_RELEASE);
+    count++;
+  }
+
+  ch->pos = tail;
+  __atomic_store_n(&ch->ring->tail, tail, __ATOMIC_RELEASE);
+  return count;
+
+err:
+  ERR("Channel ring corrupted");
+  ch->broken = true;
+  return -1;
+}
+
+int binder_channel_handle_txn(binder_channel_t *ch, translated_data_t *txnin) {
+  txnin_blob_t blob;
+  const void *ptr;
+  uint64_t id;
+  uint32_t head;
+  int ret;
+
+  if (txnin_pop_u32(txnin) != BINDER_CHANNEL_OP_MESSAGE)
+    return -EINVAL;
+
+  // The id is only 4-byte aligned in the parcel
+  ptr = txnin_pop(txnin, sizeof(id));
+  if (!ptr)
+    return -EINVAL;
+  memcpy(&id, ptr, sizeof(id));
+  if (id != ch->id)
+    return -EINVAL;
+  head = txnin_pop_u32(txnin);
+  if (txnin_pop_blob(txnin, &blob) < 0)
+    return -EINVAL;
+
+  pthread_mutex_lock(&ch->lock);
+  ret = ch->broken ? -1 : channel_drain(ch, head);
+  if (ret >= 0)
+    ch->handler(blob.data, blob.size, ch->arg);
+  pthread_mutex_unlock(&ch->lock);
+
+  txnin_blob_release(&blob);
+  return ret < 0 ? -EINVAL : 0;
+}
+
+static int64_t channel_now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool channel_empty(const binder_channel_t *ch) {
+  return __atomic_load_n(&ch->ring->head, __ATOMIC_ACQUIRE)
+         == __atomic_load_n(&ch->ring->tail, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sleeps until the producer writes, closes or exits, or `timeout_ms` passes.
+ * Returns 1 if the consumer should look at the ring again, 0 on timeout and
+ * -1 once the producer is gone.
+ */
+static int channel_wait(binder_channel_t *ch, int timeout_ms) {
+  channel_header_t *ring = ch->ring;
+  struct pollfd pfd = {.fd = ch->wake_fd, .events = POLLIN};
+  char bytes[16];
+  int ret = 1;
+
+  for (int i = 0; i < CHANNEL_SPINS; i++) {
+    if (!channel_empty(ch))
+      return 1;
+    cpu_relax();
+  }
+
+  __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (channel_empty(ch)
+      && !__atomic_load_n(&ring->producer_closed, __ATOMIC_ACQUIRE)) {
+    ret = poll(&pfd, 1, timeout_ms);
+    if (ret < 0 && errno == EINTR)
+      ret = 1;
+  }
+  __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+
+  // Wakeups are edge-like: drop the ones consumed by this wait
+  while (read(ch->wake_fd, bytes, sizeof(bytes)) > 0)
+    ;
+
+  if (ret > 0 && pfd.revents & (POLLHUP | POLLERR) && channel_empty(ch))
+    return -1;
+  return ret;
+}
+
+int binder_channel_recv(binder_channel_t *ch, int timeout_ms) {
+  int64_t deadline = timeout_ms < 0 ? 0 : channel_now_ms() + timeout_ms;
+  int count, ret;
+
+  for (;;) {
+    pthread_mutex_lock(&ch->lock);
+    count = ch->broken ? -1
+                       : channel_drain(ch, __atomic_load_n(&ch->ring->head,
+                                                           __ATOMIC_ACQUIRE));
+    pthread_mutex_unlock(&ch->lock);
+    if (count) {
+      if (count < 0)
+        errno = EPROTO;
+      return count;
+    }
+
+    if (__atomic_load_n(&ch->ring->producer_closed, __ATOMIC_ACQUIRE)
+        && channel_empty(ch)) {
+      errno = EPIPE;
+      return -1;
+    }
+
+    if (timeout_ms >= 0) {
+      timeout_ms = deadline - channel_now_ms();
+      if (timeout_ms < 0)
+        timeout_ms = 0;
+    }
+
+    ret = channel_wait(ch, timeout_ms);
+    if (ret < 0) {
+      errno = EPIPE;
+      return -1;
+    }
+    if (!ret)
+      return 0;
+  }
+}
+
+void binder_channel_destroy(binder_channel_t *ch) {
+  char byte = 0;
+
+  if (!ch)
+    return;
+
+  if (ch->consumer) {
+    __atomic_store_n(&ch->ring->consumer_closed, 1, __ATOMIC_RELEASE);
+  } else {
+    __atomic_store_n(&ch->ring->producer_closed, 1, __ATOMIC_RELEASE);
+    if (ch->wake_fd >= 0)
+      send(ch->wake_fd, &byte, sizeof(byte), MSG_NOSIGNAL);
+  }
+
+  if (ch->wake_fd >= 0)
+    close(ch->wake_fd);
+  munmap(ch->ring, ch->map_size);
+  pthread_mutex_destroy(&ch->lock);
+  free(ch);
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "dispatcher.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+#define DISPATCHER_MIN_CAPACITY 16
+
+typedef struct {
+  binder_uintptr_t cookie;
+  uint32_t code;
+  bool used;
+  binder_txn_handler_t handler;
+  void *arg;
+} dispatcher_entry_t;
+
+struct binder_dispatcher {
+  dispatcher_entry_t *entries;
+  size_t capacity;  // Always a power of two
+  size_t count;
+
+  binder_txn_handler_t default_handler;
+  void *default_arg;
+};
+
+static size_t dispatcher_hash(binder_uintptr_t cookie, uint32_t code) {
+  uint64_t h = (uint64_t)cookie ^ ((uint64_t)code << 32 | code);
+
+  // splitmix64 finalizer
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+
+  return h;
+}
+
+static dispatcher_entry_t *dispatcher_find(dispatcher_entry_t *entries,
+                                           size_t capacity,
+                                           binder_uintptr_t cookie,
+                                           uint32_t code) {
+  size_t mask = capacity - 1;
+  size_t i = dispatcher_hash(cookie, code) & mask;
+
+  // The table is never full, so probing always ends on an unused entry
+  while (entries[i].used
+         && (entries[i].cookie != cookie || entries[i].code != code))
+    i = (i + 1) & mask;
+
+  return &entries[i];
+}
+
+static int dispatcher_grow(binder_dispatcher_t *d) {
+  size_t i, capacity = d->capacity * 2;
+  dispatcher_entry_t *entries, *entry;
+
+  entries = calloc(capacity, sizeof(*entries));
+  if (!entries)
+    return -1;
+
+  for (i = 0; i < d->capacity; i++) {
+    if (!d->entries[i].used)
+      continue;
+    entry = dispatcher_find(entries, capacity, d->entries[i].cookie,
+                            d->entries[i].code);
+    *entry = d->entries[i];
+  }
+
+  free(d->entries);
+  d->entries = entries;
+  d->capacity = capacity;
+  return 0;
+}
+
+binder_dispatcher_t *binder_dispatcher_create(void) {
+  binder_dispatcher_t *d = calloc(1, sizeof(*d));
+  if (!d)
+    return NULL;
+
+  d->capacity = DISPATCHER_MIN_CAPACITY;
+  d->entries = calloc(d->capacity, sizeof(*d->entries));
+  if (!d->entries) {
+    free(d);
+    return NULL;
+  }
+
+  return d;
+}
+
+void binder_dispatcher_destroy(binder_dispatcher_t *d) {
+  if (d) {
+    free(d->entries);
+    free(d);
+  }
+}
+
+int binder_dispatcher_register(binder_dispatcher_t *d, binder_uintptr_t cookie,
+                               uint32_t code, binder_txn_handler_t handler,
+                               void *arg) {
+  dispatcher_entry_t *entry;
+
+  if (!handler)
+    return -1;
+
+  // Keep the load factor under 1/2 so that probe sequences stay short
+  if ((d->count + 1) * 2 > d->capacity && dispatcher_grow(d) < 0) {
+    ERR("Failed to grow the dispatcher table");
+    return -1;
+  }
+
+  entry = dispatcher_find(d->entries, d->capacity, cookie, code);
+  if (!entry->used) {
+    entry->used = true;
+    entry->cookie = cookie;
+    entry->code = code;
+    d->count++;
+  }
+  entry->handler = handler;
+  entry->arg = arg;
+
+  return 0;
+}
+
+void binder_dispatcher_set_default(binder_dispatcher_t *d,
+                                   binder_txn_handler_t handler, void *arg) {
+  d->default_handler = handler;
+  d->default_arg = arg;
+}
+
+int binder_dispatch(binder_ctx *ctx, translated_data_t *txnin,
+                    translation_data_t *reply, void *arg) {
+  binder_dispatcher_t *d = arg;
+  dispatcher_entry_t *entry;
+
+  entry = dispatcher_find(d->entries, d->capacity, txnin->cookie, txnin->code);
+  if (entry->used)
+    return entry->handler(ctx, txnin, reply, entry->arg);
+
+  if (d->default_handler)
+    return d->default_handler(ctx, txnin, reply, d->default_arg);
+
+  return BINDER_UNKNOWN_TRANSACTION;
+}
@@ -0,0 +1,1373 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * A userspace emulation of the Binder driver. Each descriptor returned by
+ * `emu_open` stands for a process, each calling thread for a Binder thread.
+ * Everything is guarded by a single lock; blocking reads wait on a condition
+ * of their process.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/android/binder.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "util.h"
+
+#define ALIGN8(s) (((s) + 7) & ~7UL)
+
+#define LOOPER_REGISTERED (1 << 0)
+#define LOOPER_ENTERED (1 << 1)
+
+struct emu_proc;
+struct emu_thread;
+
+typedef struct emu_buffer {
+  struct emu_buffer *next;  // Sorted by offset
+  size_t offset;
+  size_t size;
+  size_t data_size;
+  size_t offsets_size;
+} emu_buffer_t;
+
+typedef struct emu_node {
+  struct emu_node *next;
+  struct emu_proc *proc;  // NULL once the owner is gone
+  binder_uintptr_t ptr;
+  binder_uintptr_t cookie;
+  size_t refs;
+  bool accept_fds;
+} emu_node_t;
+
+typedef struct emu_ref {
+  struct emu_ref *next;
+  emu_node_t *node;
+  uint32_t handle;
+  uint32_t strong;
+  uint32_t weak;
+  bool death_requested;
+  binder_uintptr_t death_cookie;
+} emu_ref_t;
+
+typedef struct emu_txn {
+  struct emu_txn *next_in;   // The stack of the receiving thread
+  struct emu_txn *next_out;  // The stack of the sending thread
+  struct emu_thread *from;   // NULL for oneway or when the sender is gone
+  struct emu_proc *to_proc;
+  emu_node_t *node;  // NULL for replies
+  emu_buffer_t *buffer;
+  uint32_t code;
+  uint32_t flags;
+} emu_txn_t;
+
+typedef struct emu_work {
+  struct emu_work *next;
+  uint32_t cmd;  // The `BR_*` command to deliver
+  emu_txn_t *txn;
+  binder_uintptr_t cookie;
+} emu_work_t;
+
+typedef struct {
+  emu_work_t *head;
+  emu_work_t *tail;
+} emu_list_t;
+
+typedef struct emu_thread {
+  struct emu_thread *next;
+  struct emu_proc *proc;
+  pid_t tid;
+  uint32_t looper;
+  emu_list_t todo;
+  bool process_todo;  // Whether `todo` has work to wake up for
+  bool need_return;   // Whether the next read returns even without work
+  emu_txn_t *incoming;
+  emu_txn_t *outgoing;
+} emu_thread_t;
+
+typedef struct emu_context {
+  struct emu_context *next;
+  char *name;
+  emu_node_t *mgr;
+} emu_context_t;
+
+typedef struct emu_proc {
+  struct emu_proc *next;
+  emu_context_t *context;
+  int fd;
+  bool nonblock;
+  bool dead;
+  size_t active;  // Calls in progress, which keep the process allocated
+  uint8_t *map;
+  size_t map_size;
+  emu_buffer_t *buffers;
+  emu_node_t *nodes;
+  emu_ref_t *refs;
+  uint32_t next_handle;
+  emu_thread_t *threads;
+  emu_list_t todo;
+  pthread_cond_t wait;
+  uint32_t max_threads;
+  uint32_t requested_threads;
+  uint32_t started_threads;
+  uint32_t waiting_threads;
+} emu_proc_t;
+
+static pthread_mutex_t emu_lock = PTHREAD_MUTEX_INITIALIZER;
+static emu_context_t *contexts;
+static emu_proc_t *procs;
+
+static void list_push(emu_list_t *list, emu_work_t *work) {
+  work->next = NULL;
+  if (list->tail)
+    list->tail->next = work;
+  else
+    list->head = work;
+  list->tail = work;
+}
+
+static emu_work_t *list_pop(emu_list_t *list) {
+  emu_work_t *work = list->head;
+
+  if (work) {
+    list->head = work->next;
+    if (!list->head)
+      list->tail = NULL;
+  }
+  return work;
+}
+
+static void proc_wake(emu_proc_t *proc) {
+  uint64_t one = 1;
+
+  pthread_cond_broadcast(&proc->wait);
+  // A saturated counter still leaves the descriptor readable
+  if (!proc->dead && write(proc->fd, &one, sizeof(one)) < 0)
+    return;
+}
+
+/*
+ * Queues `cmd` to `thread`, or to any thread of `proc` when `thread` is NULL.
+ * Returns -1 when out of memory.
+ */
+static int queue_work(emu_proc_t *proc, emu_thread_t *thread, uint32_t cmd,
+                      emu_txn_t *txn, binder_uintptr_t cookie) {
+  emu_work_t *work = malloc(sizeof(*work));
+
+  if (!work)
+    return -1;
+
+  work->cmd = cmd;
+  work->txn = txn;
+  work->cookie = cookie;
+  if (thread) {
+    list_push(&thread->todo, work);
+    thread->process_todo = true;
+  } else {
+    list_push(&proc->todo, work);
+  }
+  proc_wake(proc);
+  return 0;
+}
+
+static emu_proc_t *proc_find(int fd) {
+  emu_proc_t *proc;
+
+  for (proc = procs; proc; proc = proc->next) {
+    if (proc->fd == fd)
+      return proc;
+  }
+  return NULL;
+}
+
+static emu_thread_t *thread_get(emu_proc_t *proc) {
+  pid_t tid = syscall(SYS_gettid);
+  emu_thread_t *thread;
+
+  for (thread = proc->threads; thread; thread = thread->next) {
+    if (thread->tid == tid)
+      return thread;
+  }
+
+  thread = calloc(1, sizeof(*thread));
+  if (!thread)
+    return NULL;
+
+  thread->proc = proc;
+  thread->tid = tid;
+  // As in the driver, so that a wakeup before the first read is not lost
+  thread->need_return = true;
+  thread->next = proc->threads;
+  proc->threads = thread;
+  return thread;
+}
+
+static emu_buffer_t *buffer_alloc(emu_proc_t *proc, size_t size) {
+  emu_buffer_t **prev = &proc->buffers, *buffer;
+  size_t offset = 0;
+
+  if (!proc->map)
+    return NULL;
+
+  size = size ? ALIGN8(size) : 8;
+
+  // First fit between the allocations, which are sorted by offset
+  for (; *prev; prev = &(*prev)->next) {
+    if ((*prev)->offset - offset >= size)
+      break;
+    offset = (*prev)->offset + (*prev)->size;
+  }
+  if (proc->map_size < offset || proc->map_size - offset < size)
+    return NULL;
+
+  buffer = calloc(1, sizeof(*buffer));
+  if (!buffer)
+    return NULL;
+
+  buffer->offset = offset;
+  buffer->size = size;
+  buffer->next = *prev;
+  *prev = buffer;
+  return buffer;
+}
+
+static emu_buffer_t *buffer_find(emu_proc_t *proc, binder_uintptr_t ptr) {
+  emu_buffer_t *buffer;
+
+  if (!proc->map)
+    return NULL;
+
+  for (buffer = proc->buffers; buffer; buffer = buffer->next) {
+    if ((binder_uintptr_t)(proc->map + buffer->offset) == ptr)
+      return buffer;
+  }
+  return NULL;
+}
+
+static void buffer_free(emu_proc_t *proc, emu_buffer_t *buffer) {
+  emu_buffer_t **prev;
+
+  for (prev = &proc->buffers; *prev; prev = &(*prev)->next) {
+    if (*prev == buffer) {
+      *prev = buffer->next;
+      break;
+    }
+  }
+  free(buffer);
+}
+
+static emu_node_t *node_get(emu_proc_t *proc, binder_uintptr_t ptr,
+                            binder_uintptr_t cookie, uint32_t flags) {
+  emu_node_t *node;
+
+  for (node = proc->nodes; node; node = node->next) {
+    if (node->ptr == ptr)
+      return node;
+  }
+
+  node = calloc(1, sizeof(*node));
+  if (!node)
+    return NULL;
+
+  node->proc = proc;
+  node->ptr = ptr;
+  node->cookie = cookie;
+  // Like the driver, only the flags a node is created with count
+  node->accept_fds = flags & FLAT_BINDER_FLAG_ACCEPTS_FDS;
+  node->next = proc->nodes;
+  proc->nodes = node;
+  return node;
+}
+
+static void node_put(emu_node_t *node) {
+  if (!--node->refs && !node->proc)
+    free(node);
+}
+
+static emu_ref_t *ref_find(emu_proc_t *proc, uint32_t handle) {
+  emu_ref_t *ref;
+
+  for (ref = proc->refs; ref; ref = ref->next) {
+    if (ref->handle == handle)
+      return ref;
+  }
+
+  // Handle 0 always refers to the context manager
+  if (!handle && proc->context->mgr && proc->context->mgr->proc) {
+    ref = calloc(1, sizeof(*ref));
+    if (!ref)
+      return NULL;
+    ref->node = proc->context->mgr;
+    ref->node->refs++;
+    ref->next = proc->refs;
+    proc->refs = ref;
+  }
+  return ref;
+}
+
+static emu_ref_t *ref_get(emu_proc_t *proc, emu_node_t *node) {
+  emu_ref_t *ref;
+
+  if (node == proc->context->mgr)
+    return ref_find(proc, 0);
+
+  for (ref = proc->refs; ref; ref = ref->next) {
+    if (ref->node == node)
+      return ref;
+  }
+
+  ref = calloc(1, sizeof(*ref));
+  if (!ref)
+    return NULL;
+
+  ref->node = node;
+  ref->handle = proc->next_handle++;
+  node->refs++;
+  ref->next = proc->refs;
+  proc->refs = ref;
+  return ref;
+}
+
+static void ref_delete(emu_proc_t *proc, emu_ref_t *ref) {
+  emu_ref_t **prev;
+
+  for (prev = &proc->refs; *prev; prev = &(*prev)->next) {
+    if (*prev == ref) {
+      *prev = ref->next;
+      node_put(ref->node);
+      free(ref);
+      return;
+    }
+  }
+}
+
+static void ref_dec(emu_proc_t *proc, emu_ref_t *ref, bool strong) {
+  if (strong && ref->strong)
+    ref->strong--;
+  else if (!strong && ref->weak)
+    ref->weak--;
+
+  if (!ref->strong && !ref->weak && !ref->death_requested)
+    ref_delete(proc, ref);
+}
+
+static void txn_stack_remove(emu_txn_t **stack, emu_txn_t *txn, bool in) {
+  for (; *stack; stack = in ? &(*stack)->next_in : &(*stack)->next_out) {
+    if (*stack == txn) {
+      *stack = in ? txn->next_in : txn->next_out;
+      return;
+    }
+  }
+}
+
+/*
+ * Fails a two-way transaction whose receiver is gone: the sender, if still
+ * around, gets `BR_DEAD_REPLY`.
+ */
+static void txn_fail(emu_txn_t *txn) {
+  emu_thread_t *from = txn->from;
+
+  if (from) {
+    txn_stack_remove(&from->outgoing, txn, false);
+    queue_work(from->proc, from, BR_DEAD_REPLY, NULL, 0);
+  }
+  free(txn);
+}
+
+/*
+ * Releases the references held by the objects of `buffer`, and closes the
+ * descriptors of its fd arrays, as the driver does on `BC_FREE_BUFFER`. The
+ * descriptors of fd objects are closed too if the buffer never reached `proc`,
+ * which then never owned them.
+ */
+static void buffer_release(emu_proc_t *proc, emu_buffer_t *buffer,
+                           bool undelivered) {
+  uint8_t *data = proc->map + buffer->offset;
+  binder_size_t *offs = (binder_size_t *)(data + ALIGN8(buffer->data_size));
+  size_t i, n, count = buffer->offsets_size / sizeof(binder_size_t);
+  struct flat_binder_object *fbo;
+  emu_ref_t *ref;
+
+  for (i = 0; i < count; i++) {
+    fbo = (struct flat_binder_object *)(data + offs[i]);
+    if (fbo->hdr.type == BINDER_TYPE_FDA) {
+      struct binder_fd_array_object *fda =
+          (struct binder_fd_array_object *)fbo;
+      struct binder_buffer_object *parent =
+          (struct binder_buffer_object *)(data + offs[fda->parent]);
+      uint32_t *fds = (uint32_t *)((uint8_t *)(uintptr_t)parent->buffer
+                                   + fda->parent_offset);
+
+      for (n = 0; n < fda->num_fds; n++)
+        close(fds[n]);
+      continue;
+    }
+    if (fbo->hdr.type == BINDER_TYPE_FD) {
+      if (undelivered)
+        close(((struct binder_fd_object *)fbo)->fd);
+      continue;
+    }
+    if (fbo->hdr.type != BINDER_TYPE_HANDLE
+        && fbo->hdr.type != BINDER_TYPE_WEAK_HANDLE)
+      continue;
+    ref = ref_find(proc, fbo->handle);
+    if (ref)
+      ref_dec(proc, ref, fbo->hdr.type == BINDER_TYPE_HANDLE);
+  }
+}
+
+/*
+ * Translates a binder or handle object from `from` for `to`, taking a
+ * reference for the transaction.
+ */
+static int translate_binder(emu_proc_t *from, emu_proc_t *to,
+                            struct flat_binder_object *fbo) {
+  bool strong;
+  emu_node_t *node;
+  emu_ref_t *ref;
+
+  switch (fbo->hdr.type) {
+    case BINDER_TYPE_BINDER:
+    case BINDER_TYPE_WEAK_BINDER:
+      strong = fbo->hdr.type == BINDER_TYPE_BINDER;
+      node = node_get(from, fbo->binder, fbo->cookie, fbo->flags);
+      break;
+    default:
+      strong = fbo->hdr.type == BINDER_TYPE_HANDLE;
+      ref = ref_find(from, fbo->handle);
+      if (!ref || !ref->node->proc)
+        return -1;
+      node = ref->node;
+      break;
+  }
+  if (!node)
+    return -1;
+
+  if (node->proc == to) {
+    fbo->hdr.type = strong ? BINDER_TYPE_BINDER : BINDER_TYPE_WEAK_BINDER;
+    fbo->binder = node->ptr;
+    fbo->cookie = node->cookie;
+    return 0;
+  }
+
+  ref = ref_get(to, node);
+  if (!ref)
+    return -1;
+  if (strong)
+    ref->strong++;
+  else
+    ref->weak++;
+
+  fbo->hdr.type = strong ? BINDER_TYPE_HANDLE : BINDER_TYPE_WEAK_HANDLE;
+  fbo->handle = ref->handle;
+  fbo->cookie = 0;
+  return 0;
+}
+
+/*
+ * Copies a transaction from `from` into a new buffer of `to` and translates its
+ * objects. Returns the buffer, or NULL if the transaction is malformed, does
+ * not fit, or carries file descriptors that `to` does not accept.
+ */
+static emu_buffer_t *txn_copy(emu_proc_t *from, emu_proc_t *to,
+                              const struct binder_transaction_data *tr,
+                              binder_size_t buffers_size, bool accept_fds) {
+  size_t data_size = tr->data_size, offsets_size = tr->offsets_size;
+  size_t i, count, object_size, sg_offset, sg_end;
+  emu_buffer_t *buffer;
+  binder_size_t *offs;
+  uint8_t *data;
+
+  if (offsets_size % sizeof(binder_size_t) || buffers_size % 8)
+    return NULL;
+
+  buffer = buffer_alloc(
+      to, ALIGN8(data_size) + ALIGN8(offsets_size) + buffers_size);
+  if (!buffer)
+    return NULL;
+
+  buffer->data_size = data_size;
+  data = to->map + buffer->offset;
+  offs = (binder_size_t *)(data + ALIGN8(data_size));
+  sg_offset = ALIGN8(data_size) + ALIGN8(offsets_size);
+  sg_end = sg_offset + buffers_size;
+
+  if (data_size)
+    memcpy(data, (const void *)(uintptr_t)tr->data.ptr.buffer, data_size);
+  if (offsets_size)
+    memcpy(offs, (const void *)(uintptr_t)tr->data.ptr.offsets, offsets_size);
+
+  count = offsets_size / sizeof(binder_size_t);
+  for (i = 0; i < count; i++) {
+    struct binder_object_header *hdr;
+
+    // Record translated objects so far, for `buffer_release` on failure
+    buffer->offsets_size = i * sizeof(binder_size_t);
+
+    if (offs[i] % sizeof(uint32_t) || offs[i] > data_size
+        || data_size - offs[i] < sizeof(*hdr))
+      goto err;
+
+    hdr = (struct binder_object_header *)(data + offs[i]);
+    switch (hdr->type) {
+      case BINDER_TYPE_BINDER:
+      case BINDER_TYPE_WEAK_BINDER:
+      case BINDER_TYPE_HANDLE:
+      case BINDER_TYPE_WEAK_HANDLE:
+        object_size = sizeof(struct flat_binder_object);
+        break;
+      case BINDER_TYPE_FD:
+        object_size = sizeof(struct binder_fd_object);
+        break;
+      case BINDER_TYPE_PTR:
+        object_size = sizeof(struct binder_buffer_object);
+        break;
+      case BINDER_TYPE_FDA:
+        object_size = sizeof(struct binder_fd_array_object);
+        break;
+      default:
+        goto err;
+    }
+    if (data_size - offs[i] < object_size)
+      goto err;
+    if ((hdr->type == BINDER_TYPE_FD || hdr->type == BINDER_TYPE_FDA)
+        && !accept_fds)
+      goto err;
+
+    switch (hdr->type) {
+      case BINDER_TYPE_FD: {
+        struct binder_fd_object *fdo = (struct binder_fd_object *)hdr;
+        int fd = fcntl(fdo->fd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0)
+          goto err;
+        fdo->fd = fd;
+        break;
+      }
+      case BINDER_TYPE_PTR: {
+        struct binder_buffer_object *bbo = (struct binder_buffer_object *)hdr;
+        struct binder_buffer_object *parent;
+        uint8_t *copy = data + sg_offset;
+
+        if (bbo->length > sg_end - sg_offset)
+          goto err;
+        memcpy(copy, (const void *)(uintptr_t)bbo->buffer, bbo->length);
+        bbo->buffer = (binder_uintptr_t)copy;
+        sg_offset += ALIGN8(bbo->length);
+
+        if (bbo->flags & BINDER_BUFFER_FLAG_HAS_PARENT) {
+          if (bbo->parent >= i)
+            goto err;
+          parent = (struct binder_buffer_object *)(data + offs[bbo->parent]);
+          if (parent->hdr.type != BINDER_TYPE_PTR
+              || bbo->parent_offset > parent->length
+              || parent->length - bbo->parent_offset < sizeof(binder_uintptr_t))
+            goto err;
+          memcpy((uint8_t *)(uintptr_t)parent->buffer + bbo->parent_offset,
+                 &bbo->buffer, sizeof(bbo->buffer));
+        }
+        break;
+      }
+      case BINDER_TYPE_FDA: {
+        struct binder_fd_array_object *fda =
+            (struct binder_fd_array_object *)hdr;
+        struct binder_buffer_object *parent;
+        uint32_t *fds;
+        size_t n;
+
+        if (fda->parent >= i)
+          goto err;
+        parent = (struct binder_buffer_object *)(data + offs[fda->parent]);
+        if (parent->hdr.type != BINDER_TYPE_PTR
+            || fda->parent_offset > parent->length
+            || (parent->length - fda->parent_offset) / sizeof(uint32_t)
+                   < fda->num_fds)
+          goto err;
+
+        fds = (uint32_t *)((uint8_t *)(uintptr_t)parent->buffer
+                           + fda->parent_offset);
+        for (n = 0; n < fda->num_fds; n++) {
+          int fd = fcntl(fds[n], F_DUPFD_CLOEXEC, 0);
+          if (fd < 0) {
+            while (n--)
+              close(fds[n]);
+            goto err;
+          }
+          fds[n] = fd;
+        }
+        break;
+      }
+      default:
+        if (translate_binder(from, to, (struct flat_binder_object *)hdr) < 0)
+          goto err;
+        break;
+    }
+  }
+
+  buffer->offsets_size = offsets_size;
+  return buffer;
+
+err:
+  buffer_release(to, buffer, true);
+  buffer_free(to, buffer);
+  return NULL;
+}
+
+/*
+ * Drops a work item that will never be read by `proc`, failing the transaction
+ * it carries.
+ */
+static void work_free(emu_proc_t *proc, emu_work_t *work) {
+  emu_txn_t *txn = work->txn;
+
+  if (txn) {
+    if (proc->map) {
+      buffer_release(proc, txn->buffer, true);
+      buffer_free(proc, txn->buffer);
+    }
+    if (work->cmd == BR_TRANSACTION && !(txn->flags & TF_ONE_WAY))
+      txn_fail(txn);
+    else
+      free(txn);
+  }
+  free(work);
+}
+
+/*
+ * Fails the transactions waiting on `thread` and detaches it from those it is
+ * waiting on.
+ */
+static void thread_flush(emu_thread_t *thread) {
+  emu_work_t *work;
+  emu_txn_t *txn;
+
+  while ((txn = thread->incoming)) {
+    thread->incoming = txn->next_in;
+    txn_fail(txn);
+  }
+
+  while ((txn = thread->outgoing)) {
+    thread->outgoing = txn->next_out;
+    txn->from = NULL;
+  }
+
+  while ((work = list_pop(&thread->todo)))
+    work_free(thread->proc, work);
+}
+
+static void thread_release(emu_thread_t *thread) {
+  emu_thread_t **prev;
+
+  thread_flush(thread);
+  for (prev = &thread->proc->threads; *prev; prev = &(*prev)->next) {
+    if (*prev == thread) {
+      *prev = thread->next;
+      break;
+    }
+  }
+  free(thread);
+}
+
+static bool thread_is_looper(emu_thread_t *thread) {
+  return thread->looper & (LOOPER_REGISTERED | LOOPER_ENTERED);
+}
+
+// Whether `thread` may pick up work queued to its process
+static bool thread_available(emu_thread_t *thread) {
+  return !thread->incoming && !thread->outgoing && !thread->todo.head
+         && thread_is_looper(thread);
+}
+
+/*
+ * Sends a transaction or a reply from `thread`. Returns the `BR_*` error to
+ * report to the sender, or 0.
+ */
+static uint32_t emu_transaction(emu_thread_t *thread,
+                                const struct binder_transaction_data *tr,
+                                binder_size_t buffers_size, bool reply) {
+  emu_proc_t *proc = thread->proc, *to_proc;
+  emu_thread_t *to_thread = NULL;
+  emu_node_t *node = NULL;
+  emu_txn_t *txn, *in_reply_to;
+  emu_ref_t *ref;
+  bool accept_fds;
+
+  if (reply) {
+    in_reply_to = thread->incoming;
+    if (!in_reply_to)
+      return BR_FAILED_REPLY;
+    thread->incoming = in_reply_to->next_in;
+    to_thread = in_reply_to->from;
+    if (to_thread)
+      txn_stack_remove(&to_thread->outgoing, in_reply_to, false);
+    accept_fds = in_reply_to->flags & TF_ACCEPT_FDS;
+    free(in_reply_to);
+    if (!to_thread || to_thread->proc->dead)
+      return BR_DEAD_REPLY;
+    to_proc = to_thread->proc;
+  } else {
+    ref = ref_find(proc, tr->target.handle);
+    if (!ref)
+      return BR_FAILED_REPLY;
+    node = ref->node;
+    to_proc = node->proc;
+    if (!to_proc || to_proc->dead)
+      return BR_DEAD_REPLY;
+    accept_fds = node->accept_fds;
+
+    // A call back into a process waiting on this thread goes to the waiting
+    // thread, as in the driver
+    if (!(tr->flags & TF_ONE_WAY)) {
+      for (txn = thread->incoming; txn; txn = txn->next_in) {
+        if (txn->from && txn->from->proc == to_proc) {
+          to_thread = txn->from;
+          break;
+        }
+      }
+    }
+  }
+
+  txn = calloc(1, sizeof(*txn));
+  if (txn)
+    txn->buffer = txn_copy(proc, to_proc, tr, buffers_size, accept_fds);
+  if (!txn || !txn->buffer) {
+    // The caller waiting on a failed reply learns about it too
+    if (reply)
+      queue_work(to_proc, to_thread, BR_FAILED_REPLY, NULL, 0);
+    free(txn);
+    return BR_FAILED_REPLY;
+  }
+
+  txn->node = node;
+  txn->to_proc = to_proc;
+  txn->code = tr->code;
+  txn->flags = tr->flags;
+
+  if (queue_work(to_proc, to_thread, reply ? BR_REPLY : BR_TRANSACTION, txn,
+                 0)
+      < 0) {
+    buffer_release(to_proc, txn->buffer, true);
+    buffer_free(to_proc, txn->buffer);
+    free(txn);
+    return BR_FAILED_REPLY;
+  }
+
+  if (!reply && !(tr->flags & TF_ONE_WAY)) {
+    txn->from = thread;
+    txn->next_out = thread->outgoing;
+    thread->outgoing = txn;
+  }
+
+  // As in the driver, the completion of a two-way transaction is only read
+  // along with the reply, saving a round trip
+  queue_work(proc, thread, BR_TRANSACTION_COMPLETE, NULL, 0);
+  if (!reply && !(tr->flags & TF_ONE_WAY))
+    thread->process_todo = false;
+  return 0;
+}
+
+// Death notifications go to a looper of the process, or to a plain thread
+static void queue_death_work(emu_thread_t *thread, uint32_t cmd,
+                             binder_uintptr_t cookie) {
+  queue_work(thread->proc, thread_is_looper(thread) ? NULL : thread, cmd, NULL,
+             cookie);
+}
+
+static void emu_refcount(emu_thread_t *thread, uint32_t cmd, uint32_t handle) {
+  emu_ref_t *ref = ref_find(thread->proc, handle);
+
+  if (!ref)
+    return;
+
+  switch (cmd) {
+    case BC_INCREFS:
+      ref->weak++;
+      break;
+    case BC_ACQUIRE:
+      ref->strong++;
+      break;
+    case BC_RELEASE:
+      ref_dec(thread->proc, ref, true);
+      break;
+    case BC_DECREFS:
+      ref_dec(thread->proc, ref, false);
+      break;
+  }
+}
+
+static void emu_death_notification(emu_thread_t *thread, uint32_t cmd,
+                                   const struct binder_handle_cookie *hc) {
+  emu_ref_t *ref = ref_find(thread->proc, hc->handle);
+
+  if (!ref)
+    return;
+
+  if (cmd == BC_REQUEST_DEATH_NOTIFICATION) {
+    if (ref->death_requested)
+      return;
+    ref->death_requested = true;
+    ref->death_cookie = hc->cookie;
+    if (!ref->node->proc)
+      queue_death_work(thread, BR_DEAD_BINDER, hc->cookie);
+    return;
+  }
+
+  if (!ref->death_requested || ref->death_cookie != hc->cookie)
+    return;
+  ref->death_requested = false;
+  queue_death_work(thread, BR_CLEAR_DEATH_NOTIFICATION_DONE, hc->cookie);
+  if (!ref->strong && !ref->weak)
+    ref_delete(thread->proc, ref);
+}
+
+static int emu_write(emu_thread_t *thread, struct binder_write_read *bwr) {
+  uint8_t *buffer = (uint8_t *)(uintptr_t)bwr->write_buffer;
+  uint8_t *ptr = buffer + bwr->write_consumed;
+  uint8_t *end = buffer + bwr->write_size;
+  emu_proc_t *proc = thread->proc;
+  uint32_t cmd, error, handle;
+  binder_uintptr_t cookie;
+  emu_buffer_t *buf;
+  size_t size;
+  void *data;
+
+  while (end - ptr >= (ptrdiff_t)sizeof(cmd)) {
+    memcpy(&cmd, ptr, sizeof(cmd));
+    size = _IOC_SIZE(cmd);
+    data = ptr + sizeof(cmd);
+    if ((size_t)(end - ptr) - sizeof(cmd) < size) {
+      errno = EINVAL;
+      return -1;
+    }
+
+    error = 0;
+    switch (cmd) {
+      case BC_TRANSACTION:
+      case BC_REPLY: {
+        // Commands are only 4-byte aligned in the stream
+        struct binder_transaction_data tr;
+        memcpy(&tr, data, sizeof(tr));
+        error = emu_transaction(thread, &tr, 0, cmd == BC_REPLY);
+        break;
+      }
+      case BC_TRANSACTION_SG:
+      case BC_REPLY_SG: {
+        struct binder_transaction_data_sg sg;
+        memcpy(&sg, data, sizeof(sg));
+        error = emu_transaction(thread, &sg.transaction_data, sg.buffers_size,
+                                cmd == BC_REPLY_SG);
+        break;
+      }
+      case BC_FREE_BUFFER:
+        memcpy(&cookie, data, sizeof(cookie));
+        buf = buffer_find(proc, cookie);
+        if (buf) {
+          buffer_release(proc, buf, false);
+          buffer_free(proc, buf);
+        }
+        break;
+      case BC_INCREFS:
+      case BC_ACQUIRE:
+      case BC_RELEASE:
+      case BC_DECREFS:
+        memcpy(&handle, data, sizeof(handle));
+        emu_refcount(thread, cmd, handle);
+        break;
+      case BC_INCREFS_DONE:
+      case BC_ACQUIRE_DONE:
+      case BC_DEAD_BINDER_DONE:
+        break;
+      case BC_REGISTER_LOOPER:
+        thread->looper |= LOOPER_REGISTERED;
+        if (proc->requested_threads) {
+          proc->requested_threads--;
+          proc->started_threads++;
+        }
+        break;
+      case BC_ENTER_LOOPER:
+        thread->looper |= LOOPER_ENTERED;
+        break;
+      case BC_EXIT_LOOPER:
+        thread->looper = 0;
+        break;
+      case BC_REQUEST_DEATH_NOTIFICATION:
+      case BC_CLEAR_DEATH_NOTIFICATION: {
+        struct binder_handle_cookie hc;
+        memcpy(&hc, data, sizeof(hc));
+        emu_death_notification(thread, cmd, &hc);
+        break;
+      }
+      default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    ptr += sizeof(cmd) + size;
+    bwr->write_consumed = ptr - buffer;
+
+    // The driver stops processing commands after a failed transaction
+    if (error) {
+      queue_work(proc, thread, error, NULL, 0);
+      break;
+    }
+  }
+
+  return 0;
+}
+
+static bool proc_has_work(emu_proc_t *proc) {
+  emu_thread_t *thread;
+
+  if (proc->todo.head)
+    return true;
+  for (thread = proc->threads; thread; thread = thread->next) {
+    if (thread->todo.head)
+      return true;
+  }
+  return false;
+}
+
+static void put_txn(emu_thread_t *thread, emu_work_t *work, uint8_t *ptr) {
+  emu_txn_t *txn = work->txn;
+  emu_proc_t *proc = thread->proc;
+  uint8_t *data = proc->map + txn->buffer->offset;
+  struct binder_transaction_data tr = {0};
+
+  if (work->cmd == BR_TRANSACTION) {
+    tr.target.ptr = txn->node->ptr;
+    tr.cookie = txn->node->cookie;
+  }
+  tr.code = txn->code;
+  tr.flags = txn->flags;
+  tr.sender_pid = getpid();
+  tr.sender_euid = geteuid();
+  tr.data_size = txn->buffer->data_size;
+  tr.offsets_size = txn->buffer->offsets_size;
+  tr.data.ptr.buffer = (binder_uintptr_t)data;
+  tr.data.ptr.offsets =
+      (binder_uintptr_t)(data + ALIGN8(txn->buffer->data_size));
+
+  memcpy(ptr, &work->cmd, sizeof(work->cmd));
+  memcpy(ptr + sizeof(work->cmd), &tr, sizeof(tr));
+
+  // Two-way transactions stay on the stack of the thread until it replies
+  if (work->cmd == BR_TRANSACTION && !(txn->flags & TF_ONE_WAY)) {
+    txn->next_in = thread->incoming;
+    thread->incoming = txn;
+  } else {
+    free(txn);
+  }
+}
+
+static int emu_read(emu_thread_t *thread, struct binder_write_read *bwr) {
+  uint8_t *buffer = (uint8_t *)(uintptr_t)bwr->read_buffer;
+  uint8_t *ptr = buffer + bwr->read_consumed;
+  uint8_t *end = buffer + bwr->read_size;
+  emu_proc_t *proc = thread->proc;
+  uint32_t cmd = BR_NOOP;
+  emu_list_t *list;
+  emu_work_t *work;
+  bool proc_work;
+  size_t size;
+  uint64_t count;
+
+  while (1) {
+    if (proc->dead) {
+      errno = EBADF;
+      return -1;
+    }
+
+    proc_work = thread_available(thread);
+    if ((thread->todo.head && thread->process_todo)
+        || (proc_work && proc->todo.head))
+      break;
+
+    if (thread->need_return)
+      break;
+
+    if (proc->nonblock) {
+      errno = EAGAIN;
+      return -1;
+    }
+
+    if (proc_work)
+      proc->waiting_threads++;
+    pthread_cond_wait(&proc->wait, &emu_lock);
+    if (proc_work)
+      proc->waiting_threads--;
+  }
+  thread->need_return = false;
+
+  if (!bwr->read_consumed && end - ptr >= (ptrdiff_t)sizeof(cmd)) {
+    memcpy(ptr, &cmd, sizeof(cmd));
+    ptr += sizeof(cmd);
+  }
+
+  while (1) {
+    if (thread->todo.head)
+      list = &thread->todo;
+    else if (proc_work && proc->todo.head)
+      list = &proc->todo;
+    else
+      break;
+
+    work = list->head;
+    size = sizeof(work->cmd);
+    if (work->txn)
+      size += sizeof(struct binder_transaction_data);
+    else if (work->cmd == BR_DEAD_BINDER
+             || work->cmd == BR_CLEAR_DEATH_NOTIFICATION_DONE)
+      size += sizeof(work->cookie);
+    if ((size_t)(end - ptr) < size)
+      break;
+
+    list_pop(list);
+    if (work->txn) {
+      put_txn(thread, work, ptr);
+    } else {
+      memcpy(ptr, &work->cmd, sizeof(work->cmd));
+      if (size > sizeof(work->cmd))
+        memcpy(ptr + sizeof(work->cmd), &work->cookie, sizeof(work->cookie));
+    }
+    ptr += size;
+
+    // At most one transaction or reply is returned per read
+    if (work->txn) {
+      free(work);
+      break;
+    }
+    free(work);
+  }
+
+  if (!proc->requested_threads && !proc->waiting_threads
+      && proc->started_threads < proc->max_threads && thread_is_looper(thread)
+      && end - ptr >= (ptrdiff_t)sizeof(cmd)) {
+    cmd = BR_SPAWN_LOOPER;
+    memcpy(ptr, &cmd, sizeof(cmd));
+    ptr += sizeof(cmd);
+    proc->requested_threads++;
+  }
+
+  // Nothing left to poll for
+  if (!proc_has_work(proc) && read(proc->fd, &count, sizeof(count)) < 0)
+    count = 0;
+
+  bwr->read_consumed = ptr - buffer;
+  return 0;
+}
+
+static emu_context_t *context_get(const char *name) {
+  emu_context_t *context;
+
+  for (context = contexts; context; context = context->next) {
+    if (!strcmp(context->name, name))
+      return context;
+  }
+
+  context = calloc(1, sizeof(*context));
+  if (!context)
+    return NULL;
+
+  context->name = strdup(name);
+  if (!context->name) {
+    free(context);
+    return NULL;
+  }
+
+  context->next = contexts;
+  contexts = context;
+  return context;
+}
+
+static void proc_free(emu_proc_t *proc) {
+  emu_buffer_t *buffer;
+
+  while (proc->threads)
+    thread_release(proc->threads);
+  while ((buffer = proc->buffers)) {
+    proc->buffers = buffer->next;
+    free(buffer);
+  }
+  pthread_cond_destroy(&proc->wait);
+  free(proc);
+}
+
+static int emu_open(const char *device, int flags) {
+  emu_proc_t *proc;
+  int fd;
+
+  proc = calloc(1, sizeof(*proc));
+  if (!proc)
+    return -1;
+
+  fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fd < 0) {
+    free(proc);
+    return -1;
+  }
+
+  pthread_mutex_lock(&emu_lock);
+  proc->context = context_get(device);
+  if (!proc->context) {
+    pthread_mutex_unlock(&emu_lock);
+    close(fd);
+    free(proc);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  proc->fd = fd;
+  proc->nonblock = flags & O_NONBLOCK;
+  proc->next_handle = 1;
+  pthread_cond_init(&proc->wait, NULL);
+  proc->next = procs;
+  procs = proc;
+  pthread_mutex_unlock(&emu_lock);
+
+  return fd;
+}
+
+static void *emu_mmap(int fd, size_t size) {
+  void *map = MAP_FAILED;
+  emu_proc_t *proc;
+
+  pthread_mutex_lock(&emu_lock);
+  proc = proc_find(fd);
+  if (!proc) {
+    errno = EBADF;
+  } else if (proc->map) {
+    errno = EBUSY;
+  } else {
+    // The region stays writable for the emulator to copy transactions in
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+               -1, 0);
+    if (map != MAP_FAILED) {
+      proc->map = map;
+      proc->map_size = size;
+    }
+  }
+  pthread_mutex_unlock(&emu_lock);
+
+  return map;
+}
+
+static int emu_munmap(int fd, void *addr, size_t size) {
+  emu_buffer_t *buffer;
+  emu_thread_t *thread;
+  emu_work_t *work;
+  emu_proc_t *proc;
+
+  pthread_mutex_lock(&emu_lock);
+  proc = proc_find(fd);
+  if (proc && proc->map == addr) {
+    // Transactions not read yet cannot be delivered anymore
+    while ((work = list_pop(&proc->todo)))
+      work_free(proc, work);
+    for (thread = proc->threads; thread; thread = thread->next) {
+      while ((work = list_pop(&thread->todo)))
+        work_free(proc, work);
+    }
+    proc->map = NULL;
+    while ((buffer = proc->buffers)) {
+      proc->buffers = buffer->next;
+      free(buffer);
+    }
+  }
+  pthread_mutex_unlock(&emu_lock);
+
+  return munmap(addr, size);
+}
+
+static int emu_ioctl(int fd, unsigned long request, void *arg) {
+  emu_thread_t *thread;
+  emu_proc_t *proc;
+  int ret = 0;
+
+  pthread_mutex_lock(&emu_lock);
+  proc = proc_find(fd);
+  if (!proc) {
+    pthread_mutex_unlock(&emu_lock);
+    errno = EBADF;
+    return -1;
+  }
+
+  proc->active++;
+  thread = thread_get(proc);
+  if (!thread) {
+    errno = ENOMEM;
+    ret = -1;
+    goto out;
+  }
+
+  switch (request) {
+    case BINDER_WRITE_READ: {
+      struct binder_write_read *bwr = arg;
+      if (bwr->write_size > bwr->write_consumed)
+        ret = emu_write(thread, bwr);
+      if (ret == 0 && bwr->read_size)
+        ret = emu_read(thread, bwr);
+      break;
+    }
+    case BINDER_SET_MAX_THREADS:
+      proc->max_threads = *(uint32_t *)arg;
+      break;
+    case BINDER_SET_CONTEXT_MGR:
+    case BINDER_SET_CONTEXT_MGR_EXT: {
+      struct flat_binder_object *fbo = arg;
+      emu_node_t *mgr = proc->context->mgr;
+      if (mgr && mgr->proc) {
+        errno = EBUSY;
+        ret = -1;
+        break;
+      }
+      if (request == BINDER_SET_CONTEXT_MGR_EXT)
+        mgr = node_get(proc, fbo->binder, fbo->cookie, fbo->flags);
+      else
+        mgr = node_get(proc, 0, 0, 0);
+      if (!mgr) {
+        errno = ENOMEM;
+        ret = -1;
+        break;
+      }
+      proc->context->mgr = mgr;
+      break;
+    }
+    case BINDER_THREAD_EXIT:
+      thread_release(thread);
+      break;
+    case BINDER_VERSION:
+      ((struct binder_version *)arg)->protocol_version =
+          BINDER_CURRENT_PROTOCOL_VERSION;
+      break;
+    default:
+      errno = EINVAL;
+      ret = -1;
+      break;
+  }
+
+out:
+  if (!--proc->active && proc->dead)
+    proc_free(proc);
+  pthread_mutex_unlock(&emu_lock);
+  return ret;
+}
+
+static int emu_close(int fd) {
+  emu_proc_t **prev, *proc, *other;
+  emu_node_t *node, *next;
+  emu_thread_t *thread;
+  emu_work_t *work;
+  emu_ref_t *ref;
+
+  pthread_mutex_lock(&emu_lock);
+  for (prev = &procs; *prev; prev = &(*prev)->next) {
+    if ((*prev)->fd == fd)
+      break;
+  }
+  proc = *prev;
+  if (!proc) {
+    pthread_mutex_unlock(&emu_lock);
+    errno = EBADF;
+    return -1;
+  }
+
+  *prev = proc->next;
+  proc->dead = true;
+  proc->fd = -1;
+
+  // Senders waiting on this process get `BR_DEAD_REPLY`
+  while ((work = list_pop(&proc->todo)))
+    work_free(proc, work);
+  for (thread = proc->threads; thread; thread = thread->next)
+    thread_flush(thread);
+
+  // Nodes outlive their owner while referenced, to report deaths
+  for (node = proc->nodes; node; node = next) {
+    next = node->next;
+    node->proc = NULL;
+    if (proc->context->mgr == node)
+      proc->context->mgr = NULL;
+    for (other = procs; other; other = other->next) {
+      for (ref = other->refs; ref; ref = ref->next) {
+        if (ref->node == node && ref->death_requested)
+          queue_work(other, NULL, BR_DEAD_BINDER, NULL, ref->death_cookie);
+      }
+    }
+    if (!node->refs)
+      free(node);
+  }
+  proc->nodes = NULL;
+
+  while ((ref = proc->refs)) {
+    proc->refs = ref->next;
+    node_put(ref->node);
+    free(ref);
+  }
+
+  if (proc->map)
+    munmap(proc->map, proc->map_size);
+  proc->map = NULL;
+
+  // Blocked readers return `EBADF`; the last one out frees the process
+  pthread_cond_broadcast(&proc->wait);
+  if (!proc->active)
+    proc_free(proc);
+  pthread_mutex_unlock(&emu_lock);
+
+  return close(fd);
+}
+
+/*
+ * Wakes the threads of the process, as the driver does when the device is
+ * flushed: their next read returns, even without work.
+ */
+static int emu_wake(int fd) {
+  emu_thread_t *thread;
+  emu_proc_t *proc;
+
+  pthread_mutex_lock(&emu_lock);
+  proc = proc_find(fd);
+  if (!proc) {
+    pthread_mutex_unlock(&emu_lock);
+    errno = EBADF;
+    return -1;
+  }
+
+  for (thread = proc->threads; thread; thread = thread->next)
+    thread->need_return = true;
+  pthread_cond_broadcast(&proc->wait);
+  pthread_mutex_unlock(&emu_lock);
+
+  return 0;
+}
+
+const binder_backend_t binder_emulator_backend = {
+    .open = emu_open,
+    .mmap = emu_mmap,
+    .munmap = emu_munmap,
+    .ioctl = emu_ioctl,
+    .close = emu_close,
+    .wake = emu_wake,
+};
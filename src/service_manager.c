@@ -0,0 +1,405 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "service_manager.h"
+
+#include <errno.h>
+#include <linux/android/binder.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+#define SVCMGR_CACHE_MASK (BINDER_SVCMGR_CACHE_SIZE - 1)
+// Entries are evicted beyond this load, keeping probe sequences short
+#define SVCMGR_CACHE_MAX (BINDER_SVCMGR_CACHE_SIZE * 3 / 4)
+
+#define STRICT_MODE_PENALTY_GATHER (1 << 31)
+#define WORK_SOURCE_UNSET -1
+#define DUMP_FLAG_PRIORITY_DEFAULT (1 << 3)
+
+/*
+ * Death notification cookies carry the handle in their low half and a tag of
+ * the client in their high half, telling them apart from the cookies of the
+ * handlers chained after it.
+ */
+#define SVCMGR_TAG(sm) ((uint32_t)((uintptr_t)(sm) >> 4))
+#define SVCMGR_COOKIE(sm, handle) \
+  ((binder_uintptr_t)SVCMGR_TAG(sm) << 32 | (uint32_t)(handle))
+
+typedef struct {
+  uint32_t hash;  // 0 for unused entries
+  int32_t handle;
+  // Whether the death notification of `handle` was requested for this entry
+  bool watched;
+  uint64_t age;  // The insertion order, for evicting the oldest entry
+  char name[BINDER_SVCMGR_NAME_MAX];
+} svcmgr_entry_t;
+
+struct binder_svcmgr {
+  uint32_t seq;  // Odd while a writer modifies `entries`
+  uint32_t flags;
+  pthread_mutex_t lock;  // Serializes writers
+  size_t count;
+  uint64_t age;
+
+  binder_death_handler_t next_handler;
+  void *next_arg;
+
+  svcmgr_entry_t entries[BINDER_SVCMGR_CACHE_SIZE];
+};
+
+static uint32_t svcmgr_hash(const char *name, size_t *len) {
+  const char *p = name;
+  uint32_t h = 0x811c9dc5;  // FNV-1a
+
+  while (*p) {
+    h ^= (uint8_t)*p++;
+    h *= 0x01000193;
+  }
+  *len = p - name;
+
+  return h ? h : 1;
+}
+
+/*
+ * Writers bump `seq` to odd before modifying entries and back to even after,
+ * with `lock` held. Readers retry when they saw an odd or changed sequence,
+ * so they may read torn entries but never return one.
+ */
+static void svcmgr_write_begin(binder_svcmgr_t *sm) {
+  pthread_mutex_lock(&sm->lock);
+  __atomic_store_n(&sm->seq, sm->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void svcmgr_write_end(binder_svcmgr_t *sm) {
+  __atomic_store_n(&sm->seq, sm->seq + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&sm->lock);
+}
+
+// Returns the index of the entry of `name`, or of the unused entry ending its
+// probe sequence. Readers bound the probes, as torn reads may never end it.
+static size_t svcmgr_probe(const binder_svcmgr_t *sm, const char *name,
+                           uint32_t hash) {
+  size_t i = hash & SVCMGR_CACHE_MASK;
+  size_t n;
+
+  for (n = 0; n < BINDER_SVCMGR_CACHE_SIZE; n++) {
+    const svcmgr_entry_t *e = &sm->entries[i];
+    uint32_t h = __atomic_load_n(&e->hash, __ATOMIC_RELAXED);
+
+    if (!h || (h == hash && !strncmp(e->name, name, BINDER_SVCMGR_NAME_MAX)))
+      return i;
+    i = (i + 1) & SVCMGR_CACHE_MASK;
+  }
+
+  return BINDER_SVCMGR_CACHE_SIZE;
+}
+
+static int32_t svcmgr_cache_find(const binder_svcmgr_t *sm, const char *name,
+                                 uint32_t hash) {
+  uint32_t seq;
+  int32_t handle;
+  size_t i;
+
+  do {
+    while ((seq = __atomic_load_n(&sm->seq, __ATOMIC_ACQUIRE)) & 1)
+      ;
+
+    handle = -1;
+    i = svcmgr_probe(sm, name, hash);
+    if (i < BINDER_SVCMGR_CACHE_SIZE
+        && __atomic_load_n(&sm->entries[i].hash, __ATOMIC_RELAXED))
+      handle = __atomic_load_n(&sm->entries[i].handle, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&sm->seq, __ATOMIC_RELAXED) != seq);
+
+  return handle;
+}
+
+// Removes entry `i`, shifting back the entries probed past it.
+static void svcmgr_cache_remove(binder_svcmgr_t *sm, size_t i) {
+  size_t j = i, home;
+
+  for (;;) {
+    j = (j + 1) & SVCMGR_CACHE_MASK;
+    if (!sm->entries[j].hash)
+      break;
+
+    // Entry `j` may fill the hole if its home is not cyclically in (i, j]
+    home = sm->entries[j].hash & SVCMGR_CACHE_MASK;
+    if ((j > i && (home <= i || home > j))
+        || (j < i && home <= i && home > j)) {
+      sm->entries[i] = sm->entries[j];
+      i = j;
+    }
+  }
+
+  __atomic_store_n(&sm->entries[i].hash, 0, __ATOMIC_RELAXED);
+  sm->count--;
+}
+
+/*
+ * Removes the entries of `handle`, dropping their references and the death
+ * notification. Called between `svcmgr_write_begin` and `svcmgr_write_end`.
+ *
+ * References are queued as raw commands rather than with
+ * `binder_handle_release`: the death handler runs on whichever context
+ * received the notification, whose handle table did not count them.
+ */
+static void svcmgr_cache_evict(binder_svcmgr_t *sm, binder_ctx *ctx,
+                               int32_t handle) {
+  struct binder_handle_cookie hc = {.handle = handle,
+                                    .cookie = SVCMGR_COOKIE(sm, handle)};
+  uint32_t h = handle;
+  size_t i = 0;
+
+  while (i < BINDER_SVCMGR_CACHE_SIZE) {
+    svcmgr_entry_t *e = &sm->entries[i];
+
+    if (!e->hash || e->handle != handle) {
+      i++;
+      continue;
+    }
+
+    if (e->watched)
+      binder_queue_cmd(ctx, BC_CLEAR_DEATH_NOTIFICATION, &hc, sizeof(hc));
+    binder_queue_cmd(ctx, BC_RELEASE, &h, sizeof(h));
+    // Entry `i` now holds the next one of its cluster, if any
+    svcmgr_cache_remove(sm, i);
+  }
+}
+
+static void svcmgr_cache_insert(binder_svcmgr_t *sm, binder_ctx *ctx,
+                                const char *name, size_t len, uint32_t hash,
+                                int32_t handle) {
+  uint32_t h = handle;
+  svcmgr_entry_t *e;
+  bool watched = false;
+  size_t i;
+
+  svcmgr_write_begin(sm);
+
+  // Another thread may have looked the name up meanwhile
+  i = svcmgr_probe(sm, name, hash);
+  if (sm->entries[i].hash)
+    goto out;
+
+  if (sm->count >= SVCMGR_CACHE_MAX) {
+    // Evict the handle of the oldest entry, scanning only when full
+    size_t oldest = BINDER_SVCMGR_CACHE_SIZE;
+
+    for (i = 0; i < BINDER_SVCMGR_CACHE_SIZE; i++) {
+      if (sm->entries[i].hash
+          && (oldest == BINDER_SVCMGR_CACHE_SIZE
+              || sm->entries[i].age < sm->entries[oldest].age))
+        oldest = i;
+    }
+    svcmgr_cache_evict(sm, ctx, sm->entries[oldest].handle);
+    i = svcmgr_probe(sm, name, hash);
+  }
+
+  for (size_t j = 0; j < BINDER_SVCMGR_CACHE_SIZE; j++) {
+    if (sm->entries[j].hash && sm->entries[j].handle == handle) {
+      watched = true;
+      break;
+    }
+  }
+
+  binder_queue_cmd(ctx, BC_ACQUIRE, &h, sizeof(h));
+  if (!watched) {
+    struct binder_handle_cookie hc = {.handle = handle,
+                                      .cookie = SVCMGR_COOKIE(sm, handle)};
+
+    binder_queue_cmd(ctx, BC_REQUEST_DEATH_NOTIFICATION, &hc, sizeof(hc));
+  }
+
+  e = &sm->entries[i];
+  memcpy(e->name, name, len + 1);
+  e->handle = handle;
+  e->watched = !watched;
+  e->age = sm->age++;
+  __atomic_store_n(&e->hash, hash, __ATOMIC_RELAXED);
+  sm->count++;
+
+out:
+  svcmgr_write_end(sm);
+}
+
+static void svcmgr_on_death(binder_ctx *ctx, binder_uintptr_t cookie,
+                            void *arg) {
+  binder_svcmgr_t *sm = arg;
+
+  if (cookie >> 32 != SVCMGR_TAG(sm)) {
+    if (sm->next_handler)
+      sm->next_handler(ctx, cookie, sm->next_arg);
+    return;
+  }
+
+  svcmgr_write_begin(sm);
+  svcmgr_cache_evict(sm, ctx, (int32_t)(uint32_t)cookie);
+  svcmgr_write_end(sm);
+}
+
+/*
+ * Puts the request header and the service name. Returns 0 on success, or -1
+ * if the parcel failed to grow.
+ */
+static int svcmgr_put_header(const binder_svcmgr_t *sm,
+                             translation_data_t *trdata, const char *name) {
+  if (trdata_put_u32(trdata, STRICT_MODE_PENALTY_GATHER) < 0)
+    return -1;
+  if (sm->flags & BINDER_SVCMGR_WORK_SOURCE
+      && trdata_put_u32(trdata, (uint32_t)WORK_SOURCE_UNSET) < 0)
+    return -1;
+  if (trdata_put_str16(trdata, BINDER_SVCMGR_INTERFACE) < 0)
+    return -1;
+  return trdata_put_str16(trdata, name);
+}
+
+binder_svcmgr_t *binder_svcmgr_create(binder_ctx *ctx, uint32_t flags) {
+  binder_svcmgr_t *sm;
+
+  sm = calloc(1, sizeof(*sm));
+  if (!sm)
+    return NULL;
+
+  sm->flags = flags;
+  pthread_mutex_init(&sm->lock, NULL);
+
+  binder_get_death_handler(ctx, &sm->next_handler, &sm->next_arg);
+  binder_set_death_handler(ctx, svcmgr_on_death, sm);
+
+  return sm;
+}
+
+void binder_svcmgr_destroy(binder_svcmgr_t *sm, binder_ctx *ctx) {
+  binder_death_handler_t handler;
+  void *arg;
+
+  if (!sm)
+    return;
+
+  binder_get_death_handler(ctx, &handler, &arg);
+  if (handler == svcmgr_on_death && arg == sm)
+    binder_set_death_handler(ctx, sm->next_handler, sm->next_arg);
+
+  svcmgr_write_begin(sm);
+  for (size_t i = 0; i < BINDER_SVCMGR_CACHE_SIZE; i++) {
+    while (sm->entries[i].hash)
+      svcmgr_cache_evict(sm, ctx, sm->entries[i].handle);
+  }
+  svcmgr_write_end(sm);
+  binder_flush(ctx);
+
+  pthread_mutex_destroy(&sm->lock);
+  free(sm);
+}
+
+int32_t binder_svcmgr_get_service(binder_svcmgr_t *sm, binder_ctx *ctx,
+                                  const char *name) {
+  translation_data_t *trdata;
+  translated_data_t reply;
+  int32_t handle;
+  uint32_t hash;
+  size_t len;
+  bool cached;
+  int ret;
+
+  hash = svcmgr_hash(name, &len);
+  cached = len < BINDER_SVCMGR_NAME_MAX;
+  if (cached) {
+    handle = svcmgr_cache_find(sm, name, hash);
+    if (handle >= 0)
+      return handle;
+  }
+
+  trdata = trdata_pool_get();
+  if (!trdata)
+    return -1;
+
+  if (svcmgr_put_header(sm, trdata, name) < 0) {
+    trdata_pool_put(trdata);
+    return -1;
+  }
+
+  ret = binder_transact(ctx, 0, BINDER_SVCMGR_CHECK_SERVICE, 0, trdata, &reply);
+  trdata_pool_put(trdata);
+  if (ret < 0) {
+    ERR("Failed to look up service: %s", name);
+    return -1;
+  }
+
+  // A missing service is replied with a null object
+  handle = reply.flags & TF_STATUS_CODE ? 0 : txnin_pop_handle(&reply);
+  // The reference must be taken before freeing the reply drops the one that
+  // came with it
+  if (handle && cached)
+    svcmgr_cache_insert(sm, ctx, name, len, hash, handle);
+  else if (handle)
+    binder_handle_acquire(ctx, handle);
+  binder_free_buffer(ctx, (binder_uintptr_t)reply.data);
+
+  if (!handle) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  return handle;
+}
+
+int binder_svcmgr_add_service(binder_svcmgr_t *sm, binder_ctx *ctx,
+                              const char *name, binder_uintptr_t ptr,
+                              binder_uintptr_t cookie, uint32_t flags) {
+  translation_data_t *trdata;
+  translated_data_t reply;
+  int32_t status;
+  int ret;
+
+  trdata = trdata_pool_get();
+  if (!trdata)
+    return -1;
+
+  if (svcmgr_put_header(sm, trdata, name) < 0
+      || trdata_put_binder_flags(trdata, ptr, cookie, true, flags) < 0
+      || trdata_put_u32(trdata, 0) < 0  // allowIsolated
+      || trdata_put_u32(trdata, DUMP_FLAG_PRIORITY_DEFAULT) < 0) {
+    trdata_pool_put(trdata);
+    return -1;
+  }
+
+  ret = binder_transact(ctx, 0, BINDER_SVCMGR_ADD_SERVICE, 0, trdata, &reply);
+  trdata_pool_put(trdata);
+  if (ret < 0) {
+    ERR("Failed to add service: %s", name);
+    return -1;
+  }
+
+  status = txnin_pop_i32(&reply);
+  if (reply.flags & TF_STATUS_CODE || status) {
+    ERR("Failed to add service: %s (%d)", name, status);
+    binder_free_buffer(ctx, (binder_uintptr_t)reply.data);
+    errno = EPERM;
+    return -1;
+  }
+  binder_free_buffer(ctx, (binder_uintptr_t)reply.data);
+
+  return 0;
+}
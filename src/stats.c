@@ -0,0 +1,56 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "stats.h"
+
+#include <stddef.h>
+
+void binder_stats_merge(binder_stats_t *dst, const binder_stats_t *src) {
+  size_t i;
+
+  dst->ioctls += src->ioctls;
+  dst->write_bytes += src->write_bytes;
+  dst->read_bytes += src->read_bytes;
+  dst->eintr += src->eintr;
+  dst->eagain += src->eagain;
+  for (i = 0; i < BINDER_STATS_CMDS; i++) {
+    dst->bc[i] += src->bc[i];
+    dst->br[i] += src->br[i];
+  }
+  dst->transactions += src->transactions;
+  for (i = 0; i < BINDER_STATS_LATENCY_BUCKETS; i++)
+    dst->latency[i] += src->latency[i];
+}
+
+uint64_t binder_stats_latency_percentile(const binder_stats_t *stats,
+                                         double p) {
+  uint64_t rank, seen = 0;
+  size_t i;
+
+  if (!stats->transactions)
+    return 0;
+
+  rank = (uint64_t)(p * (stats->transactions - 1)) + 1;
+  for (i = 0; i < BINDER_STATS_LATENCY_BUCKETS; i++) {
+    seen += stats->latency[i];
+    if (seen >= rank)
+      break;
+  }
+  if (i >= BINDER_STATS_LATENCY_BUCKETS - 1)
+    return UINT64_MAX;
+
+  return (2ULL << i) - 1;
+}
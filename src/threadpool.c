@@ -0,0 +1,239 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "threadpool.h"
+
+#include <linux/android/binder.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+struct binder_threadpool {
+  binder_ctx *ctx;
+  binder_txn_handler_t handler;
+  void *arg;
+  uint32_t max_threads;
+  uint32_t spawned;
+
+  pthread_mutex_t lock;
+  pthread_t *threads;
+  size_t num_threads;
+  size_t max_num_threads;
+
+  // The contexts of the running loopers, interrupted by
+  // `binder_threadpool_stop`
+  binder_ctx **ctxs;
+  size_t num_ctxs;
+  bool stopping;
+};
+
+static void *binder_looper_main(void *arg);
+static void *binder_looper_spawned(void *arg);
+
+static int binder_threadpool_spawn(binder_threadpool_t *pool, bool spawned) {
+  pthread_t *threads;
+  int ret = 0;
+
+  pthread_mutex_lock(&pool->lock);
+
+  if (pool->stopping || (spawned && pool->spawned >= pool->max_threads))
+    goto out;
+
+  if (pool->num_threads == pool->max_num_threads) {
+    size_t max_num_threads = pool->max_num_threads * 2 + 1;
+    binder_ctx **ctxs;
+
+    threads = realloc(pool->threads, max_num_threads * sizeof(*threads));
+    if (threads)
+      pool->threads = threads;
+    // Each thread registers at most one context
+    ctxs = realloc(pool->ctxs, max_num_threads * sizeof(*ctxs));
+    if (ctxs)
+      pool->ctxs = ctxs;
+    if (!threads || !ctxs) {
+      ret = -1;
+      goto out;
+    }
+    pool->max_num_threads = max_num_threads;
+  }
+
+  ret = pthread_create(&pool->threads[pool->num_threads], NULL,
+                       spawned ? binder_looper_spawned : binder_looper_main,
+                       pool);
+  if (ret) {
+    ERR("Failed to start looper thread: %d", ret);
+    ret = -1;
+    goto out;
+  }
+
+  pool->num_threads++;
+  if (spawned)
+    pool->spawned++;
+
+out:
+  pthread_mutex_unlock(&pool->lock);
+  return ret;
+}
+
+/*
+ * Registers the context of a looper for `binder_threadpool_stop`. Returns
+ * false if the pool is already stopping.
+ */
+static bool binder_threadpool_add_ctx(binder_threadpool_t *pool,
+                                      binder_ctx *ctx) {
+  bool stopping;
+
+  pthread_mutex_lock(&pool->lock);
+  stopping = pool->stopping;
+  if (!stopping)
+    pool->ctxs[pool->num_ctxs++] = ctx;
+  pthread_mutex_unlock(&pool->lock);
+  return !stopping;
+}
+
+static void binder_threadpool_remove_ctx(binder_threadpool_t *pool,
+                                         binder_ctx *ctx) {
+  size_t i;
+
+  pthread_mutex_lock(&pool->lock);
+  for (i = 0; i < pool->num_ctxs; i++) {
+    if (pool->ctxs[i] == ctx) {
+      pool->ctxs[i] = pool->ctxs[--pool->num_ctxs];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void binder_looper(binder_threadpool_t *pool, bool spawned) {
+  binder_ctx *ctx;
+  translation_data_t *reply;
+  translated_data_t txnin;
+  int ret, status;
+
+  ctx = binder_ctx_clone(pool->ctx);
+  reply = trdata_pool_get();
+  if (!ctx || !reply || !binder_threadpool_add_ctx(pool, ctx))
+    goto out;
+
+  if (spawned)
+    binder_register_looper(ctx);
+  else
+    binder_enter_looper(ctx);
+
+  ret = binder_recv_txn(ctx, &txnin);
+  while (ret == 0) {
+    if (ctx->spawn_looper) {
+      ctx->spawn_looper = false;
+      binder_threadpool_spawn(pool, true);
+    }
+
+    trdata_reset(reply);
+    status = pool->handler(ctx, &txnin, reply, pool->arg);
+
+    // Free the buffer, reply if needed and wait for the next transaction
+    if (status < 0)
+      ret = binder_reply_status_and_recv_txn(ctx, &txnin, status);
+    else
+      ret = binder_reply_and_recv_txn(ctx, &txnin, reply);
+  }
+
+  binder_threadpool_remove_ctx(pool, ctx);
+  binder_exit_looper(ctx);
+  binder_flush(ctx);
+  binder_thread_exit(ctx);
+
+out:
+  trdata_pool_put(reply);
+  binder_close(ctx);
+}
+
+static void *binder_looper_main(void *arg) {
+  binder_looper(arg, false);
+  return NULL;
+}
+
+static void *binder_looper_spawned(void *arg) {
+  binder_looper(arg, true);
+  return NULL;
+}
+
+binder_threadpool_t *binder_threadpool_start(binder_ctx *ctx,
+                                             uint32_t max_threads,
+                                             binder_txn_handler_t handler,
+                                             void *arg) {
+  binder_threadpool_t *pool;
+
+  if (!ctx || !handler)
+    return NULL;
+
+  if (binder_set_max_threads(ctx, max_threads) < 0)
+    return NULL;
+
+  pool = calloc(1, sizeof(*pool));
+  if (!pool)
+    return NULL;
+
+  pool->ctx = ctx;
+  pool->handler = handler;
+  pool->arg = arg;
+  pool->max_threads = max_threads;
+  pthread_mutex_init(&pool->lock, NULL);
+
+  if (binder_threadpool_spawn(pool, false) < 0) {
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+void binder_threadpool_stop(binder_threadpool_t *pool) {
+  size_t i;
+
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  for (i = 0; i < pool->num_ctxs; i++)
+    binder_interrupt(pool->ctxs[i]);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void binder_threadpool_join(binder_threadpool_t *pool) {
+  pthread_t thread;
+
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->num_threads) {
+    thread = pool->threads[--pool->num_threads];
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(thread, NULL);
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool->ctxs);
+  free(pool);
+}
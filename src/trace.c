@@ -0,0 +1,268 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "trace.h"
+
+#include <errno.h>
+#include <linux/android/binder.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+typedef struct trace_ring {
+  struct trace_ring *next;
+  binder_trace_event_t *events;
+  size_t mask;
+  uint64_t head;  // Only advanced by the owning thread
+  uint64_t dump_head;
+  bool in_use;
+} trace_ring_t;
+
+bool binder_trace_enabled;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static trace_ring_t *rings;
+static size_t trace_capacity;
+static uint64_t trace_ticks0;
+static uint64_t trace_ns0;
+
+static __thread trace_ring_t *trace_ring;
+static __thread uint32_t trace_tid;
+
+static uint64_t trace_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// A cheap monotonic counter, converted to time by the decoder
+static uint64_t trace_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#else
+  return trace_now_ns();
+#endif
+}
+
+static void trace_ring_release(void *arg) {
+  trace_ring_t *ring = arg;
+
+  pthread_mutex_lock(&trace_lock);
+  ring->in_use = false;
+  pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_key_create(void) {
+  pthread_key_create(&trace_key, trace_ring_release);
+}
+
+static trace_ring_t *trace_ring_get(void) {
+  trace_ring_t *ring;
+
+  if (trace_ring)
+    return trace_ring;
+
+  pthread_once(&trace_once, trace_key_create);
+
+  pthread_mutex_lock(&trace_lock);
+  for (ring = rings; ring; ring = ring->next) {
+    if (!ring->in_use)
+      break;
+  }
+  if (!ring) {
+    ring = calloc(1, sizeof(*ring));
+    if (ring)
+      ring->events = calloc(trace_capacity, sizeof(*ring->events));
+    if (!ring || !ring->events) {
+      pthread_mutex_unlock(&trace_lock);
+      free(ring);
+      return NULL;
+    }
+    ring->mask = trace_capacity - 1;
+    ring->next = rings;
+    rings = ring;
+  }
+  ring->in_use = true;
+  pthread_mutex_unlock(&trace_lock);
+
+  pthread_setspecific(trace_key, ring);
+  trace_ring = ring;
+  trace_tid = syscall(SYS_gettid);
+  return ring;
+}
+
+int binder_trace_enable(size_t events) {
+  size_t capacity = 1;
+
+  if (!events) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  while (capacity < events)
+    capacity <<= 1;
+
+  pthread_mutex_lock(&trace_lock);
+  // Existing rings keep their size, so the first capacity sticks
+  if (!trace_capacity) {
+    trace_capacity = capacity;
+    trace_ticks0 = trace_ticks();
+    trace_ns0 = trace_now_ns();
+  }
+  pthread_mutex_unlock(&trace_lock);
+
+  __atomic_store_n(&binder_trace_enabled, true, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void binder_trace_disable(void) {
+  __atomic_store_n(&binder_trace_enabled, false, __ATOMIC_RELEASE);
+}
+
+static bool is_transaction(uint32_t cmd) {
+  switch (cmd) {
+    case BC_TRANSACTION:
+    case BC_REPLY:
+    case BC_TRANSACTION_SG:
+    case BC_REPLY_SG:
+    case BR_TRANSACTION:
+    case BR_REPLY:
+      return true;
+    default:
+      return false;
+  }
+}
+
+void binder_trace_cmds(const void *buffer, size_t size) {
+  const uint8_t *ptr = buffer, *end = ptr + size;
+  struct binder_transaction_data tr;
+  binder_trace_event_t *ev;
+  trace_ring_t *ring;
+  uint64_t ticks;
+  uint32_t cmd;
+  size_t arg_size;
+
+  ring = trace_ring_get();
+  if (!ring)
+    return;
+
+  // The commands of one ioctl share a timestamp
+  ticks = trace_ticks();
+
+  while ((size_t)(end - ptr) >= sizeof(cmd)) {
+    memcpy(&cmd, ptr, sizeof(cmd));
+    arg_size = _IOC_SIZE(cmd);
+    if ((size_t)(end - ptr) - sizeof(cmd) < arg_size)
+      break;
+
+    ev = &ring->events[ring->head & ring->mask];
+    ev->ticks = ticks;
+    ev->tid = trace_tid;
+    ev->cmd = cmd;
+    if (is_transaction(cmd)) {
+      memcpy(&tr, ptr + sizeof(cmd), sizeof(tr));
+      ev->target = _IOC_TYPE(cmd) == 'c' ? tr.target.handle : tr.target.ptr;
+      ev->code = tr.code;
+      ev->flags = tr.flags;
+      ev->data_size = tr.data_size;
+      ev->offsets_size = tr.offsets_size;
+    } else {
+      ev->target = 0;
+      memcpy(&ev->target, ptr + sizeof(cmd),
+             arg_size < sizeof(ev->target) ? arg_size : sizeof(ev->target));
+      ev->code = 0;
+      ev->flags = 0;
+      ev->data_size = 0;
+      ev->offsets_size = 0;
+    }
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+
+    ptr += sizeof(cmd) + arg_size;
+  }
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+  const uint8_t *ptr = data;
+  ssize_t ret;
+
+  while (size) {
+    ret = write(fd, ptr, size);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    ptr += ret;
+    size -= ret;
+  }
+  return 0;
+}
+
+int binder_trace_dump(int fd) {
+  binder_trace_header_t header = {
+      .magic = BINDER_TRACE_MAGIC,
+      .version = BINDER_TRACE_VERSION,
+      .event_size = sizeof(binder_trace_event_t),
+  };
+  uint64_t count, start;
+  trace_ring_t *ring;
+  size_t n, first;
+  int ret;
+
+  pthread_mutex_lock(&trace_lock);
+
+  header.ticks0 = trace_ticks0;
+  header.ns0 = trace_ns0;
+  header.ticks1 = trace_ticks();
+  header.ns1 = trace_now_ns();
+
+  // Snapshot the heads so that the count matches the events written
+  for (ring = rings; ring; ring = ring->next) {
+    ring->dump_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    header.count += ring->dump_head < ring->mask + 1 ? ring->dump_head
+                                                     : ring->mask + 1;
+  }
+
+  ret = write_all(fd, &header, sizeof(header));
+  for (ring = rings; ring && !ret; ring = ring->next) {
+    count = ring->dump_head < ring->mask + 1 ? ring->dump_head : ring->mask + 1;
+    start = ring->dump_head - count;
+    first = start & ring->mask;
+
+    // Oldest events first, in up to two chunks around the end of the ring
+    n = ring->mask + 1 - first < count ? ring->mask + 1 - first : count;
+    ret = write_all(fd, &ring->events[first], n * sizeof(*ring->events));
+    if (!ret && count > n)
+      ret = write_all(fd, ring->events, (count - n) * sizeof(*ring->events));
+  }
+
+  pthread_mutex_unlock(&trace_lock);
+  return ret;
+}
@@ -14,25 +14,139 @@
  * limitations under the License.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // memfd_create and file seals
+#endif
+
 #include "transaction.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "unicode.h"
+#include "util.h"
 
 #define PAD_SIZE_UNSAFE(s) (((s) + 3) & ~3UL)
+#define ALIGN8(s) (((s) + 7) & ~7UL)
+
+#define TRDATA_POOL_SIZE 8
+#define TRDATA_POOL_MAX_CAPACITY 0x100000
+
+typedef struct {
+  translation_data_t *entries[TRDATA_POOL_SIZE];
+  size_t count;
+} trdata_pool_t;
+
+static pthread_key_t trdata_pool_key;
+static pthread_once_t trdata_pool_once = PTHREAD_ONCE_INIT;
+static __thread trdata_pool_t *trdata_pool;
 
 void trdata_init(translation_data_t *trdata) {
+  trdata->data = trdata->data_inline;
   trdata->data_ptr = trdata->data;
-  trdata->data_avail = sizeof(trdata->data);
+  trdata->data_avail = sizeof(trdata->data_inline);
+  trdata->offs = trdata->offs_inline;
   trdata->offs_ptr = trdata->offs;
-  trdata->offs_avail = sizeof(trdata->offs) / sizeof(binder_size_t);
+  trdata->offs_avail = sizeof(trdata->offs_inline) / sizeof(binder_size_t);
   trdata->buffers_size = 0;
+  trdata->owned_fds_count = 0;
+}
+
+static void trdata_close_fds(translation_data_t *trdata) {
+  while (trdata->owned_fds_count)
+    close(trdata->owned_fds[--trdata->owned_fds_count]);
+}
+
+void trdata_reset(translation_data_t *trdata) {
+  trdata->data_avail += trdata->data_ptr - trdata->data;
+  trdata->data_ptr = trdata->data;
+  trdata->offs_avail += trdata->offs_ptr - trdata->offs;
+  trdata->offs_ptr = trdata->offs;
+  trdata->buffers_size = 0;
+  if (trdata->owned_fds_count)
+    trdata_close_fds(trdata);
+}
+
+void trdata_release(translation_data_t *trdata) {
+  trdata_close_fds(trdata);
+  if (trdata->data != trdata->data_inline)
+    free(trdata->data);
+  if (trdata->offs != trdata->offs_inline)
+    free(trdata->offs);
+  trdata_init(trdata);
+}
+
+/*
+ * Moves `used` bytes of `buf` to new storage of `capacity` bytes. Inline
+ * storage is never freed.
+ */
+static void *trdata_grow(void *buf, const void *inline_buf, size_t used,
+                         size_t capacity) {
+  void *new_buf;
+
+  if (buf != inline_buf)
+    return realloc(buf, capacity);
+
+  new_buf = malloc(capacity);
+  if (new_buf)
+    memcpy(new_buf, buf, used);
+
+  return new_buf;
+}
+
+static int trdata_grow_data(translation_data_t *trdata, size_t size) {
+  size_t used = trdata->data_ptr - trdata->data;
+  size_t capacity = used + trdata->data_avail;
+  uint8_t *data;
+
+  while (capacity - used < size)
+    capacity *= 2;
+
+  data = trdata_grow(trdata->data, trdata->data_inline, used, capacity);
+  if (!data) {
+    ERR("Failed to grow transaction data to %zu bytes", capacity);
+    return -1;
+  }
+
+  trdata->data = data;
+  trdata->data_ptr = data + used;
+  trdata->data_avail = capacity - used;
+  return 0;
+}
+
+static int trdata_grow_offs(translation_data_t *trdata) {
+  size_t used = trdata->offs_ptr - trdata->offs;
+  size_t count = (used + trdata->offs_avail) * 2;
+  binder_size_t *offs;
+
+  offs = trdata_grow(trdata->offs, trdata->offs_inline,
+                     used * sizeof(binder_size_t),
+                     count * sizeof(binder_size_t));
+  if (!offs) {
+    ERR("Failed to grow transaction offsets to %zu entries", count);
+    return -1;
+  }
+
+  trdata->offs = offs;
+  trdata->offs_ptr = offs + used;
+  trdata->offs_avail = count - used;
+  return 0;
 }
 
 void *trdata_alloc(translation_data_t *trdata, size_t size, bool obj) {
   void *ptr;
 
   size = PAD_SIZE_UNSAFE(size);
-  if (size > trdata->data_avail)
+  if (size > trdata->data_avail && trdata_grow_data(trdata, size) < 0)
+    return NULL;
+  if (obj && !trdata->offs_avail && trdata_grow_offs(trdata) < 0)
     return NULL;
 
   ptr = trdata->data_ptr;
@@ -47,6 +161,70 @@ void *trdata_alloc(translation_data_t *trdata, size_t size, bool obj) {
   return ptr;
 }
 
+static void trdata_pool_destroy(void *arg) {
+  trdata_pool_t *pool = arg;
+
+  while (pool->count) {
+    translation_data_t *trdata = pool->entries[--pool->count];
+    trdata_release(trdata);
+    free(trdata);
+  }
+  free(pool);
+}
+
+static void trdata_pool_key_create(void) {
+  pthread_key_create(&trdata_pool_key, trdata_pool_destroy);
+}
+
+static trdata_pool_t *trdata_pool_current(void) {
+  if (trdata_pool)
+    return trdata_pool;
+
+  pthread_once(&trdata_pool_once, trdata_pool_key_create);
+
+  trdata_pool = calloc(1, sizeof(*trdata_pool));
+  if (trdata_pool)
+    pthread_setspecific(trdata_pool_key, trdata_pool);
+
+  return trdata_pool;
+}
+
+translation_data_t *trdata_pool_get(void) {
+  trdata_pool_t *pool = trdata_pool_current();
+  translation_data_t *trdata;
+
+  if (pool && pool->count) {
+    trdata = pool->entries[--pool->count];
+    trdata_reset(trdata);
+    return trdata;
+  }
+
+  trdata = malloc(sizeof(*trdata));
+  if (trdata)
+    trdata_init(trdata);
+
+  return trdata;
+}
+
+void trdata_pool_put(translation_data_t *trdata) {
+  trdata_pool_t *pool = trdata_pool_current();
+  size_t capacity;
+
+  if (!trdata)
+    return;
+
+  trdata_close_fds(trdata);
+  capacity = (trdata->data_ptr - trdata->data) + trdata->data_avail;
+  if (pool && pool->count < TRDATA_POOL_SIZE
+      && capacity <= TRDATA_POOL_MAX_CAPACITY) {
+    pool->entries[pool->count++] = trdata;
+    return;
+  }
+
+  trdata_release(trdata);
+  free(trdata);
+}
+
 struct flat_binder_object *trdata_alloc_fbo(translation_data_t *trdata) {
   return trdata_alloc(trdata, sizeof(struct flat_binder_object), true);
 }
@@ -59,66 +237,82 @@ struct binder_buffer_object *trdata_alloc_bbo(translation_data_t *trdata,
   if (!bbo)
     return NULL;
 
-  trdata->buffers_size += length;
+  // The driver lays each buffer out at an 8-byte boundary
+  trdata->buffers_size += ALIGN8(length);
 
   return bbo;
 }
 
-void trdata_put_u32(translation_data_t *trdata, uint32_t n) {
+int trdata_put_u32(translation_data_t *trdata, uint32_t n) {
   uint32_t *ptr = trdata_alloc(trdata, sizeof(n), false);
-  if (ptr)
-    *ptr = n;
+  if (!ptr)
+    return -1;
+
+  *ptr = n;
+  return 0;
 }
 
-void trdata_put_bytes(translation_data_t *trdata, const char *data,
-                      size_t len) {
+int trdata_put_bytes(translation_data_t *trdata, const char *data, size_t len) {
   uint8_t *ptr;
 
   ptr = trdata_alloc(trdata, len, false);
   if (!ptr)
-    return;
+    return -1;
 
   memcpy(ptr, data, len);
+  return 0;
 }
 
-void trdata_put_str(translation_data_t *trdata, const char *str) {
+int trdata_put_str(translation_data_t *trdata, const char *str) {
   size_t i, len;
   uint8_t *ptr;
 
   len = strlen(str);
   ptr = trdata_alloc(trdata, len + 1, false);
   if (!ptr)
-    return;
+    return -1;
 
   for (i = 0; i < len; i++) {
     ptr[i] = str[i];
   }
   ptr[len] = '\0';
+  return 0;
 }
 
-void trdata_put_str16(translation_data_t *trdata, const char *str) {
-  size_t i, len;
+int trdata_put_str16(translation_data_t *trdata, const char *str) {
+  size_t len = strlen(str), reserved, used;
+  uint32_t *len_ptr;
+  uint16_t *ptr;
 
-  len = strlen(str);
-  trdata_put_u32(trdata, len);
-  uint16_t *ptr = trdata_alloc(trdata, (len + 1) * 2, false);
-  if (!ptr)
-    return;
+  // A UTF-16 string never has more units than its UTF-8 form has bytes, so
+  // reserve for that and give back what the conversion did not use.
+  reserved = PAD_SIZE_UNSAFE((len + 1) * sizeof(uint16_t));
+  len_ptr = trdata_alloc(trdata, sizeof(*len_ptr) + reserved, false);
+  if (!len_ptr)
+    return -1;
 
-  for (i = 0; i < len; i++) {
-    ptr[i] = str[i];
-  }
-  ptr[len] = '\0';
+  ptr = (uint16_t *)(len_ptr + 1);
+  len = utf8_to_utf16(str, len, ptr);
+  *len_ptr = len;
+  // The terminator, and the padding after it if any
+  ptr[len] = 0;
+  if (len % 2 == 0)
+    ptr[len + 1] = 0;
+
+  used = PAD_SIZE_UNSAFE((len + 1) * sizeof(uint16_t));
+  trdata->data_ptr -= reserved - used;
+  trdata->data_avail += reserved - used;
+  return 0;
 }
 
-void trdata_put_buffer(translation_data_t *trdata, binder_uintptr_t buffer,
-                       binder_size_t length, binder_size_t parent,
-                       binder_size_t parent_offset, bool has_parent) {
+int trdata_put_buffer(translation_data_t *trdata, binder_uintptr_t buffer,
+                      binder_size_t length, binder_size_t parent,
+                      binder_size_t parent_offset, bool has_parent) {
   struct binder_buffer_object *bbo;
 
   bbo = trdata_alloc_bbo(trdata, length);
   if (!bbo)
-    return;
+    return -1;
 
   bbo->hdr.type = BINDER_TYPE_PTR;
   bbo->flags = has_parent ? BINDER_BUFFER_FLAG_HAS_PARENT : 0;
@@ -126,41 +320,377 @@ void trdata_put_buffer(translation_data_t *trdata, binder_uintptr_t buffer,
   bbo->length = length;
   bbo->parent = parent;
   bbo->parent_offset = parent_offset;
+  return 0;
+}
+
+#define TRDATA_REGIONS_INLINE 16
+
+/*
+ * Sorts region indices by parent, then by offset into the parent, so that the
+ * children of each region are contiguous and in the order the driver expects
+ * their fixups. Roots come first. Region counts are small, and unlike
+ * `qsort`, insertion sort needs no context argument.
+ */
+static void trdata_sort_regions(const trdata_region_t *regions, size_t *order,
+                                size_t count) {
+  size_t i, j, idx;
+
+  for (i = 0; i < count; i++) {
+    idx = i;
+    for (j = i; j > 0; j--) {
+      const trdata_region_t *prev = &regions[order[j - 1]];
+      if (prev->parent < regions[idx].parent
+          || (prev->parent == regions[idx].parent
+              && prev->parent_offset <= regions[idx].parent_offset))
+        break;
+      order[j] = order[j - 1];
+    }
+    order[j] = idx;
+  }
+}
+
+/*
+ * Emits the buffer object of region `idx`, then those of its children, depth
+ * first. The driver only accepts a fixup into the last buffer object or one
+ * of its ancestors, at an offset past the previous fixup into the same
+ * buffer, which this order guarantees.
+ *
+ * `objs` receives the index of each region's object in the offsets array.
+ */
+static int trdata_put_region(translation_data_t *trdata,
+                             const trdata_region_t *regions,
+                             const size_t *order, size_t count,
+                             binder_size_t *objs, size_t idx) {
+  const trdata_region_t *region = &regions[idx];
+  const trdata_region_t *child;
+  struct binder_buffer_object *bbo;
+  size_t lo = 0, hi = count, mid, min_offset = 0;
+
+  objs[idx] = trdata->offs_ptr - trdata->offs;
+  bbo = trdata_alloc_bbo(trdata, region->len);
+  if (!bbo)
+    return -1;
+
+  bbo->hdr.type = BINDER_TYPE_PTR;
+  bbo->flags = region->parent < 0 ? 0 : BINDER_BUFFER_FLAG_HAS_PARENT;
+  bbo->buffer = (binder_uintptr_t)region->base;
+  bbo->length = region->len;
+  bbo->parent = region->parent < 0 ? 0 : objs[region->parent];
+  bbo->parent_offset = region->parent < 0 ? 0 : region->parent_offset;
+
+  // Find the first child of this region
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (regions[order[mid]].parent < (ssize_t)idx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (; lo < count && regions[order[lo]].parent == (ssize_t)idx; lo++) {
+    child = &regions[order[lo]];
+    if (child->parent_offset < min_offset
+        || child->parent_offset > region->len
+        || region->len - child->parent_offset < sizeof(binder_uintptr_t)) {
+      ERR("Invalid offset %zu of region %zu into region %zu",
+          child->parent_offset, order[lo], idx);
+      return -1;
+    }
+    min_offset = child->parent_offset + sizeof(binder_uintptr_t);
+
+    if (trdata_put_region(trdata, regions, order, count, objs, order[lo]) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Appends a `BINDER_TYPE_PTR` object for each of `regions`, with parent links
+ * and `buffers_size` filled in, so that the driver gathers the regions
+ * straight from the caller's memory. Regions may be given in any order; each
+ * must be reachable from a root. The transaction has to be sent as
+ * `BC_TRANSACTION_SG` or `BC_REPLY_SG`.
+ *
+ * On failure, `trdata` is left as it was.
+ */
+int trdata_put_regions(translation_data_t *trdata,
+                       const trdata_region_t *regions, size_t count) {
+  size_t order_inline[TRDATA_REGIONS_INLINE];
+  binder_size_t objs_inline[TRDATA_REGIONS_INLINE];
+  size_t *order = order_inline;
+  binder_size_t *objs = objs_inline;
+  size_t data_used = trdata->data_ptr - trdata->data;
+  size_t offs_used = trdata->offs_ptr - trdata->offs;
+  size_t buffers_size = trdata->buffers_size;
+  size_t i;
+  int ret = 0;
+
+  for (i = 0; i < count; i++) {
+    if (regions[i].parent >= (ssize_t)count || regions[i].parent == (ssize_t)i
+        || regions[i].parent < -1) {
+      ERR("Invalid parent %zd of region %zu", regions[i].parent, i);
+      return -1;
+    }
+  }
+
+  if (count > TRDATA_REGIONS_INLINE) {
+    order = malloc(count * sizeof(*order));
+    objs = malloc(count * sizeof(*objs));
+    if (!order || !objs) {
+      ERR("Failed to allocate %zu regions", count);
+      ret = -1;
+      goto out;
+    }
+  }
+
+  trdata_sort_regions(regions, order, count);
+
+  for (i = 0; i < count && regions[order[i]].parent < 0; i++) {
+    ret = trdata_put_region(trdata, regions, order, count, objs, order[i]);
+    if (ret < 0)
+      break;
+  }
+
+  if (!ret && (size_t)(trdata->offs_ptr - trdata->offs) - offs_used != count) {
+    ERR("Regions are not all reachable from a root");
+    ret = -1;
+  }
+
+  if (ret < 0) {
+    trdata->data_avail += (trdata->data_ptr - trdata->data) - data_used;
+    trdata->data_ptr = trdata->data + data_used;
+    trdata->offs_avail += (trdata->offs_ptr - trdata->offs) - offs_used;
+    trdata->offs_ptr = trdata->offs + offs_used;
+    trdata->buffers_size = buffers_size;
+  }
+
+out:
+  if (order != order_inline)
+    free(order);
+  if (objs != objs_inline)
+    free(objs);
+  return ret;
+}
+
+int trdata_put_binder(translation_data_t *trdata, binder_uintptr_t ptr,
+                      bool strong) {
+  return trdata_put_binder_flags(trdata, ptr, 0, strong, 0);
 }
 
-void trdata_put_binder(translation_data_t *trdata, binder_uintptr_t ptr,
-                       bool strong) {
+/*
+ * Puts a local binder with a cookie and `FLAT_BINDER_FLAG_*` flags, which the
+ * driver records on the node when it is first sent:
+ * `FLAT_BINDER_FLAG_ACCEPTS_FDS` lets transactions to the node carry file
+ * descriptors, e.g. memfd blobs.
+ */
+int trdata_put_binder_flags(translation_data_t *trdata, binder_uintptr_t ptr,
+                            binder_uintptr_t cookie, bool strong,
+                            uint32_t flags) {
   struct flat_binder_object *fbo;
 
   fbo = trdata_alloc_fbo(trdata);
   if (!fbo)
-    return;
+    return -1;
 
   fbo->hdr.type = strong ? BINDER_TYPE_BINDER : BINDER_TYPE_WEAK_BINDER;
-  fbo->flags = 0;
+  fbo->flags = flags;
   fbo->binder = ptr;
-  fbo->cookie = 0;
+  fbo->cookie = cookie;
+  return 0;
 }
 
-void trdata_put_handle(translation_data_t *trdata, uint32_t handle,
-                       bool strong) {
+int trdata_put_handle(translation_data_t *trdata, uint32_t handle,
+                      bool strong) {
   struct flat_binder_object *fbo;
 
   fbo = trdata_alloc_fbo(trdata);
   if (!fbo)
-    return;
+    return -1;
 
   fbo->hdr.type = strong ? BINDER_TYPE_HANDLE : BINDER_TYPE_WEAK_HANDLE;
   fbo->flags = 0;
   fbo->handle = handle;
   fbo->cookie = 0;
+  return 0;
+}
+
+/*
+ * Puts a file descriptor, which the driver installs in the receiver as a new
+ * descriptor owned by it. The sender keeps `fd`. The target node must have
+ * been published with `FLAT_BINDER_FLAG_ACCEPTS_FDS`, and a reply needs
+ * `TF_ACCEPT_FDS` on the transaction. Returns 0 on success, or -1 on failure.
+ */
+int trdata_put_fd(translation_data_t *trdata, int fd, binder_uintptr_t cookie) {
+  struct binder_fd_object *fdo;
+
+  fdo = trdata_alloc(trdata, sizeof(*fdo), true);
+  if (!fdo)
+    return -1;
+
+  fdo->hdr.type = BINDER_TYPE_FD;
+  fdo->pad_flags = 0;
+  fdo->pad_binder = 0;
+  fdo->fd = fd;
+  fdo->cookie = cookie;
+  return 0;
+}
+
+/*
+ * Drops what was put after the first `data_used` bytes and `offs_used`
+ * objects, undoing a put that failed halfway.
+ */
+static void trdata_truncate(translation_data_t *trdata, size_t data_used,
+                            size_t offs_used) {
+  trdata->data_avail += (trdata->data_ptr - trdata->data) - data_used;
+  trdata->data_ptr = trdata->data + data_used;
+  trdata->offs_avail += (trdata->offs_ptr - trdata->offs) - offs_used;
+  trdata->offs_ptr = trdata->offs + offs_used;
+}
+
+/*
+ * Puts an array of file descriptors, sent by reference as a buffer followed by
+ * the `BINDER_TYPE_FDA` object fixing it up, so `fds` must stay valid until
+ * the transaction is sent. The driver closes the receiver's descriptors once
+ * its buffer is freed. Returns 0 on success, or -1 on failure.
+ */
+int trdata_put_fd_array(translation_data_t *trdata, const int *fds,
+                        size_t count) {
+  struct binder_fd_array_object *fda;
+  size_t data_used = trdata->data_ptr - trdata->data;
+  binder_size_t parent = trdata->offs_ptr - trdata->offs;
+  size_t buffers_size = trdata->buffers_size;
+
+  if (trdata_put_buffer(trdata, (binder_uintptr_t)fds, count * sizeof(*fds), 0,
+                        0, false) < 0)
+    return -1;
+
+  fda = trdata_alloc(trdata, sizeof(*fda), true);
+  if (!fda) {
+    trdata_truncate(trdata, data_used, parent);
+    trdata->buffers_size = buffers_size;
+    return -1;
+  }
+
+  fda->hdr.type = BINDER_TYPE_FDA;
+  fda->pad = 0;
+  fda->num_fds = count;
+  fda->parent = parent;
+  fda->parent_offset = 0;
+  return 0;
+}
+
+static size_t trdata_blob_threshold = TRDATA_BLOB_THRESHOLD;
+
+/*
+ * Sets the size above which `trdata_put_blob` moves blobs to a memfd, for all
+ * threads.
+ */
+void trdata_set_blob_threshold(size_t threshold) {
+  __atomic_store_n(&trdata_blob_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns a memfd holding a copy of `data`, sealed so that the receiver can
+ * map it without the sender changing or truncating it underneath. Returns -1
+ * on failure.
+ */
+static int trdata_blob_create(const void *data, size_t size) {
+  const uint8_t *ptr = data;
+  ssize_t n;
+  int fd;
+
+  fd = memfd_create("devbinder-blob", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    ERR("Failed to create blob memfd");
+    return -1;
+  }
+
+  while (size) {
+    n = write(fd, ptr, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      ERR("Failed to write blob memfd");
+      goto err;
+    }
+    ptr += n;
+    size -= n;
+  }
+
+  if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)
+      < 0) {
+    ERR("Failed to seal blob memfd");
+    goto err;
+  }
+
+  return fd;
+
+err:
+  close(fd);
+  return -1;
+}
+
+/*
+ * Puts a blob of `size` bytes: inline in the transaction data up to the blob
+ * threshold, or else in a sealed memfd that the receiver maps, so that large
+ * blobs neither fill the receiver's binder mapping nor get copied by the
+ * driver. The memfd is owned by `trdata`. Returns 0 on success, or -1 on
+ * failure.
+ */
+int trdata_put_blob(translation_data_t *trdata, const void *data, size_t size) {
+  uint64_t size64 = size;
+  size_t data_used, offs_used;
+  uint32_t *tag;
+  int fd;
+
+  if (size <= __atomic_load_n(&trdata_blob_threshold, __ATOMIC_RELAXED)) {
+    tag = trdata_alloc(trdata, sizeof(*tag) + sizeof(size64) + size, false);
+    if (!tag)
+      return -1;
+    *tag = TRDATA_BLOB_INLINE;
+    memcpy(tag + 1, &size64, sizeof(size64));
+    memcpy((uint8_t *)(tag + 1) + sizeof(size64), data, size);
+    return 0;
+  }
+
+  if (trdata->owned_fds_count == TRDATA_OWNED_FDS_MAX) {
+    ERR("Too many blobs in transaction");
+    return -1;
+  }
+
+  fd = trdata_blob_create(data, size);
+  if (fd < 0)
+    return -1;
+
+  // The memfd is only owned once the tag and its object are both in place
+  data_used = trdata->data_ptr - trdata->data;
+  offs_used = trdata->offs_ptr - trdata->offs;
+  if (!trdata_alloc(trdata, sizeof(*tag) + sizeof(size64), false)
+      || trdata_put_fd(trdata, fd, 0) < 0) {
+    trdata_truncate(trdata, data_used, offs_used);
+    close(fd);
+    return -1;
+  }
+  // Found again, as putting the object may have moved the data
+  tag = (uint32_t *)(trdata->data + data_used);
+  *tag = TRDATA_BLOB_MEMFD;
+  memcpy(tag + 1, &size64, sizeof(size64));
+
+  trdata->owned_fds[trdata->owned_fds_count++] = fd;
+  return 0;
 }
 
 void txnin_init(translated_data_t *txnin, struct binder_transaction_data *tr) {
   txnin->data = (uint8_t *)tr->data.ptr.buffer;
   txnin->data_ptr = txnin->data;
   txnin->data_avail = tr->data_size;
+  txnin->offs = (const binder_size_t *)tr->data.ptr.offsets;
+  txnin->offs_count = tr->offsets_size / sizeof(binder_size_t);
+  txnin->offs_next = 0;
   txnin->code = tr->code;
+  txnin->flags = tr->flags;
   txnin->target = tr->target.ptr;
   txnin->cookie = tr->cookie;
 }
@@ -180,17 +710,189 @@ void *txnin_pop(translated_data_t *txnin, size_t size) {
 }
 
 uint32_t txnin_pop_u32(translated_data_t *txnin) {
-  return *(uint32_t *)txnin_pop(txnin, sizeof(uint32_t));
+  uint32_t *ptr = txnin_pop(txnin, sizeof(uint32_t));
+
+  return ptr ? *ptr : 0;
 }
 
 int32_t txnin_pop_i32(translated_data_t *txnin) {
-  return *(int32_t *)txnin_pop(txnin, sizeof(int32_t));
+  int32_t *ptr = txnin_pop(txnin, sizeof(int32_t));
+
+  return ptr ? *ptr : 0;
+}
+
+/*
+ * Pops a String16, as a view of its `*len` UTF-16 units followed by a
+ * terminator. Returns NULL for a null string, whose length is consumed, or
+ * with errno set to EBADMSG and without moving if the string overruns the
+ * data.
+ */
+const uint16_t *txnin_pop_str16(translated_data_t *txnin, size_t *len) {
+  uint8_t *data_ptr = txnin->data_ptr;
+  size_t data_avail = txnin->data_avail;
+  uint32_t *len_ptr;
+  uint16_t *str;
+
+  len_ptr = txnin_pop(txnin, sizeof(*len_ptr));
+  if (!len_ptr)
+    goto fail;
+  if (*len_ptr == UINT32_MAX)
+    return NULL;
+
+  // The length is checked first, so that the size cannot overflow
+  if (*len_ptr >= txnin->data_avail / sizeof(uint16_t))
+    goto fail;
+
+  // Padding may still overrun the data, which fails the pop
+  str = txnin_pop(txnin, (*len_ptr + 1) * sizeof(uint16_t));
+  if (!str || str[*len_ptr])
+    goto fail;
+
+  *len = *len_ptr;
+  return str;
+
+fail:
+  txnin->data_ptr = data_ptr;
+  txnin->data_avail = data_avail;
+  errno = EBADMSG;
+  return NULL;
+}
+
+/*
+ * Pops a String16 narrowed to UTF-8 into `buf` of `size` bytes, terminator
+ * included. Returns `buf`, or NULL as `txnin_pop_str16` does, or with errno
+ * set to ENOBUFS and without moving if the string does not fit.
+ */
+char *txnin_pop_str16_utf8(translated_data_t *txnin, char *buf, size_t size) {
+  uint8_t *data_ptr = txnin->data_ptr;
+  size_t data_avail = txnin->data_avail;
+  const uint16_t *str;
+  size_t len;
+
+  str = txnin_pop_str16(txnin, &len);
+  if (!str)
+    return NULL;
+
+  // A unit takes at most three bytes, which spares measuring most strings
+  if (len * 3 >= size && utf16_to_utf8_length(str, len) >= size) {
+    txnin->data_ptr = data_ptr;
+    txnin->data_avail = data_avail;
+    errno = ENOBUFS;
+    return NULL;
+  }
+
+  buf[utf16_to_utf8(str, len, buf)] = '\0';
+  return buf;
+}
+
+/*
+ * Returns the size of an object of the given type, or 0 for an unknown type.
+ */
+static size_t binder_object_size(uint32_t type) {
+  switch (type) {
+    case BINDER_TYPE_BINDER:
+    case BINDER_TYPE_WEAK_BINDER:
+    case BINDER_TYPE_HANDLE:
+    case BINDER_TYPE_WEAK_HANDLE:
+      return sizeof(struct flat_binder_object);
+    case BINDER_TYPE_FD:
+      return sizeof(struct binder_fd_object);
+    case BINDER_TYPE_FDA:
+      return sizeof(struct binder_fd_array_object);
+    case BINDER_TYPE_PTR:
+      return sizeof(struct binder_buffer_object);
+    default:
+      return 0;
+  }
+}
+
+size_t txnin_object_count(const translated_data_t *txnin) {
+  return txnin->offs_count;
+}
+
+/*
+ * Returns a view of the object at `index` in the offsets array, or NULL if
+ * there is none or it does not fit within the transaction data.
+ */
+const struct binder_object_header *txnin_object_at(
+    const translated_data_t *txnin, size_t index) {
+  size_t size = (txnin->data_ptr - txnin->data) + txnin->data_avail;
+  const struct binder_object_header *hdr;
+  binder_size_t off;
+
+  if (index >= txnin->offs_count)
+    return NULL;
+
+  // Checks are combined without short-circuiting: `size - off` may wrap, in
+  // which case `off > size` already rejects the object.
+  off = txnin->offs[index];
+  if ((off % sizeof(uint32_t)) | (off > size)
+      | (size - off < sizeof(struct binder_object_header)))
+    return NULL;
+
+  hdr = (const struct binder_object_header *)(txnin->data + off);
+  if ((size - off < binder_object_size(hdr->type))
+      | !binder_object_size(hdr->type))
+    return NULL;
+
+  return hdr;
+}
+
+/*
+ * Returns the first valid object of `type` (or of any type if 0) at or after
+ * `*index` in the offsets array, and moves `*index` past it. Returns NULL once
+ * the offsets are exhausted.
+ */
+const struct binder_object_header *txnin_next_object(
+    const translated_data_t *txnin, uint32_t type, size_t *index) {
+  const struct binder_object_header *hdr;
+
+  while (*index < txnin->offs_count) {
+    hdr = txnin_object_at(txnin, (*index)++);
+    if (hdr && (!type || hdr->type == type))
+      return hdr;
+  }
+
+  return NULL;
+}
+
+/*
+ * Pops the object lying at the read position, provided that it is of `type`
+ * (or of any type if 0). Returns NULL, without moving, if there is no such
+ * object there.
+ */
+void *txnin_pop_object(translated_data_t *txnin, uint32_t type) {
+  binder_size_t pos = txnin->data_ptr - txnin->data;
+  const struct binder_object_header *hdr;
+  size_t size;
+
+  // Skip the objects that were read over as plain data
+  while (txnin->offs_next < txnin->offs_count
+         && txnin->offs[txnin->offs_next] < pos)
+    txnin->offs_next++;
+
+  if (txnin->offs_next == txnin->offs_count
+      || txnin->offs[txnin->offs_next] != pos
+      || txnin->data_avail < sizeof(*hdr))
+    return NULL;
+
+  // The read position is known to be in bounds, which leaves the type and the
+  // room for the object to check
+  hdr = (const struct binder_object_header *)txnin->data_ptr;
+  size = binder_object_size(hdr->type);
+  if ((type && hdr->type != type) | !size | (size > txnin->data_avail))
+    return NULL;
+
+  txnin->offs_next++;
+  return txnin_pop(txnin, size);
 }
 
 uint32_t txnin_pop_handle(translated_data_t *txnin) {
   struct flat_binder_object *fbo;
 
-  fbo = txnin_pop(txnin, sizeof(*fbo));
+  fbo = txnin_pop_object(txnin, BINDER_TYPE_HANDLE);
+  if (!fbo)
+    fbo = txnin_pop_object(txnin, BINDER_TYPE_WEAK_HANDLE);
   if (!fbo)
     return 0;
 
@@ -200,9 +902,135 @@ uint32_t txnin_pop_handle(translated_data_t *txnin) {
 void *txnin_pop_buffer(translated_data_t *txnin) {
   struct binder_buffer_object *bbo;
 
-  bbo = txnin_pop(txnin, sizeof(*bbo));
+  bbo = txnin_pop_object(txnin, BINDER_TYPE_PTR);
   if (!bbo)
     return NULL;
 
   return (void *)bbo->buffer;
 }
+
+/*
+ * Pops a file descriptor, which the receiver owns. Returns -1, without
+ * moving, if there is none at the read position.
+ */
+int txnin_pop_fd(translated_data_t *txnin) {
+  struct binder_fd_object *fdo;
+
+  fdo = txnin_pop_object(txnin, BINDER_TYPE_FD);
+  if (!fdo)
+    return -1;
+
+  return fdo->fd;
+}
+
+/*
+ * Pops an array of file descriptors put with `trdata_put_fd_array`, storing
+ * their count in `*count`. The descriptors are closed by the driver once the
+ * buffer is freed, so they must be duplicated to be kept. Returns NULL,
+ * without moving, if there is no such array at the read position.
+ */
+const int *txnin_pop_fd_array(translated_data_t *txnin, size_t *count) {
+  translated_data_t saved = *txnin;
+  struct binder_buffer_object *bbo;
+  struct binder_fd_array_object *fda;
+
+  bbo = txnin_pop_object(txnin, BINDER_TYPE_PTR);
+  fda = bbo ? txnin_pop_object(txnin, BINDER_TYPE_FDA) : NULL;
+  if (!fda || fda->parent != txnin->offs_next - 2 || fda->parent_offset
+      || bbo->length / sizeof(int) < fda->num_fds) {
+    *txnin = saved;
+    return NULL;
+  }
+
+  *count = fda->num_fds;
+  return (const int *)(uintptr_t)bbo->buffer;
+}
+
+/*
+ * Maps a memfd blob of `size` bytes read-only, provided that it is sealed
+ * against writes and shrinking, so that the view can neither change nor fault.
+ */
+static int txnin_blob_map(int fd, uint64_t size, txnin_blob_t *blob) {
+  struct stat st;
+  int seals;
+  void *map;
+
+  seals = fcntl(fd, F_GET_SEALS);
+  if (seals < 0 || (seals & (F_SEAL_WRITE | F_SEAL_SHRINK))
+                       != (F_SEAL_WRITE | F_SEAL_SHRINK)) {
+    ERR("Blob memfd is not sealed");
+    return -1;
+  }
+
+  if (fstat(fd, &st) < 0 || !size || size > (uint64_t)st.st_size
+      || size > SIZE_MAX) {
+    ERR("Blob memfd does not match its size");
+    return -1;
+  }
+
+  map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    ERR("Failed to map blob memfd");
+    return -1;
+  }
+
+  blob->data = map;
+  blob->size = size;
+  blob->map = map;
+  blob->map_size = size;
+  return 0;
+}
+
+/*
+ * Pops a blob put with `trdata_put_blob`. Memfd blobs are mapped, and their
+ * descriptor closed, even if mapping fails. Returns 0 on success, or -1,
+ * without moving if the data holds no blob.
+ */
+int txnin_pop_blob(translated_data_t *txnin, txnin_blob_t *blob) {
+  translated_data_t saved = *txnin;
+  const uint8_t *header;
+  uint64_t size;
+  uint32_t tag;
+  int fd, ret;
+
+  header = txnin_pop(txnin, sizeof(tag) + sizeof(size));
+  if (!header)
+    return -1;
+  memcpy(&tag, header, sizeof(tag));
+  memcpy(&size, header + sizeof(tag), sizeof(size));
+
+  if (tag == TRDATA_BLOB_INLINE) {
+    const void *data = NULL;
+
+    if (size <= txnin->data_avail)
+      data = txnin_pop(txnin, size);
+    if (!data) {
+      *txnin = saved;
+      return -1;
+    }
+    blob->data = data;
+    blob->size = size;
+    blob->map = NULL;
+    blob->map_size = 0;
+    return 0;
+  }
+
+  fd = tag == TRDATA_BLOB_MEMFD ? txnin_pop_fd(txnin) : -1;
+  if (fd < 0) {
+    *txnin = saved;
+    return -1;
+  }
+
+  ret = txnin_blob_map(fd, size, blob);
+  close(fd);
+  return ret;
+}
+
+void txnin_blob_release(txnin_blob_t *blob) {
+  if (blob->map)
+    munmap(blob->map, blob->map_size);
+  blob->data = NULL;
+  blob->size = 0;
+  blob->map = NULL;
+  blob->map_size = 0;
+}
@@ -0,0 +1,283 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "unicode.h"
+
+#include <stdbool.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#define REPLACEMENT_CHAR 0xfffd
+
+#if defined(__SSE2__)
+#define VECTOR_SIZE 16
+
+/*
+ * Widens 16 bytes of ASCII, or returns false without writing if any of them
+ * is not ASCII.
+ */
+static inline bool widen_vector(const uint8_t *src, uint16_t *dst) {
+  __m128i v = _mm_loadu_si128((const __m128i *)src);
+
+  if (_mm_movemask_epi8(v))
+    return false;
+  _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+  _mm_storeu_si128((__m128i *)(dst + 8),
+                   _mm_unpackhi_epi8(v, _mm_setzero_si128()));
+  return true;
+}
+
+/*
+ * Narrows 16 units of ASCII, or returns false without writing if any of them
+ * is not ASCII. A NULL `dst` only checks the units.
+ */
+static inline bool narrow_vector(const uint16_t *src, uint8_t *dst) {
+  __m128i a = _mm_loadu_si128((const __m128i *)src);
+  __m128i b = _mm_loadu_si128((const __m128i *)(src + 8));
+  __m128i high = _mm_and_si128(_mm_or_si128(a, b),
+                               _mm_set1_epi16((short)0xff80));
+
+  if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xffff)
+    return false;
+  if (dst)
+    _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(a, b));
+  return true;
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define VECTOR_SIZE 16
+
+static inline bool widen_vector(const uint8_t *src, uint16_t *dst) {
+  uint8x16_t v = vld1q_u8(src);
+
+  if (vmaxvq_u8(v) >= 0x80)
+    return false;
+  vst1q_u16(dst, vmovl_u8(vget_low_u8(v)));
+  vst1q_u16(dst + 8, vmovl_high_u8(v));
+  return true;
+}
+
+static inline bool narrow_vector(const uint16_t *src, uint8_t *dst) {
+  uint16x8_t a = vld1q_u16(src);
+  uint16x8_t b = vld1q_u16(src + 8);
+
+  if (vmaxvq_u16(vorrq_u16(a, b)) >= 0x80)
+    return false;
+  if (dst)
+    vst1q_u8(dst, vcombine_u8(vmovn_u16(a), vmovn_u16(b)));
+  return true;
+}
+#endif
+
+/*
+ * Widens the leading run of ASCII bytes of `src`, a vector at a time, and
+ * returns how many bytes were converted. What remains, from the vector
+ * holding the first non-ASCII byte, is left to the scalar path.
+ */
+static size_t widen_ascii(const uint8_t *src, size_t len, uint16_t *dst) {
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    if (_mm256_movemask_epi8(v))
+      break;
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+    _mm256_storeu_si256((__m256i *)(dst + i + 16),
+                        _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+  }
+#endif
+#ifdef VECTOR_SIZE
+  for (; i + VECTOR_SIZE <= len; i += VECTOR_SIZE) {
+    if (!widen_vector(src + i, dst + i))
+      return i;
+  }
+
+  // Finish with a vector overlapping what was already widened, rather than
+  // a byte at a time
+  if (i < len && len >= VECTOR_SIZE
+      && widen_vector(src + len - VECTOR_SIZE, dst + len - VECTOR_SIZE))
+    i = len;
+#endif
+
+  return i;
+}
+
+/*
+ * Narrows the leading run of ASCII units of `src`, a vector at a time, and
+ * returns how many units were converted, like `widen_ascii`. With a NULL
+ * `dst`, the run is only measured.
+ */
+static size_t narrow_ascii(const uint16_t *src, size_t len, uint8_t *dst) {
+  size_t i = 0;
+
+#ifdef VECTOR_SIZE
+  for (; i + VECTOR_SIZE <= len; i += VECTOR_SIZE) {
+    if (!narrow_vector(src + i, dst ? dst + i : NULL))
+      return i;
+  }
+
+  if (i < len && len >= VECTOR_SIZE
+      && narrow_vector(src + len - VECTOR_SIZE,
+                       dst ? dst + len - VECTOR_SIZE : NULL))
+    i = len;
+#endif
+
+  return i;
+}
+
+/*
+ * Decodes the multi-byte sequence at `src`, which starts with a non-ASCII
+ * byte. Returns the code point, or -1 for an invalid sequence, and stores
+ * the length of the sequence in `*seq_len`.
+ */
+static int32_t decode_utf8(const uint8_t *src, size_t len, size_t *seq_len) {
+  uint8_t c = src[0];
+  int32_t cp, min;
+  size_t i, n;
+
+  if (c >= 0xc2 && c <= 0xdf) {
+    n = 2, cp = c & 0x1f, min = 0x80;
+  } else if (c >= 0xe0 && c <= 0xef) {
+    n = 3, cp = c & 0x0f, min = 0x800;
+  } else if (c >= 0xf0 && c <= 0xf4) {
+    n = 4, cp = c & 0x07, min = 0x10000;
+  } else {
+    return -1;
+  }
+
+  if (n > len)
+    return -1;
+
+  for (i = 1; i < n; i++) {
+    if ((src[i] & 0xc0) != 0x80)
+      return -1;
+    cp = (cp << 6) | (src[i] & 0x3f);
+  }
+
+  if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+    return -1;
+
+  *seq_len = n;
+  return cp;
+}
+
+size_t utf8_to_utf16(const char *src, size_t len, uint16_t *dst) {
+  const uint8_t *s = (const uint8_t *)src;
+  size_t i = 0, o = 0, n, ascii;
+  int32_t cp;
+
+  while (i < len) {
+    ascii = widen_ascii(s + i, len - i, dst + o);
+    i += ascii;
+    o += ascii;
+    // The vector loop stops short of a non-ASCII byte by less than a vector,
+    // which is left to a tight loop
+    while (i < len && s[i] < 0x80)
+      dst[o++] = s[i++];
+    if (i == len)
+      break;
+
+    cp = decode_utf8(s + i, len - i, &n);
+    if (cp < 0) {
+      dst[o++] = REPLACEMENT_CHAR;
+      i++;
+    } else if (cp < 0x10000) {
+      dst[o++] = cp;
+      i += n;
+    } else {
+      cp -= 0x10000;
+      dst[o++] = 0xd800 | (cp >> 10);
+      dst[o++] = 0xdc00 | (cp & 0x3ff);
+      i += n;
+    }
+  }
+
+  return o;
+}
+
+static bool is_surrogate_pair(const uint16_t *src, size_t len) {
+  return len >= 2 && (src[0] & 0xfc00) == 0xd800
+         && (src[1] & 0xfc00) == 0xdc00;
+}
+
+size_t utf16_to_utf8_length(const uint16_t *src, size_t len) {
+  size_t i = 0, o = 0, ascii;
+  uint16_t c;
+
+  while (i < len) {
+    ascii = narrow_ascii(src + i, len - i, NULL);
+    i += ascii;
+    o += ascii;
+    while (i < len && src[i] < 0x80)
+      o++, i++;
+    if (i == len)
+      break;
+
+    c = src[i];
+    if (c < 0x800) {
+      o += 2, i += 1;
+    } else if (is_surrogate_pair(src + i, len - i)) {
+      o += 4, i += 2;
+    } else {
+      o += 3, i += 1;
+    }
+  }
+
+  return o;
+}
+
+size_t utf16_to_utf8(const uint16_t *src, size_t len, char *dst) {
+  uint8_t *d = (uint8_t *)dst;
+  size_t i = 0, o = 0, ascii;
+  uint32_t c;
+
+  while (i < len) {
+    ascii = narrow_ascii(src + i, len - i, d + o);
+    i += ascii;
+    o += ascii;
+    while (i < len && src[i] < 0x80)
+      d[o++] = src[i++];
+    if (i == len)
+      break;
+
+    c = src[i++];
+    if (c < 0x800) {
+      d[o++] = 0xc0 | (c >> 6);
+      d[o++] = 0x80 | (c & 0x3f);
+    } else {
+      if (is_surrogate_pair(src + i - 1, len - i + 1)) {
+        c = 0x10000 + ((c & 0x3ff) << 10) + (src[i++] & 0x3ff);
+        d[o++] = 0xf0 | (c >> 18);
+        d[o++] = 0x80 | ((c >> 12) & 0x3f);
+      } else {
+        if ((c & 0xf800) == 0xd800)
+          c = REPLACEMENT_CHAR;
+        d[o++] = 0xe0 | (c >> 12);
+      }
+      d[o++] = 0x80 | ((c >> 6) & 0x3f);
+      d[o++] = 0x80 | (c & 0x3f);
+    }
+  }
+
+  return o;
+}
@@ -0,0 +1,164 @@
+/*
+ * Copyright 2024 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Prints a trace written by `binder_trace_dump` in time order, one command
+ * per line: time since the start of the trace, thread, command and, for
+ * transactions, target, code, flags and sizes.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <linux/android/binder.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define CMD_NAME(cmd) [_IOC_NR(cmd)] = #cmd
+
+static const char *const bc_names[32] = {
+    CMD_NAME(BC_TRANSACTION),
+    CMD_NAME(BC_REPLY),
+    CMD_NAME(BC_ACQUIRE_RESULT),
+    CMD_NAME(BC_FREE_BUFFER),
+    CMD_NAME(BC_INCREFS),
+    CMD_NAME(BC_ACQUIRE),
+    CMD_NAME(BC_RELEASE),
+    CMD_NAME(BC_DECREFS),
+    CMD_NAME(BC_INCREFS_DONE),
+    CMD_NAME(BC_ACQUIRE_DONE),
+    CMD_NAME(BC_ATTEMPT_ACQUIRE),
+    CMD_NAME(BC_REGISTER_LOOPER),
+    CMD_NAME(BC_ENTER_LOOPER),
+    CMD_NAME(BC_EXIT_LOOPER),
+    CMD_NAME(BC_REQUEST_DEATH_NOTIFICATION),
+    CMD_NAME(BC_CLEAR_DEATH_NOTIFICATION),
+    CMD_NAME(BC_DEAD_BINDER_DONE),
+    CMD_NAME(BC_TRANSACTION_SG),
+    CMD_NAME(BC_REPLY_SG),
+};
+
+static const char *const br_names[32] = {
+    CMD_NAME(BR_ERROR),
+    CMD_NAME(BR_OK),
+    CMD_NAME(BR_TRANSACTION),
+    CMD_NAME(BR_REPLY),
+    CMD_NAME(BR_ACQUIRE_RESULT),
+    CMD_NAME(BR_DEAD_REPLY),
+    CMD_NAME(BR_TRANSACTION_COMPLETE),
+    CMD_NAME(BR_INCREFS),
+    CMD_NAME(BR_ACQUIRE),
+    CMD_NAME(BR_RELEASE),
+    CMD_NAME(BR_DECREFS),
+    CMD_NAME(BR_ATTEMPT_ACQUIRE),
+    CMD_NAME(BR_NOOP),
+    CMD_NAME(BR_SPAWN_LOOPER),
+    CMD_NAME(BR_FINISHED),
+    CMD_NAME(BR_DEAD_BINDER),
+    CMD_NAME(BR_CLEAR_DEATH_NOTIFICATION_DONE),
+    CMD_NAME(BR_FAILED_REPLY),
+};
+
+static const char *cmd_name(uint32_t cmd) {
+  const char *const *names = _IOC_TYPE(cmd) == 'c' ? bc_names : br_names;
+  const char *name = names[_IOC_NR(cmd) % 32];
+
+  return name ? name : "?";
+}
+
+static int compare_events(const void *a, const void *b) {
+  const binder_trace_event_t *x = *(binder_trace_event_t *const *)a;
+  const binder_trace_event_t *y = *(binder_trace_event_t *const *)b;
+
+  if (x->ticks != y->ticks)
+    return x->ticks < y->ticks ? -1 : 1;
+  // Commands of one buffer share a timestamp, so keep their file order
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+  binder_trace_header_t header;
+  binder_trace_event_t *events, **order, *ev;
+  double ns_per_tick = 1;
+  struct stat st;
+  uint64_t first;
+  uint32_t i;
+  FILE *f;
+
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <trace>\n", argv[0]);
+    return 1;
+  }
+
+  f = fopen(argv[1], "rb");
+  if (!f) {
+    fprintf(stderr, "Failed to open %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+
+  if (fread(&header, sizeof(header), 1, f) != 1
+      || header.magic != BINDER_TRACE_MAGIC
+      || header.version != BINDER_TRACE_VERSION
+      || header.event_size != sizeof(binder_trace_event_t)) {
+    fprintf(stderr, "%s is not a supported trace\n", argv[1]);
+    return 1;
+  }
+
+  // The file must hold every event before they are allocated for
+  if (fstat(fileno(f), &st) < 0
+      || header.count > (st.st_size - sizeof(header)) / sizeof(*events)) {
+    fprintf(stderr, "%s is truncated\n", argv[1]);
+    return 1;
+  }
+
+  events = calloc((size_t)header.count + 1, sizeof(*events));
+  order = calloc((size_t)header.count + 1, sizeof(*order));
+  if (!events || !order || fread(events, sizeof(*events), header.count, f)
+                     != header.count) {
+    fprintf(stderr, "Failed to read %u events\n", header.count);
+    return 1;
+  }
+  fclose(f);
+
+  if (header.ticks1 > header.ticks0)
+    ns_per_tick =
+        (double)(header.ns1 - header.ns0) / (header.ticks1 - header.ticks0);
+
+  // Sort pointers so that `compare_events` can break ties on file order
+  for (i = 0; i < header.count; i++)
+    order[i] = &events[i];
+  qsort(order, header.count, sizeof(*order), compare_events);
+
+  first = header.count ? order[0]->ticks : 0;
+  printf("%14s %7s %-34s %18s %10s %6s %8s %8s\n", "time(us)", "tid",
+         "command", "target", "code", "flags", "data", "offsets");
+  for (i = 0; i < header.count; i++) {
+    ev = order[i];
+    printf("%14.3f %7u %-34s %#18llx", (ev->ticks - first) * ns_per_tick / 1000,
+           ev->tid, cmd_name(ev->cmd), (unsigned long long)ev->target);
+    if (ev->data_size || ev->offsets_size || ev->code || ev->flags)
+      printf(" %#10x %#6x %8u %8u", ev->code, ev->flags, ev->data_size,
+             ev->offsets_size);
+    printf("\n");
+  }
+
+  free(order);
+  free(events);
+  return 0;
+}